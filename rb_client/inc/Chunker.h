@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <vector>
+
+#define RB_CDC_MIN_SIZE (16 * 1024)
+#define RB_CDC_AVG_SIZE (64 * 1024)
+#define RB_CDC_MAX_SIZE (256 * 1024)
+
+// FastCDC content-defined chunker: the cut points depend only on the bytes around
+// them (gear rolling hash), so an edit moves only the boundaries next to it and the
+// rest of the file keeps producing the same chunks.
+// Normalized chunking: a stricter mask before the average size and a looser one after,
+// to keep the chunk sizes close to the average.
+class Chunker {
+public:
+    Chunker();
+
+    // Length of the first chunk of data (len bytes available, the last chunk if len <= max)
+    size_t cut(const unsigned char *data, size_t len) const;
+
+    // Splits the whole stream, calling on_chunk(offset, data, size) for every chunk in order
+    // It throws a runtime error on read errors
+    void split(std::istream &is,
+               const std::function<void(uint64_t, const char *, size_t)> &on_chunk) const;
+
+private:
+    uint64_t mask_small;
+    uint64_t mask_large;
+};
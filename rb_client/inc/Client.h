@@ -1,65 +1,147 @@
 #pragma once
 
-#include <boost/asio.hpp>
-
+#include <chrono>
+#include <deque>
 #include <functional>
-#include <mutex>
+#include <memory>
 #include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
 
-#include "AsioAdapting.h"
+#include "Compression.h"
 #include "ProtobufHelpers.h"
 #include "RBHelpers.h"
 #include "rbproto.pb.h"
 
+using boost::asio::awaitable;
+using boost::asio::ip::tcp;
+
+class Client;
 class ProtoChannel;
 
+// Channels kept open between requests and shared by all of them. Idle channels are
+// checked before being handed out, kept alive with NOPs and closed when they exceed
+// max_idle or haven't been used for idle_timeout. It's only used from the io_context thread
+class ChannelPool {
+public:
+    ChannelPool(Client &client, size_t max_idle, std::chrono::seconds idle_timeout,
+                std::chrono::seconds keepalive_interval);
+    ChannelPool(const ChannelPool &) = delete;
+
+    // The most recently used healthy idle channel, or a new one
+    awaitable<std::shared_ptr<ProtoChannel>> acquire();
+    // Gives a channel back to the pool, if it can still be used
+    void release(std::shared_ptr<ProtoChannel> pc);
+    // Keeps the idle channels alive and closes the expired ones, until close
+    awaitable<void> maintain();
+    // Closes every idle channel, the ones released later are closed as well
+    awaitable<void> close();
+
+private:
+    struct idle_channel {
+        std::shared_ptr<ProtoChannel> pc;
+        std::chrono::steady_clock::time_point last_use;
+        std::chrono::steady_clock::time_point last_keepalive;
+    };
+
+    Client &client;
+    size_t max_idle;
+    std::chrono::steady_clock::duration idle_timeout;
+    // zero disables the keep-alive NOPs
+    std::chrono::steady_clock::duration keepalive_interval;
+    std::vector<idle_channel> idle_channels;
+    bool closed = false;
+
+    // Sends a NOP closing the channel, for the server to close its end as well
+    awaitable<void> close_channel(std::shared_ptr<ProtoChannel> pc);
+};
+
+// Connections to the server are made by coroutines, on the io_context they run on
 class Client {
 public:
     Client(
         const std::string & ip,
         const std::string & port,
-        int protochan_pool_max_n
+        size_t pool_max_idle,
+        std::chrono::seconds pool_idle_timeout,
+        std::chrono::seconds pool_keepalive_interval
     );
 
-    RBResponse run(RBRequest &);
+    // Sends a request on a channel borrowed from the pool. It's sent again on a new
+    // channel if a pooled one turns out to be broken, only idempotent requests can be run
+    awaitable<RBResponse> run(RBRequest &);
 
-    std::shared_ptr<ProtoChannel> open_channel();
-    void authenticate(std::string, std::string);
+    awaitable<std::shared_ptr<ProtoChannel>> open_channel();
+    ChannelPool &channel_pool() { return pool; }
+    awaitable<void> authenticate(std::string, std::string);
+    // Tells if an optional RBProto feature has been agreed with the server
+    bool has_capability(RBCapability) const;
+    // Best segment compression codec supported by both ends, COMP_NONE if there's none
+    RBCompression preferred_compression() const;
 
 private:
-    friend class ProtoChannel;
-    boost::asio::ip::tcp::resolver::iterator endpoints;
-    boost::system::error_code ec;
-    boost::asio::io_service io_service;
+    tcp::resolver::results_type endpoints;
     std::string token;
+    std::unordered_set<int> capabilities;
+    ChannelPool pool;
 };
 
-using boost::asio::ip::tcp;
-
-class ProtoChannel : public std::enable_shared_from_this<ProtoChannel> {
+// A connection to the server. It's used by one coroutine at a time, which suspends
+// while its requests and responses are in transit
+class ProtoChannel {
 public:
+    ProtoChannel(tcp::socket socket, std::string &token);
     ProtoChannel(const ProtoChannel &) = delete;
 
-    ProtoChannel(ProtoChannel &&) = default;
-
     ~ProtoChannel();
 
-    RBResponse run(RBRequest &, bool do_try = false);
+    awaitable<RBResponse> run(RBRequest &);
 
-    void close();
+    // Pipelining: send doesn't wait for the response, receive collects the responses
+    // in the order of their requests. run can't be used while some are in flight
+    awaitable<uint64_t> send(RBRequest &);
+    awaitable<RBResponse> receive();
+    size_t in_flight() const;
 
-    ProtoChannel(tcp::resolver::iterator &, boost::asio::io_service &, std::string &, Client &);
+    void close();
 
-    bool is_open();
+    bool is_open() const;
+    // Open, not closed by the server and with no unexpected data to read, for idle channels
+    bool is_healthy();
 
 private:
-    friend class Client;
-    Client & client;
+    awaitable<void> write(RBRequest &);
+    awaitable<RBResponse> read();
+
     tcp::socket socket;
-    AsioInputStream<tcp::socket> ais;
-    CopyingInputStreamAdaptor cis_adp;
-    AsioOutputStream<tcp::socket> aos;
-    CopyingOutputStreamAdaptor cos_adp;
-    std::mutex mutex;
+    boost::asio::streambuf in_buf;
+    // the serialized request, reused from request to request
+    std::string out_buf;
     std::string & token;
+    uint64_t last_seq = 0;
+    std::deque<uint64_t> pending;
+};
+
+// Sends requests of the same type on a channel keeping up to window of them in flight,
+// validating the responses. If some are still in flight when it's destroyed, after an
+// exception, the channel is closed
+class PipelinedSender {
+public:
+    PipelinedSender(std::shared_ptr<ProtoChannel> channel, size_t window, RBMsgType type);
+    ~PipelinedSender();
+    PipelinedSender(const PipelinedSender &) = delete;
+    PipelinedSender &operator=(const PipelinedSender &) = delete;
+
+    // Waits for the oldest response when the window is full. It throws an RBException if it's an error
+    awaitable<void> send(RBRequest &req);
+    // Waits for every response in flight
+    awaitable<void> flush();
+
+private:
+    std::shared_ptr<ProtoChannel> channel;
+    size_t window;
+    RBMsgType type;
 };
@@ -1,25 +1,44 @@
 #pragma once
+#include "Chunker.h"
 #include "Client.h"
+#include "Delta.h"
 #include "OutputQueue.h"
+#include "RestoreFile.h"
 #include <mutex>
+#include <semaphore>
+#include <type_traits>
+#include <unordered_set>
 
-#define PROTOCHANNEL_POOL_TIMEOUT_SECS 5
+// Files at least this large are uploaded by chunks, when the server supports it
+#define RB_CHUNKED_UPLOAD_MIN_SIZE (8 * RB_MAX_SEGMENT_SIZE)
+// Chunk references sent in a single CHUNK_OFFER or UPLOAD message
+#define RB_CHUNK_REFS_PER_MESSAGE 4096
+// Files at least this large are first offered by content hash, to skip uploading contents the server holds
+#define RB_OBJECT_LINK_MIN_SIZE (64 * 1024)
+// Files at least this large are uploaded as a delta against the server's version, when it has one
+#define RB_DELTA_UPLOAD_MIN_SIZE RB_MAX_SEGMENT_SIZE
+// Delta operations sent in a single UPLOAD message
+#define RB_DELTA_OPS_PER_MESSAGE 4096
+// Files at least this large are spread over upload_stripes channels, when the server supports it
+#define RB_STRIPED_UPLOAD_MIN_SIZE (64 * RB_MAX_SEGMENT_SIZE)
+// Consecutive segments of a file that don't compress before sending the rest of it raw
+#define RB_COMPRESSION_MAX_MISSES 2
+// Files asked for in each PROBE page, when the server supports it
+#define RB_PROBE_PAGE_SIZE 16384
 
 class ClientFlow {
 private:
-    class ClientFlowConsumer {
+    // The channel of a transfer, taken from the client's pool when it's first needed and
+    // given back when the transfer ends, if it's still usable
+    class ChannelLease {
     private:
-        std::thread sender;
+        ClientFlow &flow;
         std::shared_ptr<ProtoChannel> pc;
-        Client &client;
-        std::chrono::system_clock::time_point last_use;
-        std::mutex m;
-        void clear_protochannel();
     public:
-        ClientFlowConsumer(Client &, std::function<void(ClientFlowConsumer&)>);
-        std::shared_ptr<ProtoChannel> get_protochannel();
-        void clean_protochannel();
-        void join();
+        explicit ChannelLease(ClientFlow &);
+        ~ChannelLease();
+        ChannelLease(const ChannelLease &) = delete;
+        awaitable<std::shared_ptr<ProtoChannel>> get_protochannel();
     };
 
     Client client;
@@ -31,13 +50,46 @@ private:
     bool restore_from_server;
     fs::path root_path;
 
-    int senders_pool_n;
+    // requests in flight per channel during uploads, when the server supports pipelining
+    int upload_window;
+    size_t upload_window_size() const;
+    // channels a large file is spread over, when the server supports it
+    int upload_stripes;
+    // files restored at the same time, and channels the segments of each one are requested on
+    int restore_files;
+    int restore_segments;
 
     std::thread watcher_thread;
     void watcher_loop();
 
-    std::vector<std::unique_ptr<ClientFlowConsumer>> senders_pool;
-    void sender_loop(ClientFlowConsumer &cfc);
+    // Transfers are coroutines on io_context, its thread only waits for the network.
+    // The blocking file work they do is run on disk_pool
+    int max_transfers;
+    std::counting_semaphore<> transfer_slots;
+    std::thread dispatcher_thread;
+    void dispatcher_loop();
+    awaitable<void> transfer(std::shared_ptr<FileOperation> file_operation);
+
+    boost::asio::io_context io_context;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> io_work;
+    std::thread io_thread;
+    boost::asio::thread_pool disk_pool;
+
+    // Runs f on disk_pool, the calling coroutine resumes when it's done
+    template <typename F>
+    awaitable<std::invoke_result_t<F>> on_disk(F f) {
+        co_return co_await boost::asio::co_spawn(
+            disk_pool,
+            [&f]() -> awaitable<std::invoke_result_t<F>> { co_return f(); },
+            boost::asio::use_awaitable);
+    }
+    // Runs the coroutines concurrently, returning when they're all done. The first exception is rethrown
+    awaitable<void> run_concurrently(std::vector<std::function<awaitable<void>()>> tasks);
+    // Runs a coroutine on io_context from another thread, waiting for its result
+    template <typename T>
+    T run_on_io(awaitable<T> task) {
+        return boost::asio::co_spawn(io_context, std::move(task), boost::asio::use_future).get();
+    }
 
     std::atomic<bool> keep_going = true;
     std::mutex waiter;
@@ -46,12 +98,31 @@ private:
     const int max_attempts = 5;
     std::atomic<int> attempt_count = 0;
 
-    std::unordered_map<std::string, file_metadata> get_server_state();
-    void get_server_files(const std::unordered_map<std::string, file_metadata>&);
-    bool upload_file(const std::shared_ptr<FileOperation> &file_operationh, ClientFlowConsumer &cfc);
-    void remove_file(const std::shared_ptr<FileOperation> &file_operation, ClientFlowConsumer &cfc);
-
-    std::thread watchdog;
+    // Adds to page the server's files after the path after, sorted, and moves after to the last one.
+    // False if there are no more (CAP_PAGED_PROBE), older servers send them all at once
+    awaitable<bool> get_server_page(std::string &after, file_page_t &page);
+    // Fills the next page of the server's files from another thread, false after the last one
+    std::function<bool(file_page_t &)> server_pages();
+    // Listings of the directories of the request that differ on the server (CAP_TREE_PROBE)
+    awaitable<RBTreeResponse> get_server_tree(const RBTreeRequest &tree_request);
+    awaitable<void> get_server_files(const file_page_t &);
+    awaitable<void> restore_file(const std::string &file_path, const file_metadata &metadata);
+    awaitable<bool> upload_file(const std::shared_ptr<FileOperation> &file_operationh, ChannelLease &channel);
+    awaitable<void> upload_segments(const std::shared_ptr<FileOperation> &file_operation, std::ifstream &fl,
+                                    size_t file_size, time_t last_write_time, ChannelLease &channel);
+    // Content-defined chunks, only the ones the server doesn't have are sent (CAP_CHUNKED_UPLOAD)
+    awaitable<void> upload_chunks(const std::shared_ptr<FileOperation> &file_operation, std::ifstream &fl,
+                                  size_t file_size, time_t last_write_time, ChannelLease &channel);
+    // Segments written in parallel at their offsets, from several channels (CAP_STRIPED_UPLOAD)
+    awaitable<void> upload_striped(const std::shared_ptr<FileOperation> &file_operation, size_t file_size,
+                                   time_t last_write_time, ChannelLease &channel);
+    // Stores the file as content the server already holds (CAP_OBJECT_LINK), false if it doesn't
+    awaitable<bool> link_file(const std::shared_ptr<FileOperation> &file_operation, std::ifstream &fl,
+                              size_t file_size, time_t last_write_time, ChannelLease &channel);
+    // rsync-style delta against the server's version (CAP_DELTA_UPLOAD), false if there's none
+    awaitable<bool> upload_delta(const std::shared_ptr<FileOperation> &file_operation, std::ifstream &fl,
+                                 size_t file_size, time_t last_write_time, ChannelLease &channel);
+    awaitable<void> remove_file(const std::shared_ptr<FileOperation> &file_operation, ChannelLease &channel);
 
 public:
     ClientFlow(
@@ -62,7 +133,19 @@ public:
         const std::string &password,
         bool restore_from_server,
         std::chrono::system_clock::duration watcher_interval,
-        int senders_pool_n
+        WatcherMode watcher_mode,
+        const std::string &index_path,
+        int scan_threads,
+        uint64_t scan_inflight_bytes,
+        int max_transfers,
+        int disk_threads,
+        int upload_window,
+        int upload_stripes,
+        int restore_files,
+        int restore_segments,
+        size_t pool_max_idle,
+        std::chrono::seconds pool_idle_timeout,
+        std::chrono::seconds pool_keepalive_interval
     );
 
     void stop();
@@ -1,17 +1,28 @@
 #include <boost/filesystem.hpp>
-#include <boost/crc.hpp>
 #include <iostream>
 #include <vector>
 #include <chrono>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <mutex>
 #include <string>
 #include <functional>
 
 #include "RBHelpers.h"
+#include "ScanIndex.h"
+#include "ScanPipeline.h"
 
 namespace fs = boost::filesystem;
 
+// Directories asked for in each TREE request, when the server supports it
+#define RB_TREE_DIRS_PER_REQUEST 256
+
+enum class WatcherMode {
+    POLLING = 0,
+    INOTIFY = 1,
+};
+
 enum class FileStatus {
     CREATED = 0,
     MODIFIED = 1,
@@ -23,27 +34,62 @@ struct file_metadata {
     uint32_t checksum;
     size_t size;
     time_t last_write_time;
+    // strong_hash of the content, empty if it wasn't calculated
+    std::string object_hash;
 };
 
+// Files by relative path, a page of the server's ones sorted by path
+typedef std::vector<std::pair<std::string, file_metadata>> file_page_t;
+
 
 class FileManager {
     fs::path path_to_watch;
     std::chrono::system_clock::duration update_interval;
+    WatcherMode mode;
     std::unordered_map<std::string, file_metadata> files;
+    ScanIndex index;
+    ScanPipeline pipeline;
+    std::mutex scan_mutex;   // guards files and index while a scan is running
+    std::chrono::system_clock::time_point last_index_save;
     std::atomic<bool> running = true;
+    uint64_t object_hash_min_size = 0;
     template<typename Map>
     bool contains(const Map& map, const std::string &key) {
         auto it = map.find(key);
         return it != map.end();
     }
+    bool is_watched_file(const fs::path &path);
+    void save_index(bool force);
+    bool known_checksum(const std::string &file_path, const file_stat &st, uint32_t &checksum, std::string &object_hash);
+    void update_file(const std::string &file_path, const file_stat &st, uint32_t checksum, const std::string &object_hash,
+                     const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action);
+    void check_removed(const fs::path &path, const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action);
+    void scan(const std::vector<fs::path> &dirs, const std::vector<fs::path> &single_files,
+              std::unordered_set<std::string> *seen,
+              const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action);
+    void polling_scan(const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action);
+    void monitor_polling(const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action);
+    void monitor_inotify(const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action);
 
 public:
-    FileManager(fs::path path, std::chrono::system_clock::duration delay);
+    FileManager(fs::path path, std::chrono::system_clock::duration delay, WatcherMode mode, fs::path index_path,
+                int scan_threads, uint64_t scan_inflight_bytes);
     void start_monitoring(const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action);
     void stop_monitoring();
+    // The files of at least min_size bytes get their object hash as they're scanned, 0 for none.
+    // Set before the initial scan
+    void hash_objects(uint64_t min_size);
     void initial_scan();
+    // Compares the files with the server's, which next_page gives in pages sorted by path.
+    // It returns false when there are no more
     void file_system_compare(
-        const std::unordered_map<std::string, file_metadata>& map,
+        const std::function<bool(file_page_t&)>& next_page,
+        const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action
+    );
+    // Compares the files with the server's by their Merkle trees (CAP_TREE_PROBE), going down a level
+    // of the directories that differ at a time. fetch sends a TREE request and returns the answer
+    void tree_compare(
+        const std::function<RBTreeResponse(const RBTreeRequest&)>& fetch,
         const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action
     );
 };
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = boost::filesystem;
+
+enum class InotifyChange {
+    UPDATED = 0,         // written or attributes changed
+    GONE = 1,            // deleted or moved out
+    QUEUE_OVERFLOW = 2,  // kernel queue overflowed, events have been lost
+    ADDED = 3,           // created or moved in
+};
+
+struct inotify_change {
+    fs::path path;
+    InotifyChange type;
+    bool is_dir;
+};
+
+// Thin wrapper around a Linux inotify instance that keeps the
+// watch descriptor <-> directory mapping for a whole directory tree.
+// On other platforms the constructor throws and FileManager falls back to polling.
+class InotifyWatcher {
+public:
+    InotifyWatcher();
+    ~InotifyWatcher();
+    InotifyWatcher(const InotifyWatcher &) = delete;
+    InotifyWatcher& operator=(const InotifyWatcher &) = delete;
+
+    // Adds a watch on dir and all of its subdirectories. The directories
+    // actually added are appended to added_dirs (if not null)
+    // It can throw a runtime error if the watch limit is reached
+    void add_watch_recursive(const fs::path &dir, std::vector<fs::path> *added_dirs = nullptr);
+    void remove_watch_recursive(const fs::path &dir);
+
+    // Waits at most timeout_ms for events. Returns false on timeout
+    bool read_changes(std::vector<inotify_change> &changes, int timeout_ms);
+
+private:
+    int fd = -1;
+    std::unordered_map<int, fs::path> wd_paths;
+    std::unordered_map<std::string, int> path_wds;
+    std::vector<char> buffer;
+
+    void add_watch(const fs::path &dir);
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+
+#include "RBHelpers.h"
+
+namespace fs = boost::filesystem;
+
+// Appended to the name of a file being restored, in its directory
+#define RB_RESTORE_SUFFIX ".rbrestore"
+
+// A file being restored. It's created next to path with its final size, preallocated,
+// and the segments are written at their offsets, in whatever order they arrive.
+// It replaces the file at path only once it's complete, it's removed otherwise
+class RestoreFile {
+public:
+    // It throws an RBException if the file can't be created
+    RestoreFile(const fs::path &path, uint64_t size);
+    RestoreFile(const RestoreFile &) = delete;
+    ~RestoreFile();
+
+    // It throws an RBException if the data can't be written
+    void write_at(uint64_t offset, const char *data, size_t size);
+    // Moves the restored file to path. It throws an RBException if it can't
+    void commit();
+
+private:
+    int fd;
+    fs::path path;
+    fs::path tmp_path;
+};
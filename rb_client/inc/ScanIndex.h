@@ -0,0 +1,65 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+namespace fs = boost::filesystem;
+
+// Identity of a file on disk: if none of these changed, the content didn't either
+struct file_stat {
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+
+    bool operator==(const file_stat &other) const {
+        return inode == other.inode && size == other.size &&
+               mtime_ns == other.mtime_ns && ctime_ns == other.ctime_ns;
+    }
+    bool operator!=(const file_stat &other) const { return !(*this == other); }
+
+    time_t mtime() const;
+};
+
+// Returns false if the file can't be stat'ed (e.g. removed in the meantime)
+bool get_file_stat(const fs::path &path, file_stat &st);
+
+
+// On-disk cache of the checksums calculated by the watcher, keyed by path, with the
+// strong_hash of the files whose hash was asked for (object_hash, empty otherwise).
+// It lets the client skip rehashing the files that didn't change between two runs.
+// File layout (native endianness):
+//   header: magic[8] | version u32 | entries u64
+//   entry:  path_len u32 | inode u64 | size u64 | mtime_ns i64 | ctime_ns i64 | checksum u32 |
+//           hash_len u8 | path | object_hash
+class ScanIndex {
+public:
+    explicit ScanIndex(fs::path index_path);
+
+    // A missing or corrupted index is not an error: all files will simply be hashed again
+    void load();
+    // Written to a temporary file and renamed, so a crash never leaves a truncated index
+    void save();
+    bool is_dirty() const { return dirty; }
+
+    // Gives the cached checksum if the file didn't change since it was indexed
+    bool lookup(const std::string &path, const file_stat &st, uint32_t &checksum, std::string &object_hash) const;
+    void update(const std::string &path, const file_stat &st, uint32_t checksum, const std::string &object_hash);
+    void remove(const std::string &path);
+    // Drops the entries for which is_stale returns true
+    void prune(const std::function<bool(const std::string &)> &is_stale);
+
+private:
+    struct index_entry {
+        file_stat stat;
+        uint32_t checksum;
+        std::string object_hash;
+    };
+
+    fs::path index_path;
+    std::unordered_map<std::string, index_entry> entries;
+    bool dirty = false;
+};
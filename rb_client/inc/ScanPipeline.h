@@ -0,0 +1,41 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "ScanIndex.h"
+
+namespace fs = boost::filesystem;
+
+// Multi-stage scanner:
+//   1. a few threads enumerate directories in parallel and stat the files found
+//   2. the files that can't be resolved by lookup are checksummed by a pool of
+//      hashing workers, limited by the amount of bytes in flight. The large ones
+//      get their object hash (strong_hash) in the same read
+//   3. the results are handed to sink on the calling thread, so the caller
+//      doesn't need to synchronize its own data structures in there
+class ScanPipeline {
+public:
+    // Tells if a file has to be included in the scan
+    typedef std::function<bool(const fs::path &)> filter_t;
+    // Gives the checksum and the object hash of a file without reading it, if known. Called concurrently
+    typedef std::function<bool(const std::string &, const file_stat &, uint32_t &, std::string &)> lookup_t;
+    // Receives every scanned file, with hashed telling if the checksum has just been calculated
+    typedef std::function<void(const std::string &, const file_stat &, uint32_t, const std::string &,
+                               bool hashed)> sink_t;
+
+    ScanPipeline(int hash_workers, uint64_t max_inflight_bytes);
+
+    // Scans recursively every directory in dirs, plus the single files in files. The files
+    // of at least object_hash_min_size bytes are given their object hash too, 0 for none
+    void run(const std::vector<fs::path> &dirs, const std::vector<fs::path> &files, uint64_t object_hash_min_size,
+             const filter_t &filter, const lookup_t &lookup, const sink_t &sink);
+
+private:
+    int hash_workers;
+    int enum_workers;
+    uint64_t max_inflight_bytes;
+};
@@ -0,0 +1,90 @@
+#include "Chunker.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+    // Random values for the gear hash. They are generated from a fixed seed:
+    // changing them moves every cut point and defeats deduplication against old uploads
+    struct gear_table {
+        uint64_t values[256];
+
+        gear_table() {
+            uint64_t state = 0x5262436863686b73ULL;  // splitmix64
+            for (auto &value : values) {
+                uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                value = z ^ (z >> 31);
+            }
+        }
+    };
+
+    const gear_table gear;
+
+    // mask with the given number of the most significant bits set: with the
+    // left-shifting gear hash those are the bits influenced by the most bytes
+    uint64_t high_bits_mask(int bits) {
+        return ~uint64_t(0) << (64 - bits);
+    }
+
+    int log2_floor(uint64_t n) {
+        int bits = 0;
+        while (n >>= 1) bits++;
+        return bits;
+    }
+}
+
+Chunker::Chunker()
+    : mask_small(high_bits_mask(log2_floor(RB_CDC_AVG_SIZE) + 2)),
+      mask_large(high_bits_mask(log2_floor(RB_CDC_AVG_SIZE) - 2)) {}
+
+size_t Chunker::cut(const unsigned char *data, size_t len) const {
+    if (len <= RB_CDC_MIN_SIZE) return len;
+
+    size_t normal = len < RB_CDC_AVG_SIZE ? len : RB_CDC_AVG_SIZE;
+    size_t limit = len < RB_CDC_MAX_SIZE ? len : RB_CDC_MAX_SIZE;
+
+    uint64_t fp = 0;
+    size_t i = RB_CDC_MIN_SIZE;
+    for (; i < normal; i++) {
+        fp = (fp << 1) + gear.values[data[i]];
+        if (!(fp & mask_small)) return i + 1;
+    }
+    for (; i < limit; i++) {
+        fp = (fp << 1) + gear.values[data[i]];
+        if (!(fp & mask_large)) return i + 1;
+    }
+    return limit;
+}
+
+void Chunker::split(std::istream &is,
+                    const std::function<void(uint64_t, const char *, size_t)> &on_chunk) const {
+    std::vector<unsigned char> buffer(RB_CDC_MAX_SIZE * 4);
+    size_t start = 0;
+    size_t end = 0;
+    uint64_t offset = 0;
+    bool eof = false;
+
+    while (true) {
+        // keep at least a max-sized chunk in the buffer, so cut points don't depend on reads
+        if (!eof && end - start < RB_CDC_MAX_SIZE) {
+            std::memmove(&buffer[0], &buffer[start], end - start);
+            end -= start;
+            start = 0;
+
+            is.read(reinterpret_cast<char *>(&buffer[end]), buffer.size() - end);
+            end += is.gcount();
+            if (is.bad()) throw std::runtime_error("Chunker->Error reading file");
+            if (!is) eof = true;
+            continue;
+        }
+
+        if (start == end) break;
+
+        size_t len = cut(&buffer[start], end - start);
+        on_chunk(offset, reinterpret_cast<const char *>(&buffer[start]), len);
+        offset += len;
+        start += len;
+    }
+}
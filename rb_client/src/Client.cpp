@@ -1,108 +1,341 @@
 #include "Client.h"
+
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <exception>
 
 using boost::asio::ip::tcp;
+using boost::asio::use_awaitable;
+using boost::asio::redirect_error;
+
+// optional RBProto features supported by this client
+static const RBCapability supported_capabilities[] = {
+    RBCapability::CAP_CHUNKED_UPLOAD,
+    RBCapability::CAP_DELTA_UPLOAD,
+    RBCapability::CAP_OBJECT_LINK,
+    RBCapability::CAP_PIPELINED_UPLOAD,
+    RBCapability::CAP_STRIPED_UPLOAD,
+    RBCapability::CAP_PAGED_PROBE,
+    RBCapability::CAP_TREE_PROBE,
+};
 
-Client::Client(const std::string &ip, const std::string &port, int n) {
-    tcp::resolver resolver(io_service);
-    tcp::resolver::query query(ip, port);
-    endpoints = resolver.resolve(query);
+Client::Client(const std::string &ip, const std::string &port, size_t pool_max_idle,
+               std::chrono::seconds pool_idle_timeout, std::chrono::seconds pool_keepalive_interval)
+    : pool(*this, pool_max_idle, pool_idle_timeout, pool_keepalive_interval) {
+    boost::asio::io_context io_context;
+    tcp::resolver resolver(io_context);
+    endpoints = resolver.resolve(ip, port);
 }
 
-void Client::authenticate(std::string username, std::string password) {
+awaitable<void> Client::authenticate(std::string username, std::string password) {
     RBRequest req;
     auto authReq = std::make_unique<RBAuthRequest>();
 
     authReq->set_user(username);
     authReq->set_pass(password);
+    for (auto capability : supported_capabilities)
+        authReq->add_capabilities(capability);
+    for (auto codec : available_codecs())
+        authReq->add_capabilities(codec_capability(codec));
 
     req.set_protover(3);
     req.set_type(RBMsgType::AUTH);
     req.set_allocated_auth_request(authReq.release());
 
-    RBResponse res = run(req);
+    RBResponse res = co_await run(req);
 
     validateRBProto(res, RBMsgType::AUTH, 3);
 
     token = res.auth_response().token();
+
+    capabilities.clear();
+    for (auto capability : res.auth_response().capabilities())
+        capabilities.insert(capability);
 }
 
-RBResponse Client::run(RBRequest &req) {
-    req.set_final(true);
-    ProtoChannel chan(endpoints, io_service, token, *this);
-    auto res = chan.run(req);
-    chan.close();
-    return std::move(res);
+bool Client::has_capability(RBCapability capability) const {
+    return capabilities.count(capability) > 0;
 }
 
-std::shared_ptr<ProtoChannel> Client::open_channel() {
-    return std::make_shared<ProtoChannel>(endpoints, io_service, token, *this);
+RBCompression Client::preferred_compression() const {
+    for (auto codec : available_codecs())
+        if (has_capability(codec_capability(codec)))
+            return codec;
+    return RBCompression::COMP_NONE;
 }
 
-RBResponse ProtoChannel::run(RBRequest &req, bool do_try) {
-    if (do_try) {
-        if (!mutex.try_lock()) {
-            throw std::runtime_error("busy_protochannel");
+awaitable<RBResponse> Client::run(RBRequest &req) {
+    req.set_final(false);
+    for (int attempt = 0;; attempt++) {
+        auto chan = co_await pool.acquire();
+        try {
+            auto res = co_await chan->run(req);
+            pool.release(std::move(chan));
+            co_return res;
+        } catch (RBException &e) {
+            // network failures close the channel, the server may have dropped it meanwhile
+            if (attempt > 0 || chan->is_open()) throw;
+            RBLog("Client >> Pooled channel broken, retrying the request on another one");
         }
-    } else {
-        mutex.lock();
     }
+}
+
+awaitable<std::shared_ptr<ProtoChannel>> Client::open_channel() {
+    tcp::socket socket(co_await boost::asio::this_coro::executor);
+    boost::system::error_code ec;
+    co_await boost::asio::async_connect(socket, endpoints, redirect_error(use_awaitable, ec));
+    if (ec) throw RBException("Client->Connection failed");
 
-    std::lock_guard lg(mutex, std::adopt_lock);
+    co_return std::make_shared<ProtoChannel>(std::move(socket), token);
+}
+
+ProtoChannel::ProtoChannel(tcp::socket socket, std::string &token)
+    : socket(std::move(socket)),
+      token(token) {
+    RBLog("Protochannel()");
+}
 
+ProtoChannel::~ProtoChannel() {
+    if (socket.is_open()) {
+        close();
+        RBLog("ProtoChannel closed unexpectedly");
+    }
+    RBLog("~Protochannel()");
+}
+
+awaitable<void> ProtoChannel::write(RBRequest &req) {
     req.set_token(token);
 
-    if (!socket.is_open()) {
-        if (do_try) throw std::runtime_error("closed_protochannel");
-        throw RBException("Client->Socket closed");
+    out_buf.clear();
+    if (!google::protobuf::io::serializeDelimited(req, &out_buf))
+        throw RBException("Client->Request send fail");
+
+    boost::system::error_code ec;
+    co_await boost::asio::async_write(socket, boost::asio::buffer(out_buf), redirect_error(use_awaitable, ec));
+    if (ec) {
+        close();
+        throw RBException("Client->Request send fail");
+    }
+}
+
+awaitable<RBResponse> ProtoChannel::read() {
+    uint32_t size;
+    size_t prefix_size;
+    boost::system::error_code ec;
+    while (!google::protobuf::io::readDelimitedSize(in_buf.data().data(), in_buf.size(), &size, &prefix_size)) {
+        if (in_buf.size() >= 5) {
+            close();
+            throw RBException("Client->Response receive fail");
+        }
+        co_await boost::asio::async_read(socket, in_buf, boost::asio::transfer_at_least(1),
+                                         redirect_error(use_awaitable, ec));
+        if (ec) {
+            close();
+            throw RBException("Client->Response receive fail");
+        }
     }
 
-    bool net_op = google::protobuf::io::writeDelimitedTo(req, &cos_adp);
-    cos_adp.Flush();
-    if (!net_op) throw RBException("Client->Request send fail");
+    size_t frame_size = prefix_size + size;
+    if (in_buf.size() < frame_size) {
+        co_await boost::asio::async_read(socket, in_buf, boost::asio::transfer_at_least(frame_size - in_buf.size()),
+                                         redirect_error(use_awaitable, ec));
+        if (ec) {
+            close();
+            throw RBException("Client->Response receive fail");
+        }
+    }
+
+    RBResponse res;
+    bool net_op = res.ParseFromArray(static_cast<const char *>(in_buf.data().data()) + prefix_size, size);
+    in_buf.consume(frame_size);
+    if (!net_op) {
+        close();
+        throw RBException("Client->Response receive fail");
+    }
+    co_return res;
+}
+
+awaitable<RBResponse> ProtoChannel::run(RBRequest &req) {
+    if (!pending.empty())
+        throw std::logic_error("ProtoChannel->run with pipelined requests in flight");
 
     if (!socket.is_open()) throw RBException("Client->Socket closed");
 
-    RBResponse res;
-    net_op = google::protobuf::io::readDelimitedFrom(&res, &cis_adp);
-    if (!net_op) throw RBException("Client->Response receive fail");
+    co_await write(req);
+    RBResponse res = co_await read();
 
-    if (req.final()) socket.close();
+    if (req.final()) close();
 
-    return res;
+    co_return res;
 }
 
-ProtoChannel::ProtoChannel(
-    tcp::resolver::iterator &endpoints,
-    boost::asio::io_service &io_service,
-    std::string & token,
-    Client & c)
-    : socket(io_service),
-      ais(socket),
-      cis_adp(&ais),
-      aos(socket),
-      cos_adp(&aos),
-      client(c),
-      token(token) {
-    boost::asio::connect(socket, endpoints);
-    if (!socket.is_open()) throw RBException("Client->Connection failed");
+awaitable<uint64_t> ProtoChannel::send(RBRequest &req) {
+    req.set_seq(++last_seq);
 
-    RBLog("Protochannel()");
+    if (!socket.is_open()) throw RBException("Client->Socket closed");
+
+    co_await write(req);
+
+    pending.push_back(last_seq);
+    co_return last_seq;
 }
 
-ProtoChannel::~ProtoChannel() {
-    if (socket.is_open()) {
+awaitable<RBResponse> ProtoChannel::receive() {
+    if (pending.empty()) throw std::logic_error("ProtoChannel->receive without requests in flight");
+
+    auto seq = pending.front();
+    pending.pop_front();
+
+    if (!socket.is_open()) throw RBException("Client->Socket closed");
+
+    RBResponse res = co_await read();
+    if (res.seq() != seq) {
         close();
-        RBLog("ProtoChannel closed unexpectedly");
+        throw RBException("Client->Response out of sequence");
     }
-    RBLog("~Protochannel()");
+
+    co_return res;
+}
+
+size_t ProtoChannel::in_flight() const {
+    return pending.size();
 }
 
 void ProtoChannel::close() {
-    if (socket.is_open()) socket.close();
+    boost::system::error_code ec;
+    if (socket.is_open()) socket.close(ec);
 }
 
-bool ProtoChannel::is_open() {
-    std::lock_guard lg(mutex);
+bool ProtoChannel::is_open() const {
     return socket.is_open();
 }
+
+bool ProtoChannel::is_healthy() {
+    if (!socket.is_open() || !pending.empty()) return false;
+    // an idle channel has nothing to read: either the server closed it or it's out of sync
+    char c;
+    auto res = ::recv(socket.native_handle(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    close();
+    return false;
+}
+
+ChannelPool::ChannelPool(Client &client, size_t max_idle, std::chrono::seconds idle_timeout,
+                         std::chrono::seconds keepalive_interval)
+    : client(client), max_idle(max_idle), idle_timeout(idle_timeout), keepalive_interval(keepalive_interval) {}
+
+awaitable<std::shared_ptr<ProtoChannel>> ChannelPool::acquire() {
+    // the most recently used idle channel, the others may time out
+    while (!idle_channels.empty()) {
+        auto idle = std::move(idle_channels.back());
+        idle_channels.pop_back();
+        if (idle.pc->is_healthy()) co_return idle.pc;
+        RBLog("ChannelPool >> Dropping broken idle channel", LogLevel::DEBUG);
+    }
+    co_return co_await client.open_channel();
+}
+
+void ChannelPool::release(std::shared_ptr<ProtoChannel> pc) {
+    // still held by a transfer (e.g. a pipelined sender), or left with responses to read
+    if (pc.use_count() > 1 || !pc->is_open() || pc->in_flight() > 0) return;
+    if (closed || idle_channels.size() >= max_idle) {
+        pc->close();
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    idle_channels.push_back({std::move(pc), now, now});
+}
+
+awaitable<void> ChannelPool::close_channel(std::shared_ptr<ProtoChannel> pc) {
+    RBRequest nop_req;
+    nop_req.set_type(RBMsgType::NOP);
+    nop_req.set_protover(3);
+    nop_req.set_final(true);
+    try {
+        co_await pc->run(nop_req);
+    } catch (std::exception &e) {
+        pc->close();
+    }
+}
+
+awaitable<void> ChannelPool::maintain() {
+    auto period = keepalive_interval.count() > 0 ? std::min(idle_timeout, keepalive_interval) : idle_timeout;
+    boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+    while (!closed) {
+        timer.expires_after(std::max<std::chrono::steady_clock::duration>(period / 2, std::chrono::seconds(1)));
+        co_await timer.async_wait(use_awaitable);
+
+        auto now = std::chrono::steady_clock::now();
+        std::vector<std::shared_ptr<ProtoChannel>> expired;
+        std::vector<idle_channel> kept, keepalive;
+        for (auto &idle : idle_channels) {
+            if (idle.last_use + idle_timeout <= now)
+                expired.push_back(std::move(idle.pc));
+            else if (keepalive_interval.count() > 0 && idle.last_keepalive + keepalive_interval <= now)
+                keepalive.push_back(std::move(idle));
+            else
+                kept.push_back(std::move(idle));
+        }
+        idle_channels = std::move(kept);
+
+        for (auto &pc : expired) {
+            RBLog("ChannelPool >> Closing unused channel", LogLevel::DEBUG);
+            co_await close_channel(pc);
+        }
+
+        // the channels are out of the pool while their NOP is in flight
+        for (auto &idle : keepalive) {
+            RBRequest nop_req;
+            nop_req.set_type(RBMsgType::NOP);
+            nop_req.set_protover(3);
+            try {
+                auto res = co_await idle.pc->run(nop_req);
+                if (!res.success() || closed) {
+                    co_await close_channel(idle.pc);
+                    continue;
+                }
+            } catch (std::exception &e) {
+                RBLog("ChannelPool >> Keep-alive failed, dropping channel", LogLevel::DEBUG);
+                idle.pc->close();
+                continue;
+            }
+            // keep-alives don't count as uses: the channel keeps its place, ordered by last use
+            idle.last_keepalive = std::chrono::steady_clock::now();
+            auto pos = std::upper_bound(idle_channels.begin(), idle_channels.end(), idle,
+                [](const idle_channel &a, const idle_channel &b) { return a.last_use < b.last_use; });
+            idle_channels.insert(pos, std::move(idle));
+        }
+    }
+}
+
+awaitable<void> ChannelPool::close() {
+    closed = true;
+    auto unused = std::move(idle_channels);
+    idle_channels.clear();
+    for (auto &idle : unused) co_await close_channel(idle.pc);
+}
+
+PipelinedSender::PipelinedSender(std::shared_ptr<ProtoChannel> channel, size_t window, RBMsgType type)
+    : channel(std::move(channel)), window(window ? window : 1), type(type) {}
+
+PipelinedSender::~PipelinedSender() {
+    // the channel can't be used anymore without reading those responses
+    if (channel->in_flight() > 0) channel->close();
+}
+
+awaitable<void> PipelinedSender::send(RBRequest &req) {
+    while (channel->in_flight() >= window) {
+        auto res = co_await channel->receive();
+        validateRBProto(res, type, 3);
+    }
+    co_await channel->send(req);
+}
+
+awaitable<void> PipelinedSender::flush() {
+    while (channel->in_flight() > 0) {
+        auto res = co_await channel->receive();
+        validateRBProto(res, type, 3);
+    }
+}
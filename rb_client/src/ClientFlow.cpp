@@ -1,45 +1,41 @@
 #include "ClientFlow.h"
 
-ClientFlow::ClientFlowConsumer::ClientFlowConsumer(Client &client, std::function<void(ClientFlowConsumer&)> handler) 
-    : client(client), sender([handler, this](){ 
-        handler(*this);
-    }) {}
-
-void ClientFlow::ClientFlowConsumer::clear_protochannel() {
-    if (pc == nullptr) return;
-    if (pc->is_open()) {
-        RBRequest nop_req;
-        nop_req.set_type(RBMsgType::NOP);
-        nop_req.set_protover(3);
-        nop_req.set_final(true);
-        pc->run(nop_req, true);
-    }
-    pc = nullptr;
+#include <algorithm>
+#include <cstring>
+
+using boost::asio::use_awaitable;
+
+ClientFlow::ChannelLease::ChannelLease(ClientFlow &flow) : flow(flow) {}
+
+ClientFlow::ChannelLease::~ChannelLease() {
+    if (pc != nullptr) flow.client.channel_pool().release(std::move(pc));
 }
 
-std::shared_ptr<ProtoChannel> ClientFlow::ClientFlowConsumer::get_protochannel() {
-    std::lock_guard lg(m);
-    if (pc == nullptr || !pc->is_open()) {
-        pc = client.open_channel();
-    }
-    last_use = std::chrono::system_clock::now();
-    return pc;
+awaitable<std::shared_ptr<ProtoChannel>> ClientFlow::ChannelLease::get_protochannel() {
+    if (pc == nullptr || !pc->is_open())
+        pc = co_await flow.client.channel_pool().acquire();
+    co_return pc;
 }
 
-void ClientFlow::ClientFlowConsumer::clean_protochannel() {
-    std::lock_guard lg(m);
-    if (pc == nullptr) return;
-    auto timeout = last_use + std::chrono::seconds(PROTOCHANNEL_POOL_TIMEOUT_SECS);
-    auto now = std::chrono::system_clock::now();
-    if (now > timeout) {
-        RBLog("ClientFlow >> Cleaning unused ProtoChannel...", LogLevel::DEBUG);
-        clear_protochannel();
+awaitable<void> ClientFlow::run_concurrently(std::vector<std::function<awaitable<void>()>> tasks) {
+    auto executor = co_await boost::asio::this_coro::executor;
+    boost::asio::steady_timer done(executor, boost::asio::steady_timer::time_point::max());
+    size_t remaining = tasks.size();
+    std::exception_ptr error;
+
+    for (auto &task : tasks) {
+        boost::asio::co_spawn(executor, task(), [&](std::exception_ptr e) {
+            if (e && !error) error = e;
+            if (--remaining == 0) done.cancel();
+        });
+    }
+    // every task completes on this same thread, so remaining needs no synchronization
+    while (remaining > 0) {
+        boost::system::error_code ec;
+        co_await done.async_wait(boost::asio::redirect_error(use_awaitable, ec));
     }
-}
 
-void ClientFlow::ClientFlowConsumer::join() {
-    clear_protochannel();
-    sender.join();
+    if (error) std::rethrow_exception(error);
 }
 
 ClientFlow::ClientFlow(
@@ -50,23 +46,35 @@ ClientFlow::ClientFlow(
     const std::string &password,
     bool restore_option,
     std::chrono::system_clock::duration watcher_interval,
-    int senders_pool_n)
-    : client(ip, port, senders_pool_n),
+    WatcherMode watcher_mode,
+    const std::string &index_path,
+    int scan_threads,
+    uint64_t scan_inflight_bytes,
+    int max_transfers,
+    int disk_threads,
+    int upload_window,
+    int upload_stripes,
+    int restore_files,
+    int restore_segments,
+    size_t pool_max_idle,
+    std::chrono::seconds pool_idle_timeout,
+    std::chrono::seconds pool_keepalive_interval)
+    : client(ip, port, pool_max_idle, pool_idle_timeout, pool_keepalive_interval),
       root_path(root_path),
       username(username),
       password(password),
       restore_from_server(restore_option),
-      senders_pool_n(senders_pool_n),
-      watchdog(make_watchdog(
-        std::chrono::seconds(PROTOCHANNEL_POOL_TIMEOUT_SECS),
-        [this]() { return keep_going.load(); },
-        [this]() { 
-            for(auto &cfc : senders_pool) cfc->clean_protochannel();
-        }
-      )),
-      file_manager(root_path, watcher_interval) {}
-
-bool ClientFlow::upload_file(const std::shared_ptr<FileOperation> &file_operation, ClientFlowConsumer & cfc) {
+      upload_window(upload_window),
+      upload_stripes(upload_stripes),
+      restore_files(std::max(restore_files, 1)),
+      restore_segments(std::max(restore_segments, 1)),
+      max_transfers(std::max(max_transfers, 1)),
+      transfer_slots(std::max(max_transfers, 1)),
+      io_work(boost::asio::make_work_guard(io_context)),
+      disk_pool(std::max(disk_threads, 1)),
+      file_manager(root_path, watcher_interval, watcher_mode, index_path, scan_threads, scan_inflight_bytes) {}
+
+awaitable<bool> ClientFlow::upload_file(const std::shared_ptr<FileOperation> &file_operation, ChannelLease &channel) {
     if (file_operation->get_command() != FileCommand::UPLOAD)
         throw std::logic_error("ClientFlow->Wrong type of FileOperation command");
 
@@ -76,7 +84,7 @@ bool ClientFlow::upload_file(const std::shared_ptr<FileOperation> &file_operatio
     std::ifstream fl(file_path.string(), std::ios::binary);
     if (fl.fail()) {
         RBLog("ClientFlow >> Can't open file <" + file_path.string() + "> for upload", LogLevel::ERROR);
-        return false;
+        co_return false;
     }
 
     file_metadata metadata = file_operation->get_metadata();
@@ -85,100 +93,604 @@ bool ClientFlow::upload_file(const std::shared_ptr<FileOperation> &file_operatio
 
     // Skip if metadata don't match
     if (file_size != metadata.size || last_write_time != metadata.last_write_time)
-        return false;
+        co_return false;
+
+    bool aborted = false;
+    try {
+        // no transfer at all if the server holds the content, then a delta needs
+        // a version of the file on the server, the other modes start from scratch
+        bool uploaded = client.has_capability(RBCapability::CAP_OBJECT_LINK) &&
+                        file_size >= RB_OBJECT_LINK_MIN_SIZE &&
+                        co_await link_file(file_operation, fl, file_size, last_write_time, channel);
+        uploaded = uploaded ||
+                   (client.has_capability(RBCapability::CAP_DELTA_UPLOAD) &&
+                    file_size >= RB_DELTA_UPLOAD_MIN_SIZE &&
+                    co_await upload_delta(file_operation, fl, file_size, last_write_time, channel));
+        if (!uploaded) {
+            // new large files are better spread over more channels than deduplicated by chunks
+            if (client.has_capability(RBCapability::CAP_STRIPED_UPLOAD) && upload_stripes > 1 &&
+                file_size >= RB_STRIPED_UPLOAD_MIN_SIZE)
+                co_await upload_striped(file_operation, file_size, last_write_time, channel);
+            else if (client.has_capability(RBCapability::CAP_CHUNKED_UPLOAD) && file_size >= RB_CHUNKED_UPLOAD_MIN_SIZE)
+                co_await upload_chunks(file_operation, fl, file_size, last_write_time, channel);
+            else
+                co_await upload_segments(file_operation, fl, file_size, last_write_time, channel);
+        }
+    } catch (RBException &e) {
+        RBLog("File upload aborted: " + e.getMsg(), LogLevel::ERROR);
+        aborted = true;
+    }
+
+    if (aborted) {
+        RBRequest req;
+        auto file_segment = std::make_unique<RBFileSegment>();
+        file_segment->set_path(file_operation->get_path());
+        req.set_allocated_file_segment(file_segment.release());
+        req.set_type(RBMsgType::ABORT);
+        req.set_protover(3);
+
+        auto res = co_await client.run(req);
+        validateRBProto(res, RBMsgType::ABORT, 3);
+    }
 
+    // upload_channel.close();
+
+    fl.close();
+    co_return true;
+}
+
+awaitable<void> ClientFlow::upload_segments(const std::shared_ptr<FileOperation> &file_operation, std::ifstream &fl,
+                                            size_t file_size, time_t last_write_time, ChannelLease &channel) {
+    file_metadata metadata = file_operation->get_metadata();
     int num_segments = count_segments(file_size);
-    int chunk_size = 2048;
-    std::vector<char> chunk(chunk_size, 0);  // Buffer to hold 2048 characters
-    boost::crc_32_type crc;
+    RBCrc32 crc;
+    auto codec = client.preferred_compression();
+    int compression_misses = 0;
+
+    // ensure there's at least one segment, for empty files
+    if (!num_segments) num_segments++;
+
+    RBLog("Begin outbound transfer of " + std::to_string(num_segments) + " segments");
+    PipelinedSender sender(co_await channel.get_protochannel(), upload_window_size(), RBMsgType::UPLOAD);
+
+    // The same message is sent for every segment, its data is read straight into it
+    RBRequest file_upload_request;
+    file_upload_request.set_protover(3);
+    file_upload_request.set_type(RBMsgType::UPLOAD);
+    auto file_segment = file_upload_request.mutable_file_segment();
+    auto file_metadata = file_segment->mutable_file_metadata();
+    file_segment->set_path(file_operation->get_path());
+    file_metadata->set_size(file_size);
+    file_metadata->set_last_write_time(last_write_time);
+    auto data = file_segment->add_data();
+
+    // Fragment files that are larger than RB_MAX_SEGMENT_SIZE
+    for (int i = 0; i < num_segments; i++) {
+        RBLog("Sending segment " + std::to_string(i));
+
+        file_segment->set_segmentid(i);
+        file_segment->set_compression(RBCompression::COMP_NONE);
+        file_segment->set_raw_size(0);
+
+        // Length of current file segment
+        size_t segment_len = RB_MAX_SEGMENT_SIZE;
+        if (i == num_segments - 1) {  // If last segment
+            if (file_size == 0)
+                segment_len = 0;
+            else if (file_size % RB_MAX_SEGMENT_SIZE != 0)
+                segment_len = file_size % RB_MAX_SEGMENT_SIZE;
+        }
 
-    try {
-        // ensure there's at least one segment, for empty files
-        if (!num_segments) num_segments++;
-
-        RBLog("Begin outbound transfer of " + std::to_string(num_segments) + " segments");
-
-        // Fragment files that are larger than RB_MAX_SEGMENT_SIZE
-        for (int i = 0; i < num_segments; i++) {
-            RBLog("Sending segment " + std::to_string(i));
-
-            RBRequest file_upload_request;
-            file_upload_request.set_protover(3);
-            file_upload_request.set_type(RBMsgType::UPLOAD);
-
-            auto file_segment = std::make_unique<RBFileSegment>();
-            auto file_metadata = std::make_unique<RBFileMetadata>();
-            file_segment->set_path(file_operation->get_path());
-            file_segment->set_segmentid(i);
-            file_metadata->set_size(file_size);
-            file_metadata->set_last_write_time(last_write_time);
-
-            // Length of current file segment
-            size_t segment_len = RB_MAX_SEGMENT_SIZE;
-            if (i == num_segments - 1) {  // If last segment
-                if (file_size == 0)
-                    segment_len = 0;
-                else if (file_size % RB_MAX_SEGMENT_SIZE != 0)
-                    segment_len = file_size % RB_MAX_SEGMENT_SIZE;
+        co_await on_disk([&]() {
+            // Check every time if something has changed for the file operation
+            if (file_operation->get_abort())
+                throw RBException("ClientFlow->Abort");
+
+            data->resize(segment_len);
+            if (segment_len && !fl.read(data->data(), segment_len))
+                throw std::runtime_error("ClientFlow->Error reading file chunk");
+            crc.process_bytes(data->data(), segment_len);
+
+            // already compressed contents are detected by the first segments, then sent raw
+            if (codec != RBCompression::COMP_NONE && compression_misses < RB_COMPRESSION_MAX_MISSES) {
+                if (compress_segment(codec, *file_segment)) {
+                    RBLog("Segment " + std::to_string(i) + " compressed with " + codec_name(codec) + ": " +
+                          std::to_string(file_segment->raw_size()) + " -> " + std::to_string(data->size()));
+                    compression_misses = 0;
+                } else {
+                    compression_misses++;
+                }
             }
+        });
+
+        if (i == num_segments - 1) {                  // Final file segment
+            if (crc.checksum() != metadata.checksum)  // Check if checksums match
+                throw RBException("ClientFlow->different_checksums");
+            file_metadata->set_checksum(crc.checksum());
+        } else if (!keep_going.load()) {
+            throw RBException("ClientFlow->client_stopped");
+        }
+
+        // in case a response is not valid the sender will throw an exception, triggering the abort
+        co_await sender.send(file_upload_request);
+    }
+    co_await sender.flush();
+}
+
+awaitable<void> ClientFlow::upload_striped(const std::shared_ptr<FileOperation> &file_operation, size_t file_size,
+                                           time_t last_write_time, ChannelLease &channel) {
+    file_metadata metadata = file_operation->get_metadata();
+    fs::path file_path{root_path};
+    file_path.append(file_operation->get_path());
 
-            // Reading file segment by 2048-character long chunks
-            size_t tot_read = 0;
-            size_t current_read = 0;
-            while (tot_read < segment_len) {
-                // Check every time if something has changed for the file operation
+    auto codec = client.preferred_compression();
+    int num_segments = count_segments(file_size);
+    std::vector<uint32_t> segment_crcs(num_segments);
+
+    auto make_request = [&](std::ifstream &in, int i) {
+        if (file_operation->get_abort())
+            throw RBException("ClientFlow->Abort");
+        if (!keep_going.load())
+            throw RBException("ClientFlow->client_stopped");
+
+        RBRequest file_upload_request;
+        file_upload_request.set_protover(3);
+        file_upload_request.set_type(RBMsgType::UPLOAD);
+
+        auto file_segment = std::make_unique<RBFileSegment>();
+        auto file_metadata = std::make_unique<RBFileMetadata>();
+        file_segment->set_path(file_operation->get_path());
+        file_segment->set_segmentid(i);
+        file_segment->set_striped(true);
+
+        uint64_t offset = static_cast<uint64_t>(i) * RB_MAX_SEGMENT_SIZE;
+        auto data = file_segment->add_data();
+        data->resize(std::min<uint64_t>(RB_MAX_SEGMENT_SIZE, file_size - offset));
+        in.seekg(offset);
+        in.read(data->data(), data->size());
+        if (!in) throw std::runtime_error("ClientFlow->Error reading file chunk");
+        segment_crcs[i] = rb_crc32(0, data->data(), data->size());
+        if (codec != RBCompression::COMP_NONE)
+            compress_segment(codec, *file_segment);
+        file_metadata->set_size(file_size);
+        file_metadata->set_last_write_time(last_write_time);
+        file_metadata->set_checksum(metadata.checksum);
+        file_segment->set_allocated_file_metadata(file_metadata.release());
+        file_upload_request.set_allocated_file_segment(file_segment.release());
+        return file_upload_request;
+    };
+
+    int stripes = std::min(upload_stripes, num_segments - 1);
+    RBLog("Begin striped transfer of " + std::to_string(num_segments) + " segments on " +
+          std::to_string(stripes) + " channels");
+
+    // The first segment creates the upload on the server, then the others can go in any order
+    {
+        std::ifstream in(file_path.string(), std::ios::binary);
+        auto req = co_await on_disk([&]() { return make_request(in, 0); });
+        auto res = co_await (co_await channel.get_protochannel())->run(req);
+        validateRBProto(res, RBMsgType::UPLOAD, 3);
+    }
+
+    int next_segment = 1;
+    bool failed = false;
+
+    // Stripe 0 runs on the transfer's channel, the others take one of their own
+    std::vector<std::unique_ptr<ChannelLease>> leases;
+    leases.reserve(stripes);
+    std::vector<std::function<awaitable<void>()>> tasks;
+    for (int s = 0; s < stripes; s++) {
+        tasks.push_back([&, s]() -> awaitable<void> {
+            try {
+                ChannelLease &stripe_channel = s == 0 ? channel : *leases.emplace_back(std::make_unique<ChannelLease>(*this));
+                std::ifstream in(file_path.string(), std::ios::binary);
+                PipelinedSender sender(co_await stripe_channel.get_protochannel(), upload_window_size(), RBMsgType::UPLOAD);
+                while (!failed && next_segment < num_segments) {
+                    int i = next_segment++;
+                    auto req = co_await on_disk([&]() { return make_request(in, i); });
+                    co_await sender.send(req);
+                }
+                co_await sender.flush();
+            } catch (...) {
+                failed = true;
+                throw;
+            }
+        });
+    }
+    co_await run_concurrently(std::move(tasks));
+
+    // the server has checked the data against the expected checksum, this tells if the file
+    // changed while it was read
+    uint32_t crc = segment_crcs[0];
+    for (int i = 1; i < num_segments; i++) {
+        uint64_t len = std::min<uint64_t>(RB_MAX_SEGMENT_SIZE, file_size - static_cast<uint64_t>(i) * RB_MAX_SEGMENT_SIZE);
+        crc = crc32_combine(crc, segment_crcs[i], len);
+    }
+    if (crc != metadata.checksum)
+        throw RBException("ClientFlow->different_checksums");
+}
+
+awaitable<void> ClientFlow::upload_chunks(const std::shared_ptr<FileOperation> &file_operation, std::ifstream &fl,
+                                          size_t file_size, time_t last_write_time, ChannelLease &channel) {
+    file_metadata metadata = file_operation->get_metadata();
+
+    struct chunk_info {
+        uint64_t offset;
+        uint32_t size;
+        std::string hash;
+    };
+    std::vector<chunk_info> chunks;
+    RBCrc32 crc;
+
+    co_await on_disk([&]() {
+        Chunker chunker;
+        chunker.split(fl, [&](uint64_t offset, const char *data, size_t size) {
+            if (file_operation->get_abort())
+                throw RBException("ClientFlow->Abort");
+            crc.process_bytes(data, size);
+            chunks.push_back({offset, static_cast<uint32_t>(size), strong_hash(data, size)});
+        });
+    });
+
+    if (crc.checksum() != metadata.checksum)
+        throw RBException("ClientFlow->different_checksums");
+
+    // Offer every distinct chunk once, the server answers with the ones it doesn't have
+    std::unordered_set<std::string> offered;
+    std::vector<const chunk_info *> distinct;
+    for (const auto &chunk : chunks)
+        if (offered.insert(chunk.hash).second)
+            distinct.push_back(&chunk);
+
+    std::vector<const chunk_info *> missing;
+    for (size_t first = 0; first < distinct.size(); first += RB_CHUNK_REFS_PER_MESSAGE) {
+        size_t last = std::min(first + RB_CHUNK_REFS_PER_MESSAGE, distinct.size());
+
+        RBRequest offer_request;
+        offer_request.set_protover(3);
+        offer_request.set_type(RBMsgType::CHUNK_OFFER);
+
+        auto chunk_offer = std::make_unique<RBChunkOffer>();
+        chunk_offer->set_path(file_operation->get_path());
+        for (size_t i = first; i < last; i++) {
+            auto chunk_ref = chunk_offer->add_chunks();
+            chunk_ref->set_hash(distinct[i]->hash);
+            chunk_ref->set_size(distinct[i]->size);
+        }
+        offer_request.set_allocated_chunk_offer(chunk_offer.release());
+
+        auto res = co_await (co_await channel.get_protochannel())->run(offer_request);
+        validateRBProto(res, RBMsgType::CHUNK_OFFER, 3);
+
+        // missing indexes are relative to this offer
+        for (auto index : res.chunk_offer_response().missing()) {
+            if (index >= last - first)
+                throw RBException("ClientFlow->invalid_chunk_offer_response");
+            missing.push_back(distinct[first + index]);
+        }
+    }
+
+    RBLog("ClientFlow >> " + std::to_string(missing.size()) + "/" + std::to_string(distinct.size()) +
+          " chunks to upload for " + file_operation->get_path());
+
+    // Upload the missing chunks, packed in messages of about RB_MAX_SEGMENT_SIZE bytes
+    fl.clear();
+    size_t next = 0;
+    PipelinedSender chunk_sender(co_await channel.get_protochannel(), upload_window_size(), RBMsgType::CHUNK_UPLOAD);
+    while (next < missing.size()) {
+        RBRequest upload_request;
+        upload_request.set_protover(3);
+        upload_request.set_type(RBMsgType::CHUNK_UPLOAD);
+
+        auto chunk_data = std::make_unique<RBChunkData>();
+        co_await on_disk([&]() {
+            size_t batch_size = 0;
+            while (next < missing.size() && (batch_size == 0 || batch_size + missing[next]->size <= RB_MAX_SEGMENT_SIZE)) {
                 if (file_operation->get_abort())
                     throw RBException("ClientFlow->Abort");
 
-                if (segment_len - tot_read >= chunk_size)
-                    fl.read(&chunk[0], chunk_size);
-                else
-                    fl.read(&chunk[0], segment_len - tot_read);
-
+                const auto &chunk = *missing[next++];
+                auto rb_chunk = chunk_data->add_chunks();
+                rb_chunk->set_hash(chunk.hash);
+                auto data = rb_chunk->mutable_data();
+                data->resize(chunk.size);
+                fl.seekg(chunk.offset);
+                fl.read(data->data(), chunk.size);
                 if (!fl) throw std::runtime_error("ClientFlow->Error reading file chunk");
+                batch_size += chunk.size;
+            }
+        });
+        upload_request.set_allocated_chunk_data(chunk_data.release());
+
+        if (!keep_going.load())
+            throw RBException("ClientFlow->client_stopped");
+
+        co_await chunk_sender.send(upload_request);
+    }
+    co_await chunk_sender.flush();
+
+    // Commit the file as UPLOAD segments listing its chunks
+    int num_segments = static_cast<int>((chunks.size() + RB_CHUNK_REFS_PER_MESSAGE - 1) / RB_CHUNK_REFS_PER_MESSAGE);
+    PipelinedSender sender(co_await channel.get_protochannel(), upload_window_size(), RBMsgType::UPLOAD);
+    for (int i = 0; i < num_segments; i++) {
+        RBRequest file_upload_request;
+        file_upload_request.set_protover(3);
+        file_upload_request.set_type(RBMsgType::UPLOAD);
+
+        auto file_segment = std::make_unique<RBFileSegment>();
+        auto file_metadata = std::make_unique<RBFileMetadata>();
+        file_segment->set_path(file_operation->get_path());
+        file_segment->set_segmentid(i);
+        file_segment->set_segment_count(num_segments);
+        file_metadata->set_size(file_size);
+        file_metadata->set_last_write_time(last_write_time);
+
+        size_t first = static_cast<size_t>(i) * RB_CHUNK_REFS_PER_MESSAGE;
+        size_t last = std::min(first + RB_CHUNK_REFS_PER_MESSAGE, chunks.size());
+        for (size_t j = first; j < last; j++) {
+            auto chunk_ref = file_segment->add_chunk_refs();
+            chunk_ref->set_hash(chunks[j].hash);
+            chunk_ref->set_size(chunks[j].size);
+        }
+
+        if (i == num_segments - 1)
+            file_metadata->set_checksum(crc.checksum());
+
+        file_segment->set_allocated_file_metadata(file_metadata.release());
+        file_upload_request.set_allocated_file_segment(file_segment.release());
+
+        co_await sender.send(file_upload_request);
+    }
+    co_await sender.flush();
+}
+
+awaitable<bool> ClientFlow::link_file(const std::shared_ptr<FileOperation> &file_operation, std::ifstream &fl,
+                                      size_t file_size, time_t last_write_time, ChannelLease &channel) {
+    file_metadata metadata = file_operation->get_metadata();
+
+    // hashed by the scan together with the checksum, it's only missing for the files
+    // scanned before the capability was known
+    std::string object_hash = metadata.object_hash;
+    if (object_hash.empty()) {
+        RBCrc32 crc;
+        RBSha256 sha;
+        co_await on_disk([&]() {
+            std::vector<char> buffer(RB_MAX_SEGMENT_SIZE);
+            while (fl.read(&buffer[0], buffer.size()) || fl.gcount()) {
+                if (file_operation->get_abort())
+                    throw RBException("ClientFlow->Abort");
+                crc.process_bytes(&buffer[0], fl.gcount());
+                sha.process_bytes(&buffer[0], fl.gcount());
+            }
+            if (fl.bad()) throw std::runtime_error("ClientFlow->Error reading file");
+        });
+        if (crc.checksum() != metadata.checksum)
+            throw RBException("ClientFlow->different_checksums");
+        object_hash = sha.digest();
+
+        // the other upload modes read the file from the start
+        fl.clear();
+        fl.seekg(0);
+    }
+
+    RBRequest link_request;
+    link_request.set_protover(3);
+    link_request.set_type(RBMsgType::LINK);
+
+    auto file_segment = std::make_unique<RBFileSegment>();
+    auto file_metadata = std::make_unique<RBFileMetadata>();
+    file_segment->set_path(file_operation->get_path());
+    file_segment->set_object_hash(object_hash);
+    file_metadata->set_size(file_size);
+    file_metadata->set_last_write_time(last_write_time);
+    file_metadata->set_checksum(metadata.checksum);
+    file_segment->set_allocated_file_metadata(file_metadata.release());
+    link_request.set_allocated_file_segment(file_segment.release());
+
+    auto res = co_await (co_await channel.get_protochannel())->run(link_request);
+    validateRBProto(res, RBMsgType::LINK, 3);
+
+    if (res.link_response().linked())
+        RBLog("ClientFlow >> " + file_operation->get_path() + " linked to content already on the server");
+    co_return res.link_response().linked();
+}
+
+awaitable<bool> ClientFlow::upload_delta(const std::shared_ptr<FileOperation> &file_operation, std::ifstream &fl,
+                                         size_t file_size, time_t last_write_time, ChannelLease &channel) {
+    file_metadata metadata = file_operation->get_metadata();
+
+    RBRequest signature_request;
+    signature_request.set_protover(3);
+    signature_request.set_type(RBMsgType::SIGNATURE);
+    auto signature_segment = std::make_unique<RBFileSegment>();
+    signature_segment->set_path(file_operation->get_path());
+    signature_request.set_allocated_file_segment(signature_segment.release());
+
+    auto signature_res = co_await (co_await channel.get_protochannel())->run(signature_request);
+    validateRBProto(signature_res, RBMsgType::SIGNATURE, 3);
+    const auto &signature = signature_res.signature_response();
+
+    // Nothing to start from on the server
+    if (signature.blocks_size() == 0) co_return false;
+    if (signature.block_size() == 0 || signature.block_size() > RB_DELTA_MAX_BLOCK_SIZE)
+        throw RBException("ClientFlow->invalid_signature");
+    size_t block_size = signature.block_size();
+
+    std::unordered_map<uint32_t, std::vector<uint64_t>> blocks_by_weak;
+    for (int i = 0; i < signature.blocks_size(); i++)
+        blocks_by_weak[signature.blocks(i).weak()].push_back(i);
+
+    // First pass: find the server's blocks in the file. Literal data is recorded by
+    // position, it's read again while sending
+    struct delta_op {
+        bool literal;
+        uint64_t start;   // file offset or first block
+        uint64_t length;  // bytes or blocks
+    };
+    std::vector<delta_op> ops;
+    auto add_literal = [&ops](uint64_t offset, uint64_t length) {
+        if (!length) return;
+        if (!ops.empty() && ops.back().literal && ops.back().start + ops.back().length == offset)
+            ops.back().length += length;
+        else
+            ops.push_back({true, offset, length});
+    };
+    auto add_block = [&ops](uint64_t block) {
+        if (!ops.empty() && !ops.back().literal && ops.back().start + ops.back().length == block)
+            ops.back().length++;
+        else
+            ops.push_back({false, block, 1});
+    };
 
-                current_read = fl.gcount();                       // Get the number of characters that have been read (always 2048, except the last time)
-                file_segment->add_data(&chunk[0], current_read);  // Push characters that have been read into data
-                crc.process_bytes(&chunk[0], current_read);
-                tot_read += current_read;
+    RBCrc32 crc;
+    co_await on_disk([&]() {
+        std::vector<unsigned char> buffer(std::max<size_t>(4 * block_size, RB_MAX_SEGMENT_SIZE));
+        size_t start = 0;              // window position in buffer
+        size_t end = 0;
+        uint64_t buffer_offset = 0;    // file offset of buffer[0]
+        uint64_t literal_offset = 0;   // file offset of the data not matched yet
+        bool eof = false;
+        bool rolling = false;
+        RollingChecksum weak;
+
+        while (true) {
+            // keep at least a block after the window, so it can slide
+            if (!eof && end - start <= block_size) {
+                if (file_operation->get_abort())
+                    throw RBException("ClientFlow->Abort");
+
+                std::memmove(&buffer[0], &buffer[start], end - start);
+                buffer_offset += start;
+                end -= start;
+                start = 0;
+
+                fl.read(reinterpret_cast<char *>(&buffer[end]), buffer.size() - end);
+                if (fl.bad()) throw std::runtime_error("ClientFlow->Error reading file");
+                crc.process_bytes(&buffer[end], fl.gcount());
+                end += fl.gcount();
+                if (!fl) eof = true;
+                continue;
             }
+            if (end - start < block_size) break;
 
-            if (i == num_segments - 1) {                  // Final file segment
-                if (crc.checksum() != metadata.checksum)  // Check if checksums match
-                    throw RBException("ClientFlow->different_checksums");
-                file_metadata->set_checksum(crc.checksum());
-            } else if (!keep_going.load()) {
-                throw RBException("ClientFlow->client_stopped");
+            if (!rolling) {
+                weak.reset(&buffer[start], block_size);
+                rolling = true;
             }
 
-            file_segment->set_allocated_file_metadata(file_metadata.release());
-            file_upload_request.set_allocated_file_segment(file_segment.release());
+            auto candidates = blocks_by_weak.find(weak.digest());
+            if (candidates != blocks_by_weak.end()) {
+                auto strong = delta_strong_hash(&buffer[start], block_size);
+                auto match = std::find_if(candidates->second.begin(), candidates->second.end(), [&](uint64_t block) {
+                    return signature.blocks(block).strong() == strong;
+                });
+                if (match != candidates->second.end()) {
+                    add_literal(literal_offset, buffer_offset + start - literal_offset);
+                    add_block(*match);
+                    start += block_size;
+                    literal_offset = buffer_offset + start;
+                    rolling = false;
+                    continue;
+                }
+            }
 
-            auto res = cfc.get_protochannel()->run(file_upload_request);
-            // in case the response is not valid the validator will throw an excaption, triggering the abort
-            validateRBProto(res, RBMsgType::UPLOAD, 3);
+            if (end - start == block_size) break;
+            weak.roll(buffer[start], buffer[start + block_size]);
+            start++;
         }
-    } catch (RBException &e) {
-        RBLog("File upload aborted: " + e.getMsg(), LogLevel::ERROR);
+        add_literal(literal_offset, buffer_offset + end - literal_offset);
+    });
+
+    if (crc.checksum() != metadata.checksum)
+        throw RBException("ClientFlow->different_checksums");
+
+    // Split the operations in segments of at most RB_MAX_SEGMENT_SIZE literal bytes
+    std::vector<std::vector<delta_op>> segments(1);
+    uint64_t segment_bytes = 0;
+    uint64_t literal_bytes = 0;
+    for (auto op : ops) {
+        if (!op.literal) {
+            if (segments.back().size() >= RB_DELTA_OPS_PER_MESSAGE) {
+                segments.emplace_back();
+                segment_bytes = 0;
+            }
+            segments.back().push_back(op);
+            continue;
+        }
+        literal_bytes += op.length;
+        while (op.length) {
+            if (segment_bytes == RB_MAX_SEGMENT_SIZE || segments.back().size() >= RB_DELTA_OPS_PER_MESSAGE) {
+                segments.emplace_back();
+                segment_bytes = 0;
+            }
+            uint64_t length = std::min<uint64_t>(op.length, RB_MAX_SEGMENT_SIZE - segment_bytes);
+            segments.back().push_back({true, op.start, length});
+            segment_bytes += length;
+            op.start += length;
+            op.length -= length;
+        }
+    }
+
+    RBLog("ClientFlow >> Delta of " + file_operation->get_path() + ": " + std::to_string(literal_bytes) + "/" +
+          std::to_string(file_size) + " bytes to upload");
+
+    // Second pass: send the operations, reading the literal data back
+    fl.clear();
+    int num_segments = static_cast<int>(segments.size());
+    PipelinedSender sender(co_await channel.get_protochannel(), upload_window_size(), RBMsgType::UPLOAD);
+    for (int i = 0; i < num_segments; i++) {
+        RBRequest file_upload_request;
+        file_upload_request.set_protover(3);
+        file_upload_request.set_type(RBMsgType::UPLOAD);
 
-        RBRequest req;
         auto file_segment = std::make_unique<RBFileSegment>();
+        auto file_metadata = std::make_unique<RBFileMetadata>();
         file_segment->set_path(file_operation->get_path());
-        req.set_allocated_file_segment(file_segment.release());
-        req.set_type(RBMsgType::ABORT);
-        req.set_protover(3);
+        file_segment->set_segmentid(i);
+        file_segment->set_segment_count(num_segments);
+        file_segment->set_delta_block_size(block_size);
+        file_segment->set_delta_base_checksum(signature.checksum());
+        file_metadata->set_size(file_size);
+        file_metadata->set_last_write_time(last_write_time);
+
+        co_await on_disk([&]() {
+            for (const auto &op : segments[i]) {
+                if (file_operation->get_abort())
+                    throw RBException("ClientFlow->Abort");
 
-        auto res = client.run(req);
-        validateRBProto(res, RBMsgType::ABORT, 3);
-    }
+                auto delta = file_segment->add_delta();
+                if (op.literal) {
+                    auto literal = delta->mutable_literal();
+                    literal->resize(op.length);
+                    fl.seekg(op.start);
+                    fl.read(literal->data(), op.length);
+                    if (!fl) throw std::runtime_error("ClientFlow->Error reading file chunk");
+                } else {
+                    delta->set_block(op.start);
+                    delta->set_block_count(op.length);
+                }
+            }
+        });
 
-    // upload_channel.close();
+        if (i == num_segments - 1)
+            file_metadata->set_checksum(crc.checksum());
+        else if (!keep_going.load())
+            throw RBException("ClientFlow->client_stopped");
 
-    fl.close();
-    return true;
+        file_segment->set_allocated_file_metadata(file_metadata.release());
+        file_upload_request.set_allocated_file_segment(file_segment.release());
+
+        co_await sender.send(file_upload_request);
+    }
+    co_await sender.flush();
+    co_return true;
 }
 
-void ClientFlow::remove_file(const std::shared_ptr<FileOperation> &file_operation, ClientFlowConsumer &cfc) {
+size_t ClientFlow::upload_window_size() const {
+    return client.has_capability(RBCapability::CAP_PIPELINED_UPLOAD) ? upload_window : 1;
+}
+
+awaitable<void> ClientFlow::remove_file(const std::shared_ptr<FileOperation> &file_operation, ChannelLease &channel) {
     if (file_operation->get_command() != FileCommand::REMOVE)
         throw std::logic_error("ClientFlow->Wrong type of FileOperation command");
 
@@ -189,118 +701,181 @@ void ClientFlow::remove_file(const std::shared_ptr<FileOperation> &file_operatio
     file_segment->set_path(file_operation->get_path());
     file_remove_request.set_allocated_file_segment(file_segment.release());
 
-    auto res = cfc.get_protochannel()->run(file_remove_request);
+    auto res = co_await (co_await channel.get_protochannel())->run(file_remove_request);
     validateRBProto(res, RBMsgType::REMOVE, 3);
     if (!res.success())
         throw RBException("ClientFlow->Server Response Error: " + res.error());
 }
 
-void ClientFlow::get_server_files(const std::unordered_map<std::string, file_metadata> &server_map) {
-    for (const auto &pair : server_map) {
-        RBLog("Path: " + pair.first);
-        RBLog("Size: " + std::to_string(pair.second.size));
-        int num_segments = count_segments(pair.second.size);
-        RBLog("Segments: " + std::to_string(num_segments));
-
-        // ensure there's at least one segment, for empty files
-        if (!num_segments) num_segments++;
-
-        RBLog("Begin inbound transfer of " + std::to_string(num_segments) + " segments");
-
-        // Files larger than RB_MAX_SEGMENT_SIZE are requested in segments
-        for (int i = 0; i < num_segments; i++) {
-            if (!keep_going.load())
-                throw RBException("ClientFlow->client_stopped");
-
-            RBLog("Requesting segment " + std::to_string(i));
+awaitable<void> ClientFlow::get_server_files(const file_page_t &server_map) {
+    RBLog("Begin restore of " + std::to_string(server_map.size()) + " files, " + std::to_string(restore_files) +
+          " at a time");
 
-            auto file_segment_info = std::make_unique<RBFileSegment>();
-            file_segment_info->set_path(pair.first);
-            file_segment_info->set_segmentid(i);
-
-            RBRequest restore_request;
-            restore_request.set_protover(3);
-            restore_request.set_type(RBMsgType::RESTORE);
-            restore_request.set_allocated_file_segment(file_segment_info.release());
-
-            auto res = client.run(restore_request);
-            validateRBProto(res, RBMsgType::RESTORE, 3);
-
-            // write segment received from server
-            const auto &file_segment = res.file_segment();
-            const auto &res_path = file_segment.path();  // CHECK not checking for forbidden paths
-            auto path = root_path / fs::path(res_path).lexically_normal();
-            if (path.filename().empty()) {
-                RBLog("Client >> The path provided is not formatted as a valid file path", LogLevel::ERROR);
-                throw RBException("ClientFlow->malformed_path");
+    // restore_files workers take the next file to restore, the first failure stops them all
+    auto next_file = server_map.begin();
+    bool failed = false;
+    std::vector<std::function<awaitable<void>()>> tasks;
+    for (int w = 0; w < std::min<int>(restore_files, server_map.size()); w++) {
+        tasks.push_back([&]() -> awaitable<void> {
+            try {
+                while (!failed && next_file != server_map.end()) {
+                    const auto &[path, metadata] = *next_file++;
+                    co_await restore_file(path, metadata);
+                }
+            } catch (...) {
+                failed = true;
+                throw;
             }
+        });
+    }
+    co_await run_concurrently(std::move(tasks));
+    // CHECK directly throwing an exception in order to prevent from doing the file_system_compare
+}
 
-            auto segment_id = file_segment.segmentid();
-            if (segment_id != i) {
-                RBLog("Client >> Wrong segment received");
-                throw RBException("ClientFlow->wrong_segment");
-            }
-            // CHECK What if we don't check for wrong segment, but we accept them in
-            // any order and place them in a file at the right position, even if
-            // the file doesn't exist and the segment_id is greater than 0
-
-            // Create directories containing the file
-            fs::create_directories(path.parent_path());
-
-            // Create or overwrite file if it's the first segment (segment_id == 0), otherwise append to file
-            auto open_mode = segment_id == 0
-                ? std::ios::trunc
-                : std::ios::app;
-            std::ofstream ofs{path.string(), open_mode | std::ios::binary};
-
-            if (!ofs) {
-                RBLog("Client >> Cannot open file", LogLevel::ERROR);
-                // fs::remove(path); // CHECK Delete file?
-                throw RBException("ClientFlow->cannot_open_file");
-            }
+awaitable<void> ClientFlow::restore_file(const std::string &file_path, const file_metadata &metadata) {
+    if (file_path.find("..") != std::string::npos) {
+        RBLog("Client >> The path provided contains '..' (forbidden)", LogLevel::ERROR);
+        throw RBException("ClientFlow->forbidden_path");
+    }
+    auto path = root_path / fs::path(file_path).lexically_normal();
+    if (path.filename().empty()) {
+        RBLog("Client >> The path provided is not formatted as a valid file path", LogLevel::ERROR);
+        throw RBException("ClientFlow->malformed_path");
+    }
 
-            for (const std::string &datum : file_segment.data())
-                ofs << datum;
-            ofs.close();
+    // ensure there's at least one segment, for empty files
+    int num_segments = std::max(count_segments(metadata.size), 1);
+    RBLog("Begin inbound transfer of " + std::to_string(num_segments) + " segments of " + file_path);
 
-            if (i != num_segments - 1) continue;
+    auto file = co_await on_disk([&]() {
+        fs::create_directories(path.parent_path());
+        return std::make_unique<RestoreFile>(path, metadata.size);
+    });
 
-            // CHECK This checks against original checksum received from server
-            // Check if checksums match
-            auto checksum = calculate_checksum(path);
-            if (checksum != pair.second.checksum) {
-                RBLog("Client >> Checksums don't match");  //", deleting file..."
-                // fs::remove(path); // CHECK Delete file?
-                throw RBException("ClientFlow->invalid_checksum");
+    // The segments are checksummed as they're written, in any order, and their
+    // checksums combined at the end
+    std::vector<uint32_t> segment_crcs(num_segments);
+    auto segment_size = [&](int i) {
+        return std::min<uint64_t>(RB_MAX_SEGMENT_SIZE, metadata.size - static_cast<uint64_t>(i) * RB_MAX_SEGMENT_SIZE);
+    };
+
+    // restore_segments workers, each one on a channel of its own, request the next segment
+    int next_segment = 0;
+    bool failed = false;
+    std::vector<std::function<awaitable<void>()>> tasks;
+    for (int w = 0; w < std::min(restore_segments, num_segments); w++) {
+        tasks.push_back([&]() -> awaitable<void> {
+            try {
+                ChannelLease channel(*this);
+                RBRequest restore_request;
+                restore_request.set_protover(3);
+                restore_request.set_type(RBMsgType::RESTORE);
+                auto file_segment_info = restore_request.mutable_file_segment();
+                file_segment_info->set_path(file_path);
+                file_segment_info->set_compression(client.preferred_compression());
+
+                while (!failed && next_segment < num_segments) {
+                    if (!keep_going.load())
+                        throw RBException("ClientFlow->client_stopped");
+
+                    int i = next_segment++;
+                    file_segment_info->set_segmentid(i);
+                    auto res = co_await (co_await channel.get_protochannel())->run(restore_request);
+                    validateRBProto(res, RBMsgType::RESTORE, 3);
+
+                    const auto &file_segment = res.file_segment();
+                    if (file_segment.segmentid() != i) {
+                        RBLog("Client >> Wrong segment received");
+                        throw RBException("ClientFlow->wrong_segment");
+                    }
+
+                    co_await on_disk([&]() {
+                        std::string scratch;
+                        auto payload = segment_payload(file_segment, scratch);
+                        if (payload.size() != segment_size(i))
+                            throw RBException("ClientFlow->invalid_segment_size");
+                        segment_crcs[i] = rb_crc32(0, payload.data(), payload.size());
+                        file->write_at(static_cast<uint64_t>(i) * RB_MAX_SEGMENT_SIZE, payload.data(), payload.size());
+                    });
+                }
+            } catch (...) {
+                failed = true;
+                throw;
             }
-        }
+        });
     }
-
-    // CHECK directly throwing an exception in order to prevent from doing the file_system_compare
+    co_await run_concurrently(std::move(tasks));
+
+    // the file at path is only replaced once the whole content matches the server's checksum,
+    // dropping the restored one otherwise
+    uint32_t checksum = segment_crcs[0];
+    for (int i = 1; i < num_segments; i++)
+        checksum = crc32_combine(checksum, segment_crcs[i], segment_size(i));
+    if (checksum != metadata.checksum) {
+        RBLog("Client >> Checksums don't match, discarding " + file_path, LogLevel::ERROR);
+        co_await on_disk([&]() { file.reset(); });
+        throw RBException("ClientFlow->invalid_checksum");
+    }
+    // with the last write time it had when it was backed up
+    co_await on_disk([&]() {
+        file->commit();
+        fs::last_write_time(path, metadata.last_write_time);
+    });
 }
 
-std::unordered_map<std::string, file_metadata> ClientFlow::get_server_state() {
-    RBRequest probe_all_request;
-    probe_all_request.set_protover(3);
-    probe_all_request.set_type(RBMsgType::PROBE);
+awaitable<bool> ClientFlow::get_server_page(std::string &after, file_page_t &page) {
+    RBRequest probe_request;
+    probe_request.set_protover(3);
+    probe_request.set_type(RBMsgType::PROBE);
+    bool paged = client.has_capability(RBCapability::CAP_PAGED_PROBE);
+    if (paged) {
+        auto probe = probe_request.mutable_probe_request();
+        probe->set_after(after);
+        probe->set_limit(RB_PROBE_PAGE_SIZE);
+    }
 
-    auto res = client.run(probe_all_request);
+    auto res = co_await client.run(probe_request);
     validateRBProto(res, RBMsgType::PROBE, 3);
     if (!res.error().empty())
         throw RBException("ClientFlow->Server Response Error: " + res.error());
     if (!res.has_probe_response())
         throw RBException("ClientFlow->Missing probe response");
 
-    auto server_files = res.probe_response().files();
-    std::unordered_map<std::string, file_metadata> map;
-
-    auto it = server_files.begin();
-    while (it != server_files.end()) {
-        map[it->first] = file_metadata{it->second.checksum(), it->second.size(), it->second.last_write_time()};
-        it++;
+    auto &probe_response = res.probe_response();
+    for (auto &entry : probe_response.entries()) {
+        auto &meta = entry.metadata();
+        page.emplace_back(entry.path(), file_metadata{meta.checksum(), meta.size(), meta.last_write_time()});
     }
+    // older servers send all the files at once, in no order
+    for (auto &[path, meta] : probe_response.files())
+        page.emplace_back(path, file_metadata{meta.checksum(), meta.size(), meta.last_write_time()});
+    if (!paged)
+        std::sort(page.begin(), page.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    if (!page.empty())
+        after = page.back().first;
+    co_return paged && probe_response.more();
+}
+
+std::function<bool(file_page_t &)> ClientFlow::server_pages() {
+    return [this, after = std::string(), more = true](file_page_t &page) mutable {
+        if (!more) return false;
+        more = run_on_io(get_server_page(after, page));
+        return true;
+    };
+}
+
+awaitable<RBTreeResponse> ClientFlow::get_server_tree(const RBTreeRequest &tree_request) {
+    RBRequest req;
+    req.set_protover(3);
+    req.set_type(RBMsgType::TREE);
+    *req.mutable_tree_request() = tree_request;
 
-    return map;
+    auto res = co_await client.run(req);
+    validateRBProto(res, RBMsgType::TREE, 3);
+    if (!res.error().empty())
+        throw RBException("ClientFlow->Server Response Error: " + res.error());
+    co_return res.tree_response();
 }
 
 void ClientFlow::watcher_loop() {
@@ -335,28 +910,38 @@ void ClientFlow::watcher_loop() {
         }
     };
 
-    // probing server
-    std::unordered_map server_files = get_server_state();
-
-    // restoring files from server's backup
+    // restoring files from server's backup, a page of them at a time
     if (restore_from_server) {
         RBLog("Watcher >> Syncing client to server's state...", LogLevel::INFO);
-        get_server_files(server_files);
+        auto next_page = server_pages();
+        file_page_t page;
+        while (next_page(page)) {
+            run_on_io(get_server_files(page));
+            page.clear();
+        }
         RBLog("Client >> RESTORE DONE", LogLevel::INFO);
     }
 
     RBLog("Watcher >> Syncing server to client's state...", LogLevel::INFO);
-    // scanning current files
+    // scanning current files, with the object hash of the ones LINK is sent for
+    if (client.has_capability(RBCapability::CAP_OBJECT_LINK))
+        file_manager.hash_objects(RB_OBJECT_LINK_MIN_SIZE);
     file_manager.initial_scan();
-    // comparing client and server files
-    file_manager.file_system_compare(server_files, update_handler);
+    // comparing client and server files: only the directories that differ, when the server keeps
+    // their trees, or all of them, probing the server as they're compared
+    if (client.has_capability(RBCapability::CAP_TREE_PROBE))
+        file_manager.tree_compare(
+            [this](const RBTreeRequest &tree_request) { return run_on_io(get_server_tree(tree_request)); },
+            update_handler);
+    else
+        file_manager.file_system_compare(server_pages(), update_handler);
 
     RBLog("Watcher >> Start monitoring...", LogLevel::INFO);
     // running file watcher to monitor client fs
     file_manager.start_monitoring(update_handler);
 }
 
-void ClientFlow::sender_loop(ClientFlowConsumer &cfc) {
+void ClientFlow::dispatcher_loop() {
     try {
         while (true) {
             if (attempt_count == max_attempts) {
@@ -364,58 +949,80 @@ void ClientFlow::sender_loop(ClientFlowConsumer &cfc) {
                 stop();
                 break;
             } else if (attempt_count > 0) {
-                // from the second attempt the thread have to wait a little bit in order to not solve the problem
+                // after a failure, wait a little bit in order to not solve the problem
                 std::this_thread::sleep_for(std::chrono::milliseconds(3000));
             }
 
-            auto op = out_queue.get_file_operation();
-            const auto &path = op->get_path();
-
-            if (!keep_going) return;
-
+            // a slot is released by every transfer when it ends
+            transfer_slots.acquire();
+            std::shared_ptr<FileOperation> op;
             try {
-                switch (op->get_command()) {
-                case FileCommand::UPLOAD:
-                    RBLog("Client >> UPLOADING: " + path, LogLevel::INFO);
-                    if (upload_file(op, cfc))
-                        RBLog("Client >> UPLOADED: " + path, LogLevel::INFO);
-                    else
-                        RBLog("Client >> SKIPPED: " + path, LogLevel::DEBUG);
-                    break;
-                case FileCommand::REMOVE:
-                    RBLog("Client >> REMOVING: " + path, LogLevel::INFO);
-                    remove_file(op, cfc);
-                    RBLog("Client >> REMOVED: " + path, LogLevel::INFO);
-                    break;
-                default:
-                    RBLog("Client >> unhandled file operation!", LogLevel::ERROR);
-                    break;
-                }
+                op = out_queue.get_file_operation();
+            } catch (...) {
+                transfer_slots.release();
+                throw;
+            }
 
-                attempt_count = 0;                              // resetting attempt count
-                out_queue.remove_file_operation(op->get_id());  // deleting file operation because completed correctly
-            } catch (RBException &e) {
-                attempt_count++;
-                RBLog("RBException:" + e.getMsg(), LogLevel::ERROR);
-                out_queue.free_file_operation(op->get_id());
-            } catch (std::exception &e) {
-                attempt_count++;
-                RBLog("exception:" + std::string(e.what()), LogLevel::ERROR);
-                out_queue.free_file_operation(op->get_id());
+            if (!keep_going) {
+                transfer_slots.release();
+                return;
             }
+
+            boost::asio::co_spawn(io_context, transfer(op), [this](std::exception_ptr) {
+                transfer_slots.release();
+            });
         }
     } catch (RBException &e) {
         if (keep_going)
-            RBLog("Client >> unexpected termination of sender thread: " + e.getMsg());
+            RBLog("Client >> unexpected termination of dispatcher thread: " + e.getMsg());
+    } catch (std::exception &e) {
+        RBLog("Client >> unexpected termination of dispatcher thread: " + std::string(e.what()));
+    }
+}
+
+awaitable<void> ClientFlow::transfer(std::shared_ptr<FileOperation> op) {
+    const auto &path = op->get_path();
+    ChannelLease channel(*this);
+
+    try {
+        switch (op->get_command()) {
+        case FileCommand::UPLOAD:
+            RBLog("Client >> UPLOADING: " + path, LogLevel::INFO);
+            if (co_await upload_file(op, channel))
+                RBLog("Client >> UPLOADED: " + path, LogLevel::INFO);
+            else
+                RBLog("Client >> SKIPPED: " + path, LogLevel::DEBUG);
+            break;
+        case FileCommand::REMOVE:
+            RBLog("Client >> REMOVING: " + path, LogLevel::INFO);
+            co_await remove_file(op, channel);
+            RBLog("Client >> REMOVED: " + path, LogLevel::INFO);
+            break;
+        default:
+            RBLog("Client >> unhandled file operation!", LogLevel::ERROR);
+            break;
+        }
+
+        attempt_count = 0;                              // resetting attempt count
+        out_queue.remove_file_operation(op->get_id());  // deleting file operation because completed correctly
+    } catch (RBException &e) {
+        attempt_count++;
+        RBLog("RBException:" + e.getMsg(), LogLevel::ERROR);
+        out_queue.free_file_operation(op->get_id());
     } catch (std::exception &e) {
-        RBLog("Client >> unexpected termination of sender thread: " + std::string(e.what()));
+        attempt_count++;
+        RBLog("exception:" + std::string(e.what()), LogLevel::ERROR);
+        out_queue.free_file_operation(op->get_id());
     }
 }
 
 void ClientFlow::start() {
+    io_thread = std::thread([this]() { io_context.run(); });
+    boost::asio::co_spawn(io_context, client.channel_pool().maintain(), boost::asio::detached);
+
     RBLog("Main >> Authenticating...", LogLevel::INFO);
     try {
-        client.authenticate(username, password);
+        run_on_io(client.authenticate(username, password));
     } catch (RBException &e) {
         RBLog("Authentication failed: " + e.getMsg(), LogLevel::ERROR);
         exit(-1);
@@ -429,14 +1036,9 @@ void ClientFlow::start() {
     // thread for making some initial operations and then keeping file watcher running
     watcher_thread = std::thread([this]() { watcher_loop(); });
 
-    // threads for handling file operation: sending requests and receiving responses
-    for (int i = 0; i < senders_pool_n; i++) {
-        RBLog("Main >> Starting sender thread " + std::to_string(i), LogLevel::INFO);
-        senders_pool.emplace_back(std::make_unique<ClientFlowConsumer>(
-            client, 
-            [this](ClientFlowConsumer &cfc) { sender_loop(cfc); }
-        ));
-    }
+    // thread starting a transfer for each file operation, up to max_transfers at a time
+    RBLog("Main >> Starting dispatcher for " + std::to_string(max_transfers) + " transfers", LogLevel::INFO);
+    dispatcher_thread = std::thread([this]() { dispatcher_loop(); });
 
     RBLog("ClientFLow >> RB client started!", LogLevel::INFO);
 
@@ -452,13 +1054,17 @@ void ClientFlow::start() {
     RBLog("ClientFLow >> Waiting for watcher thread to finish...", LogLevel::INFO);
     watcher_thread.join();
 
-    RBLog("ClientFLow >> Waiting for sender threads to finish...", LogLevel::INFO);
-    for (auto &s : senders_pool) {
-        try {
-            s->join();
-        } catch (std::exception &e) {
-        }
+    RBLog("ClientFLow >> Waiting for transfers to finish...", LogLevel::INFO);
+    dispatcher_thread.join();
+    for (int i = 0; i < max_transfers; i++) transfer_slots.acquire();
+    try {
+        run_on_io(client.channel_pool().close());
+    } catch (std::exception &e) {
     }
+    io_work.reset();
+    io_context.stop();
+    io_thread.join();
+    disk_pool.join();
 }
 
 void ClientFlow::stop() {
@@ -1,24 +1,56 @@
 #include "FileManager.h"
+#include "DirTree.h"
+#include "InotifyWatcher.h"
+#include "RestoreFile.h"
 
+#include <algorithm>
+#include <set>
+#include <string_view>
+#include <unordered_set>
 #include <utility>
 
 FileManager::FileManager(
     fs::path path,
-    std::chrono::system_clock::duration delay)
-    : path_to_watch(std::move(path)), update_interval(delay) {}
+    std::chrono::system_clock::duration delay,
+    WatcherMode mode,
+    fs::path index_path,
+    int scan_threads,
+    uint64_t scan_inflight_bytes)
+    : path_to_watch(std::move(path)), update_interval(delay), mode(mode), index(std::move(index_path)),
+      pipeline(scan_threads, scan_inflight_bytes) {}
+
+#define RB_INDEX_SAVE_INTERVAL_SECS 60
 
 void FileManager::initial_scan() {
     RBLog("Watcher >> Performing initial scan...", LogLevel::INFO);
-    for (auto &file : fs::recursive_directory_iterator(path_to_watch) ) {
-        if(fs::is_regular_file(file.path()) && file.path().string().find(".DS_Store") == std::string::npos ){
-            file_metadata current_file_metadata{};
-            current_file_metadata.last_write_time = last_write_time(file.path());
-            current_file_metadata.size = fs::file_size(file.path());
-            current_file_metadata.checksum = calculate_checksum(file.path());
-
-            files[file.path().string()] = current_file_metadata;
+    index.load();
+
+    // only files that changed since the last run are hashed again
+    size_t hashed = 0;
+    pipeline.run({path_to_watch}, {}, object_hash_min_size,
+        [this](const fs::path &path) { return is_watched_file(path); },
+        [this](const std::string &file_path, const file_stat &st, uint32_t &checksum, std::string &object_hash) {
+            return known_checksum(file_path, st, checksum, object_hash);
+        },
+        [&](const std::string &file_path, const file_stat &st, uint32_t checksum, const std::string &object_hash,
+            bool was_hashed) {
+            if (was_hashed) hashed++;
+            update_file(file_path, st, checksum, object_hash, nullptr);
         }
-    }
+    );
+
+    index.prune([this](const std::string &file_path) { return !contains(files, file_path); });
+    save_index(true);
+    RBLog("Watcher >> Initial scan done: " + std::to_string(files.size()) + " files, " +
+          std::to_string(hashed) + " hashed", LogLevel::INFO);
+}
+
+void FileManager::save_index(bool force) {
+    auto now = std::chrono::system_clock::now();
+    if (!index.is_dirty()) return;
+    if (!force && now - last_index_save < std::chrono::seconds(RB_INDEX_SAVE_INTERVAL_SECS)) return;
+    index.save();
+    last_index_save = now;
 }
 
 // Utils function
@@ -33,95 +65,359 @@ void FileManager::stop_monitoring() {
     files["^NIL^"] = file_metadata();
 }
 
+bool FileManager::is_watched_file(const fs::path &path) {
+    // the files being restored are left behind by a client that stopped meanwhile
+    return path.string().find(".DS_Store") == std::string::npos && path.extension() != RB_RESTORE_SUFFIX;
+}
+
+void FileManager::hash_objects(uint64_t min_size) {
+    object_hash_min_size = min_size;
+}
+
+bool FileManager::known_checksum(const std::string &file_path, const file_stat &st, uint32_t &checksum,
+                                 std::string &object_hash) {
+    std::lock_guard lg(scan_mutex);
+    if (!index.lookup(file_path, st, checksum, object_hash)) return false;
+    // indexed when its object hash wasn't asked for, it's read again to get it
+    return object_hash_min_size == 0 || st.size < object_hash_min_size || !object_hash.empty();
+}
+
+// Description: store the current state of a file, notifying its creation or modification
+void FileManager::update_file(const std::string &file_path, const file_stat &st, uint32_t checksum,
+                              const std::string &object_hash,
+                              const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action) {
+    file_metadata current_file_metadata{checksum, st.size, st.mtime(), object_hash};
+    FileStatus status;
+    {
+        std::lock_guard lg(scan_mutex);
+        index.update(file_path, st, checksum, object_hash);
+
+        auto it = files.find(file_path);
+        if (it == files.end()) {
+            // File creation
+            files[file_path] = current_file_metadata;
+            status = FileStatus::CREATED;
+        } else {
+            // File modification. The new write time is kept even if the content
+            // didn't change, so the file isn't hashed again
+            bool changed = it->second.checksum != checksum;
+            it->second = current_file_metadata;
+            if (!changed) return;
+            status = FileStatus::MODIFIED;
+        }
+    }
+
+    if (action)
+        action(string_remove_pref(path_to_watch.string(), file_path), current_file_metadata, status);
+}
+
+// Description: notify the removal of a file if it doesn't exist anymore
+void FileManager::check_removed(const fs::path &path, const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action) {
+    const std::string file_path = path.string();
+    auto it = files.find(file_path);
+    if (it == files.end()) return;
+
+    boost::system::error_code ec;
+    if (fs::is_regular_file(path, ec) && is_watched_file(path)) return;
+
+    files.erase(it);
+    index.remove(file_path);
+    action(string_remove_pref(path_to_watch.string(), file_path), {}, FileStatus::REMOVED);
+}
+
+// Description: bring the entries of the given directories and files up to date
+void FileManager::scan(const std::vector<fs::path> &dirs, const std::vector<fs::path> &single_files,
+                       std::unordered_set<std::string> *seen,
+                       const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action) {
+    pipeline.run(dirs, single_files, object_hash_min_size,
+        [this](const fs::path &path) { return is_watched_file(path); },
+        [this](const std::string &file_path, const file_stat &st, uint32_t &checksum, std::string &object_hash) {
+            return known_checksum(file_path, st, checksum, object_hash);
+        },
+        [&](const std::string &file_path, const file_stat &st, uint32_t checksum, const std::string &object_hash,
+            bool) {
+            if (seen) seen->insert(file_path);
+            update_file(file_path, st, checksum, object_hash, action);
+        }
+    );
+}
+
+// Description: walk the whole tree comparing it with the known files
+void FileManager::polling_scan(const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action) {
+    std::unordered_set<std::string> seen;
+    scan({path_to_watch}, {}, &seen, action);
+
+    // File erase: the files the scan didn't find are double-checked before being notified
+    std::vector<std::string> missing;
+    for (auto &file : files)
+        if (!contains(seen, file.first)) missing.push_back(file.first);
+    for (auto &file_path : missing)
+        check_removed(fs::path(file_path), action);
+}
+
 // Description: Start the monitoring of the setted path to watch
 // Errors: It can throw a runtime error because of checksum calculation
 void FileManager::start_monitoring(const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action) {
-        while (running) {
-            std::this_thread::sleep_for(update_interval);
-            try {
-                std::string relative_path;
-                // File erase
-                auto it = files.begin();
-                while (it != files.end()) {
-                    if (!fs::exists(fs::path(it->first))) {
-                        relative_path = string_remove_pref(path_to_watch.string(), it->first);
-                        action(relative_path, {}, FileStatus::REMOVED);
-                        it = files.erase(it);
-                    } else {
-                        it++;
-                    }
-                }
+    bool monitored = false;
+    if (mode == WatcherMode::INOTIFY) {
+        try {
+            monitor_inotify(action);
+            monitored = true;
+        } catch (std::exception &e) {
+            RBLog("Watcher >> inotify monitoring unavailable: " + std::string(e.what()), LogLevel::ERROR);
+            RBLog("Watcher >> Falling back to polling...", LogLevel::INFO);
+        }
+    }
+    if (!monitored) monitor_polling(action);
 
-                for (auto &file : fs::recursive_directory_iterator(path_to_watch)) {
-                    file_metadata current_file_metadata{};
-
-                    if (fs::is_regular_file(file.path()) && file.path().string().find(".DS_Store") == std::string::npos ) {
-                        // File creation
-                        if (!contains(files, file.path().string())) {
-                            current_file_metadata.last_write_time = last_write_time(file.path());
-                            current_file_metadata.size = fs::file_size(file.path());
-                            current_file_metadata.checksum = calculate_checksum(file.path());
-
-                            files[file.path().string()] = current_file_metadata;
-                            relative_path = string_remove_pref(path_to_watch.string(), file.path().string());
-                            action(relative_path, files[file.path().string()], FileStatus::CREATED);
-                        } else {
-                            // File modification
-                            current_file_metadata.last_write_time = last_write_time(file.path());
-                            if (files[file.path().string()].last_write_time != fs::last_write_time(file.path())) {
-
-                                current_file_metadata.size = fs::file_size(file.path());
-                                current_file_metadata.checksum = calculate_checksum(file.path());
-                                if (files[file.path().string()].checksum != current_file_metadata.checksum) {
-
-                                    files[file.path().string()] = current_file_metadata;
-                                    relative_path = string_remove_pref(path_to_watch.string(), file.path().string());
-                                    action(relative_path, files[file.path().string()], FileStatus::MODIFIED);
-                                }
-                            }
-                        }
-                    }
-                }
-            } catch(std::exception &e) {
-                RBLog("Watcher >> Error occured while monitoring: " + std::string(e.what()), LogLevel::ERROR);
+    save_index(true);
+}
+
+void FileManager::monitor_polling(const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action) {
+    while (running) {
+        std::this_thread::sleep_for(update_interval);
+        try {
+            polling_scan(action);
+        } catch(std::exception &e) {
+            RBLog("Watcher >> Error occured while monitoring: " + std::string(e.what()), LogLevel::ERROR);
+        }
+        save_index(false);
+    }
+}
+
+// Description: event driven monitoring. Changed paths are collected and checked
+//              once the events settle down (or at least every update_interval)
+// Errors: It throws a runtime error if inotify can't be set up (e.g. watch limit reached)
+void FileManager::monitor_inotify(const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action) {
+    InotifyWatcher watcher;
+    watcher.add_watch_recursive(path_to_watch);
+
+    // catch what changed between the initial scan and the watches being in place
+    polling_scan(action);
+
+    std::set<std::string> dirty;
+    std::vector<inotify_change> changes;
+    auto last_flush = std::chrono::system_clock::now();
+
+    while (running) {
+        save_index(false);
+        changes.clear();
+        bool got_events = watcher.read_changes(changes, 250);
+
+        bool overflow = false;
+        for (auto &change : changes) {
+            if (change.type == InotifyChange::QUEUE_OVERFLOW) {
+                overflow = true;
+            } else if (change.type == InotifyChange::ADDED && change.is_dir) {
+                // new directory: watch it and pick up the files created before the watch was added
+                std::vector<fs::path> added_dirs;
+                watcher.add_watch_recursive(change.path, &added_dirs);
+                boost::system::error_code ec;
+                for (auto &dir : added_dirs)
+                    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+                        dirty.insert(it->path().string());
+            } else if (change.type == InotifyChange::UPDATED && change.is_dir) {
+                // the attributes of a watched directory changed, its files didn't
+                continue;
+            } else if (change.type == InotifyChange::GONE && change.is_dir) {
+                watcher.remove_watch_recursive(change.path);
+                const std::string prefix = change.path.string() + "/";
+                for (auto &file : files)
+                    if (file.first.compare(0, prefix.size(), prefix) == 0)
+                        dirty.insert(file.first);
+            } else {
+                dirty.insert(change.path.string());
+            }
+        }
+
+        if (overflow) {
+            // some events are lost: re-arm the watches and compare the tree by write time
+            RBLog("Watcher >> inotify queue overflow, rescanning...", LogLevel::INFO);
+            dirty.clear();
+            try {
+                watcher.add_watch_recursive(path_to_watch);
+                polling_scan(action);
+            } catch (fs::filesystem_error &e) {
+                RBLog("Watcher >> Error occured while rescanning: " + std::string(e.what()), LogLevel::ERROR);
             }
+            last_flush = std::chrono::system_clock::now();
+            continue;
+        }
+
+        auto now = std::chrono::system_clock::now();
+        if (dirty.empty() || (got_events && now - last_flush < update_interval))
+            continue;
+
+        std::vector<fs::path> changed_files;
+        for (auto &file_path : dirty) {
+            boost::system::error_code ec;
+            fs::path path(file_path);
+            if (fs::is_regular_file(path, ec))
+                changed_files.push_back(path);
+            else
+                check_removed(path, action);
+        }
+        try {
+            scan({}, changed_files, nullptr, action);
+        } catch(std::exception &e) {
+            RBLog("Watcher >> Error occured while monitoring: " + std::string(e.what()), LogLevel::ERROR);
         }
+        dirty.clear();
+        last_flush = now;
+    }
 }
 
-// Description: compare a map containing a file system with the actual and make an action for the differences
-// Input parameters: map <string(relative path), file_metadata>
+// Description: compare the server's file system with the actual one and make an action for the differences.
+//              The server's files come in pages sorted by path, which are merged with the local ones sorted likewise
+// Input parameters: function filling the next page of the server's files, false after the last one
 //                   action function
-void FileManager::file_system_compare(const std::unordered_map<std::string, file_metadata>& map,
+void FileManager::file_system_compare(const std::function<bool(file_page_t&)>& next_page,
                                       const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action) {
     if(path_to_watch.empty())
         throw std::logic_error("Watcher >> Function file_system_compare can be used only after the file watcher is set");
 
-    auto it = map.begin();
-    while(it != map.end()) {
-        fs::path p{path_to_watch.string()};
-        p /= it->first;
-        std::string file_path = p.string();
-        if(!contains(files, file_path)) {
-            action(it->first, {}, FileStatus::REMOVED);
-        } else {
-            if(files[file_path].last_write_time != it->second.last_write_time &&
-                files[file_path].checksum != it->second.checksum) {
-                action(it->first, files[file_path], FileStatus::MODIFIED);
+    // local files by relative path
+    size_t prefix_size = path_to_watch.string().size() + 1;
+    std::vector<std::pair<std::string_view, const file_metadata*>> local;
+    local.reserve(files.size());
+    for (auto& [file_path, meta] : files)
+        if (file_path.size() > prefix_size)
+            local.emplace_back(std::string_view(file_path).substr(prefix_size), &meta);
+    std::sort(local.begin(), local.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    auto local_it = local.begin();
+    auto created = [&]() {
+        action(std::string(local_it->first), *local_it->second, FileStatus::CREATED);
+        local_it++;
+    };
+
+    file_page_t page;
+    while(next_page(page)) {
+        for(auto& [path, server_meta] : page) {
+            while(local_it != local.end() && local_it->first < path)
+                created();
+
+            if(local_it == local.end() || local_it->first != path) {
+                action(path, {}, FileStatus::REMOVED);
+            } else {
+                auto& meta = *local_it->second;
+                if(meta.last_write_time != server_meta.last_write_time &&
+                    meta.checksum != server_meta.checksum) {
+                    action(path, meta, FileStatus::MODIFIED);
+                }
+                local_it++;
             }
         }
-        it++;
+        page.clear();
     }
 
-    it=files.begin();
-    while(it != files.end()) {
-        std::string relative_path = string_remove_pref(path_to_watch.string(), it->first);
+    while(local_it != local.end())
+        created();
+}
+
 
-        if(!contains(map, relative_path)) {
-            action(relative_path, it->second, FileStatus::CREATED);
+
+
+void FileManager::tree_compare(const std::function<RBTreeResponse(const RBTreeRequest&)>& fetch,
+                               const std::function<void(const std::string&, const file_metadata&, FileStatus)> &action) {
+    if(path_to_watch.empty())
+        throw std::logic_error("Watcher >> Function tree_compare can be used only after the file watcher is set");
+
+    // the local tree, by relative path
+    std::string prefix = path_to_watch.string() + "/";
+    DirTree local(true);
+    for (auto& [file_path, meta] : files)
+        if (file_path.size() > prefix.size())
+            local.add_file(std::string_view(file_path).substr(prefix.size()), meta.checksum, meta.size);
+    local.sum_all();
+
+    // every file under a directory the server doesn't have
+    std::function<void(const std::string&)> created_dir = [&](const std::string& path) {
+        auto dir = local.find(path);
+        for (auto& name : dir->file_names) {
+            auto file_path = child_path(path, name);
+            action(file_path, files.at(prefix + file_path), FileStatus::CREATED);
         }
-        it++;
-    }
-}
+        for (auto& name : dir->subdirs)
+            created_dir(child_path(path, name));
+    };
 
+    // The names the server listed so far for the directories whose listing comes in pages, and
+    // the cursor of the next page: the local entries it doesn't have are only known after the last one
+    struct listed_dir {
+        std::unordered_set<std::string> files;
+        std::unordered_set<std::string> dirs;
+        std::string after;
+    };
+    std::unordered_map<std::string, listed_dir> listed;
 
+    auto compare_listing = [&](const RBTreeListing& listing, std::vector<std::string>& next) {
+        auto& server = listed[listing.path()];
+        for (auto& entry : listing.files()) {
+            auto name = base_name(entry.path());
+            server.files.emplace(name);
+            server.after = std::max(server.after, std::string(name));
+            auto it = files.find(prefix + entry.path());
+            if (it == files.end()) {
+                action(entry.path(), {}, FileStatus::REMOVED);
+                continue;
+            }
+            auto& meta = it->second;
+            if (meta.last_write_time != entry.metadata().last_write_time() &&
+                meta.checksum != entry.metadata().checksum()) {
+                action(entry.path(), meta, FileStatus::MODIFIED);
+            }
+        }
 
+        for (auto& subdir : listing.dirs()) {
+            auto name = base_name(subdir.path());
+            server.dirs.emplace(name);
+            server.after = std::max(server.after, std::string(name));
+            auto local_subdir = local.find(subdir.path());
+            if (!local_subdir || !(local_subdir->summary == tree_hash::from_bytes(subdir.hash())))
+                next.push_back(subdir.path());
+        }
+        if (listing.more()) return false;
+
+        auto dir = local.find(listing.path());
+        if (dir) {
+            for (auto& name : dir->file_names)
+                if (!server.files.count(name)) {
+                    auto file_path = child_path(listing.path(), name);
+                    action(file_path, files.at(prefix + file_path), FileStatus::CREATED);
+                }
+            for (auto& name : dir->subdirs)
+                if (!server.dirs.count(name))
+                    created_dir(child_path(listing.path(), name));
+        }
+        listed.erase(listing.path());
+        return true;
+    };
+
+    // a level of directories at a time, from the root: the server lists the ones that differ,
+    // and the ones whose listing didn't fit in the answer are asked again with the next level
+    size_t requests = 0;
+    std::vector<std::string> level = {""};
+    while (!level.empty()) {
+        std::vector<std::string> next;
+        for (size_t first = 0; first < level.size(); first += RB_TREE_DIRS_PER_REQUEST) {
+            RBTreeRequest req;
+            for (size_t i = first; i < std::min(level.size(), first + RB_TREE_DIRS_PER_REQUEST); i++) {
+                auto dir = req.add_dirs();
+                dir->set_path(level[i]);
+                if (auto local_dir = local.find(level[i]))
+                    dir->set_hash(local_dir->summary.bytes());
+                auto it = listed.find(level[i]);
+                if (it != listed.end())
+                    dir->set_after(it->second.after);
+            }
+            auto res = fetch(req);
+            requests++;
+            for (auto& listing : res.listings())
+                if (!compare_listing(listing, next))
+                    next.push_back(listing.path());
+        }
+        level = std::move(next);
+    }
+    RBLog("Watcher >> Trees compared in " + std::to_string(requests) + " TREE requests", LogLevel::INFO);
+}
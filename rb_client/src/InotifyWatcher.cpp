@@ -0,0 +1,134 @@
+#include "InotifyWatcher.h"
+
+#include <stdexcept>
+
+#ifdef __linux__
+
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#define RB_INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                         IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+InotifyWatcher::InotifyWatcher() : buffer(64 * 1024) {
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error(std::string("InotifyWatcher->inotify_init failed: ") + strerror(errno));
+}
+
+InotifyWatcher::~InotifyWatcher() {
+    if (fd >= 0) close(fd);
+}
+
+void InotifyWatcher::add_watch(const fs::path &dir) {
+    int wd = inotify_add_watch(fd, dir.string().c_str(), RB_INOTIFY_MASK);
+    if (wd < 0) {
+        // the directory may have vanished in the meantime, nothing to watch
+        if (errno == ENOENT || errno == ENOTDIR) return;
+        throw std::runtime_error(std::string("InotifyWatcher->inotify_add_watch failed: ") + strerror(errno));
+    }
+
+    // the same directory can be reached again (e.g. after an overflow rescan),
+    // the kernel gives back the same watch descriptor in that case
+    auto old = wd_paths.find(wd);
+    if (old != wd_paths.end()) path_wds.erase(old->second.string());
+    wd_paths[wd] = dir;
+    path_wds[dir.string()] = wd;
+}
+
+void InotifyWatcher::add_watch_recursive(const fs::path &dir, std::vector<fs::path> *added_dirs) {
+    add_watch(dir);
+    if (added_dirs) added_dirs->push_back(dir);
+
+    boost::system::error_code ec;
+    for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (fs::is_directory(it->path()) && !fs::is_symlink(it->path())) {
+            add_watch(it->path());
+            if (added_dirs) added_dirs->push_back(it->path());
+        }
+    }
+}
+
+void InotifyWatcher::remove_watch_recursive(const fs::path &dir) {
+    const std::string prefix = dir.string() + "/";
+    auto it = path_wds.begin();
+    while (it != path_wds.end()) {
+        if (it->first == dir.string() || it->first.compare(0, prefix.size(), prefix) == 0) {
+            inotify_rm_watch(fd, it->second);
+            wd_paths.erase(it->second);
+            it = path_wds.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+bool InotifyWatcher::read_changes(std::vector<inotify_change> &changes, int timeout_ms) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0) {
+        if (errno == EINTR) return false;
+        throw std::runtime_error(std::string("InotifyWatcher->poll failed: ") + strerror(errno));
+    }
+    if (ready == 0) return false;
+
+    while (true) {
+        ssize_t len = read(fd, &buffer[0], buffer.size());
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            throw std::runtime_error(std::string("InotifyWatcher->read failed: ") + strerror(errno));
+        }
+
+        ssize_t i = 0;
+        while (i < len) {
+            auto *event = reinterpret_cast<struct inotify_event *>(&buffer[i]);
+            i += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                changes.push_back({fs::path(), InotifyChange::QUEUE_OVERFLOW, false});
+                continue;
+            }
+
+            auto dir = wd_paths.find(event->wd);
+            if (dir == wd_paths.end()) continue;  // watch already removed
+
+            if (event->mask & IN_IGNORED) {
+                path_wds.erase(dir->second.string());
+                wd_paths.erase(dir);
+                continue;
+            }
+
+            fs::path path = dir->second;
+            if (event->len > 0) path /= event->name;
+            auto type = event->mask & (IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF)
+                ? InotifyChange::GONE
+                : event->mask & (IN_CREATE | IN_MOVED_TO)
+                ? InotifyChange::ADDED
+                : InotifyChange::UPDATED;
+            changes.push_back({path, type, (event->mask & IN_ISDIR) != 0});
+        }
+    }
+
+    return true;
+}
+
+#else
+
+InotifyWatcher::InotifyWatcher() {
+    throw std::runtime_error("InotifyWatcher->inotify is not available on this platform");
+}
+
+InotifyWatcher::~InotifyWatcher() {}
+
+void InotifyWatcher::add_watch(const fs::path &) {}
+
+void InotifyWatcher::add_watch_recursive(const fs::path &, std::vector<fs::path> *) {}
+
+void InotifyWatcher::remove_watch_recursive(const fs::path &) {}
+
+bool InotifyWatcher::read_changes(std::vector<inotify_change> &, int) { return false; }
+
+#endif
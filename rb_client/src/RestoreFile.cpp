@@ -0,0 +1,62 @@
+#include "RestoreFile.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+RestoreFile::RestoreFile(const fs::path &path, uint64_t size)
+    : path(path), tmp_path(path.parent_path() / ("." + path.filename().string() + RB_RESTORE_SUFFIX)) {
+    fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        RBLog("RestoreFile >> Cannot open file " + tmp_path.string(), LogLevel::ERROR);
+        throw RBException("ClientFlow->cannot_open_file");
+    }
+
+    int res = 0;
+#ifdef __linux__
+    // the blocks are allocated upfront where the file system can, it's only resized otherwise
+    if (size > 0 && ::fallocate(fd, 0, 0, size) < 0) {
+        res = errno == EOPNOTSUPP ? ::ftruncate(fd, size) : -1;
+    }
+#else
+    res = ::ftruncate(fd, size);
+#endif
+    if (res < 0) {
+        RBLog("RestoreFile >> Cannot allocate " + std::to_string(size) + " bytes for " + path.string(),
+              LogLevel::ERROR);
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+        throw RBException("ClientFlow->cannot_write_file");
+    }
+}
+
+RestoreFile::~RestoreFile() {
+    if (fd < 0) return;
+    // not committed, the file at path is left as it was
+    ::close(fd);
+    ::unlink(tmp_path.c_str());
+}
+
+void RestoreFile::commit() {
+    int res = ::close(fd);
+    fd = -1;
+    if (res < 0 || ::rename(tmp_path.c_str(), path.c_str()) < 0) {
+        RBLog("RestoreFile >> Cannot replace file " + path.string(), LogLevel::ERROR);
+        ::unlink(tmp_path.c_str());
+        throw RBException("ClientFlow->cannot_write_file");
+    }
+}
+
+void RestoreFile::write_at(uint64_t offset, const char *data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        auto res = ::pwrite(fd, data + written, size - written, offset + written);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) {
+            RBLog("RestoreFile >> Cannot write file " + path.string(), LogLevel::ERROR);
+            throw RBException("ClientFlow->cannot_write_file");
+        }
+        written += res;
+    }
+}
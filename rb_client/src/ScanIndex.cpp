@@ -0,0 +1,190 @@
+#include "ScanIndex.h"
+#include "RBHelpers.h"
+
+#include <sys/stat.h>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#define RB_INDEX_MAGIC "RBINDEX\0"
+#define RB_INDEX_VERSION 2
+#define RB_INDEX_IO_BUFFER (1 << 20)
+// magic, version and number of entries
+#define RB_INDEX_HEADER_SIZE (8 + sizeof(uint32_t) + sizeof(uint64_t))
+// an entry with an empty path and no object hash
+#define RB_INDEX_MIN_ENTRY_SIZE (sizeof(uint32_t) + 4 * sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint8_t))
+
+time_t file_stat::mtime() const {
+    // floor division, tv_nsec is always positive
+    int64_t secs = mtime_ns / 1000000000;
+    if (mtime_ns % 1000000000 < 0) secs--;
+    return static_cast<time_t>(secs);
+}
+
+bool get_file_stat(const fs::path &path, file_stat &st) {
+    struct stat sb;
+    if (stat(path.string().c_str(), &sb) != 0) return false;
+
+    st.inode = sb.st_ino;
+    st.size = sb.st_size;
+#ifdef __APPLE__
+    st.mtime_ns = int64_t(sb.st_mtimespec.tv_sec) * 1000000000 + sb.st_mtimespec.tv_nsec;
+    st.ctime_ns = int64_t(sb.st_ctimespec.tv_sec) * 1000000000 + sb.st_ctimespec.tv_nsec;
+#else
+    st.mtime_ns = int64_t(sb.st_mtim.tv_sec) * 1000000000 + sb.st_mtim.tv_nsec;
+    st.ctime_ns = int64_t(sb.st_ctim.tv_sec) * 1000000000 + sb.st_ctim.tv_nsec;
+#endif
+    return true;
+}
+
+ScanIndex::ScanIndex(fs::path index_path) : index_path(std::move(index_path)) {}
+
+template <typename T>
+static bool read_field(std::istream &is, T &field) {
+    return static_cast<bool>(is.read(reinterpret_cast<char *>(&field), sizeof(T)));
+}
+
+template <typename T>
+static void write_field(std::ostream &os, const T &field) {
+    os.write(reinterpret_cast<const char *>(&field), sizeof(T));
+}
+
+void ScanIndex::load() {
+    entries.clear();
+    dirty = false;
+
+    std::vector<char> io_buffer(RB_INDEX_IO_BUFFER);
+    std::ifstream ifs;
+    ifs.rdbuf()->pubsetbuf(&io_buffer[0], io_buffer.size());
+    ifs.open(index_path.string(), std::ios::binary);
+    if (!ifs) {
+        RBLog("ScanIndex >> No index found at " + index_path.string(), LogLevel::INFO);
+        return;
+    }
+
+    char magic[8];
+    uint32_t version;
+    uint64_t count;
+    if (!ifs.read(magic, sizeof(magic)) || memcmp(magic, RB_INDEX_MAGIC, sizeof(magic)) != 0 ||
+        !read_field(ifs, version) || version != RB_INDEX_VERSION || !read_field(ifs, count)) {
+        RBLog("ScanIndex >> Index " + index_path.string() + " is not valid, ignoring it", LogLevel::ERROR);
+        return;
+    }
+
+    // the counts read are checked against the file before anything is sized on them
+    boost::system::error_code ec;
+    uint64_t file_size = fs::file_size(index_path, ec);
+    if (ec || file_size < RB_INDEX_HEADER_SIZE || count > (file_size - RB_INDEX_HEADER_SIZE) / RB_INDEX_MIN_ENTRY_SIZE) {
+        RBLog("ScanIndex >> Index " + index_path.string() + " is corrupted, ignoring it", LogLevel::ERROR);
+        return;
+    }
+
+    entries.reserve(count);
+    std::string path;
+    for (uint64_t i = 0; i < count; i++) {
+        uint32_t path_len;
+        uint8_t hash_len;
+        index_entry entry{};
+        bool ok = read_field(ifs, path_len) &&
+                  read_field(ifs, entry.stat.inode) &&
+                  read_field(ifs, entry.stat.size) &&
+                  read_field(ifs, entry.stat.mtime_ns) &&
+                  read_field(ifs, entry.stat.ctime_ns) &&
+                  read_field(ifs, entry.checksum) &&
+                  read_field(ifs, hash_len);
+        // a longer path can't be on disk, the index is corrupted
+        if (ok && path_len > PATH_MAX) {
+            RBLog("ScanIndex >> Index " + index_path.string() + " is corrupted, ignoring it", LogLevel::ERROR);
+            entries.clear();
+            return;
+        }
+        if (ok) {
+            path.resize(path_len);
+            entry.object_hash.resize(hash_len);
+            ok = ifs.read(&path[0], path_len) && ifs.read(&entry.object_hash[0], hash_len);
+        }
+        if (!ok) {
+            RBLog("ScanIndex >> Index " + index_path.string() + " is truncated, ignoring it", LogLevel::ERROR);
+            entries.clear();
+            return;
+        }
+        entries.emplace(path, entry);
+    }
+
+    RBLog("ScanIndex >> Loaded " + std::to_string(entries.size()) + " entries", LogLevel::INFO);
+}
+
+void ScanIndex::save() {
+    fs::path tmp_path = index_path;
+    tmp_path += ".tmp";
+
+    {
+        std::vector<char> io_buffer(RB_INDEX_IO_BUFFER);
+        std::ofstream ofs;
+        ofs.rdbuf()->pubsetbuf(&io_buffer[0], io_buffer.size());
+        ofs.open(tmp_path.string(), std::ios::binary | std::ios::trunc);
+        if (!ofs) {
+            RBLog("ScanIndex >> Cannot write index " + tmp_path.string(), LogLevel::ERROR);
+            return;
+        }
+
+        ofs.write(RB_INDEX_MAGIC, 8);
+        write_field(ofs, uint32_t(RB_INDEX_VERSION));
+        write_field(ofs, uint64_t(entries.size()));
+        for (auto &[path, entry] : entries) {
+            write_field(ofs, uint32_t(path.size()));
+            write_field(ofs, entry.stat.inode);
+            write_field(ofs, entry.stat.size);
+            write_field(ofs, entry.stat.mtime_ns);
+            write_field(ofs, entry.stat.ctime_ns);
+            write_field(ofs, entry.checksum);
+            write_field(ofs, uint8_t(entry.object_hash.size()));
+            ofs.write(path.data(), path.size());
+            ofs.write(entry.object_hash.data(), entry.object_hash.size());
+        }
+
+        ofs.close();
+        if (!ofs) {
+            RBLog("ScanIndex >> Error writing index " + tmp_path.string(), LogLevel::ERROR);
+            return;
+        }
+    }
+
+    boost::system::error_code ec;
+    fs::rename(tmp_path, index_path, ec);
+    if (ec) {
+        RBLog("ScanIndex >> Cannot replace index: " + ec.message(), LogLevel::ERROR);
+        return;
+    }
+    dirty = false;
+}
+
+bool ScanIndex::lookup(const std::string &path, const file_stat &st, uint32_t &checksum, std::string &object_hash) const {
+    auto it = entries.find(path);
+    if (it == entries.end() || it->second.stat != st) return false;
+    checksum = it->second.checksum;
+    object_hash = it->second.object_hash;
+    return true;
+}
+
+void ScanIndex::update(const std::string &path, const file_stat &st, uint32_t checksum, const std::string &object_hash) {
+    entries[path] = index_entry{st, checksum, object_hash};
+    dirty = true;
+}
+
+void ScanIndex::remove(const std::string &path) {
+    if (entries.erase(path)) dirty = true;
+}
+
+void ScanIndex::prune(const std::function<bool(const std::string &)> &is_stale) {
+    auto it = entries.begin();
+    while (it != entries.end()) {
+        if (is_stale(it->first)) {
+            it = entries.erase(it);
+            dirty = true;
+        } else {
+            it++;
+        }
+    }
+}
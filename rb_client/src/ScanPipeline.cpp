@@ -0,0 +1,186 @@
+#include "ScanPipeline.h"
+#include "RBHelpers.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#define RB_SCAN_MAX_ENUM_WORKERS 4
+// every queued file is accounted at least this size, so that the
+// queue of small files is bounded as well
+#define RB_SCAN_MIN_FILE_COST 4096
+
+namespace {
+    struct scan_item {
+        std::string path;
+        file_stat stat;
+        uint32_t checksum;
+        std::string object_hash;
+        bool hashed;
+    };
+}
+
+ScanPipeline::ScanPipeline(int hash_workers, uint64_t max_inflight_bytes)
+    : hash_workers(std::max(hash_workers, 1)),
+      enum_workers(std::min(std::max(hash_workers, 1), RB_SCAN_MAX_ENUM_WORKERS)),
+      max_inflight_bytes(std::max<uint64_t>(max_inflight_bytes, RB_SCAN_MIN_FILE_COST)) {}
+
+void ScanPipeline::run(const std::vector<fs::path> &dirs, const std::vector<fs::path> &files,
+                       uint64_t object_hash_min_size, const filter_t &filter, const lookup_t &lookup, const sink_t &sink) {
+    std::mutex m;
+    std::condition_variable dir_cv, hash_cv, budget_cv, done_cv;
+
+    std::deque<fs::path> dir_queue(dirs.begin(), dirs.end());
+    int busy_dirs = 0;
+    bool enum_done = false;
+
+    std::deque<scan_item> hash_queue;
+    uint64_t inflight_bytes = 0;
+    int hashing = 0;
+
+    std::deque<scan_item> done_queue;
+
+    auto cost = [](const scan_item &item) {
+        return std::max<uint64_t>(item.stat.size, RB_SCAN_MIN_FILE_COST);
+    };
+
+    // Stage 1 helper: resolve a file by lookup or queue it for hashing
+    auto process_file = [&](const fs::path &path, std::vector<scan_item> &resolved) {
+        scan_item item{path.string(), {}, 0, {}, false};
+        if (!get_file_stat(path, item.stat)) return;
+
+        if (lookup(item.path, item.stat, item.checksum, item.object_hash)) {
+            resolved.push_back(std::move(item));
+            return;
+        }
+
+        std::unique_lock ul(m);
+        budget_cv.wait(ul, [&]() {
+            return inflight_bytes == 0 || inflight_bytes + cost(item) <= max_inflight_bytes;
+        });
+        inflight_bytes += cost(item);
+        hash_queue.push_back(std::move(item));
+        hash_cv.notify_one();
+    };
+
+    auto enumerator = [&]() {
+        while (true) {
+            fs::path dir;
+            {
+                std::unique_lock ul(m);
+                dir_cv.wait(ul, [&]() { return !dir_queue.empty() || busy_dirs == 0; });
+                if (dir_queue.empty()) {
+                    if (!enum_done) {
+                        enum_done = true;
+                        dir_cv.notify_all();
+                        hash_cv.notify_all();
+                        done_cv.notify_all();
+                    }
+                    return;
+                }
+                dir = std::move(dir_queue.front());
+                dir_queue.pop_front();
+                busy_dirs++;
+            }
+
+            std::vector<fs::path> subdirs;
+            std::vector<scan_item> resolved;
+            boost::system::error_code ec;
+            for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+                boost::system::error_code st_ec;
+                auto status = it->symlink_status(st_ec);
+                if (st_ec) continue;
+                if (fs::is_directory(status)) {
+                    subdirs.push_back(it->path());
+                } else if (fs::is_regular_file(it->path(), st_ec) && filter(it->path())) {
+                    process_file(it->path(), resolved);
+                }
+            }
+            if (ec)
+                RBLog("Scanner >> Cannot read directory " + dir.string() + ": " + ec.message(), LogLevel::ERROR);
+
+            std::lock_guard lg(m);
+            for (auto &subdir : subdirs) dir_queue.push_back(std::move(subdir));
+            for (auto &item : resolved) done_queue.push_back(std::move(item));
+            busy_dirs--;
+            dir_cv.notify_all();
+            if (!resolved.empty()) done_cv.notify_one();
+        }
+    };
+
+    // Stage 2: hashing workers
+    auto hasher = [&]() {
+        while (true) {
+            scan_item item;
+            {
+                std::unique_lock ul(m);
+                hash_cv.wait(ul, [&]() { return !hash_queue.empty() || enum_done; });
+                if (hash_queue.empty()) return;
+                item = std::move(hash_queue.front());
+                hash_queue.pop_front();
+                hashing++;
+            }
+
+            bool ok = true;
+            try {
+                bool object = object_hash_min_size != 0 && item.stat.size >= object_hash_min_size;
+                item.checksum = calculate_checksum(item.path, object ? &item.object_hash : nullptr);
+                item.hashed = true;
+            } catch (std::exception &e) {
+                // the file may have been removed or truncated in the meantime
+                RBLog("Scanner >> Cannot hash " + item.path + ": " + e.what(), LogLevel::DEBUG);
+                ok = false;
+            }
+
+            std::lock_guard lg(m);
+            inflight_bytes -= cost(item);
+            hashing--;
+            if (ok) done_queue.push_back(std::move(item));
+            budget_cv.notify_all();
+            done_cv.notify_one();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    // the single files are fed by one extra thread, so the caller can start draining right away
+    busy_dirs++;
+    threads.emplace_back([&]() {
+        std::vector<scan_item> resolved;
+        for (auto &file : files) {
+            boost::system::error_code ec;
+            if (fs::is_regular_file(file, ec) && filter(file))
+                process_file(file, resolved);
+        }
+        std::lock_guard lg(m);
+        for (auto &item : resolved) done_queue.push_back(std::move(item));
+        busy_dirs--;
+        dir_cv.notify_all();
+        done_cv.notify_one();
+    });
+    for (int i = 0; i < enum_workers; i++) threads.emplace_back(enumerator);
+    for (int i = 0; i < hash_workers; i++) threads.emplace_back(hasher);
+
+    // Stage 3: insertion, on the calling thread
+    while (true) {
+        std::deque<scan_item> batch;
+        {
+            std::unique_lock ul(m);
+            done_cv.wait(ul, [&]() {
+                return !done_queue.empty() || (enum_done && hash_queue.empty() && hashing == 0);
+            });
+            if (done_queue.empty()) break;
+            batch.swap(done_queue);
+        }
+        for (auto &item : batch) {
+            try {
+                sink(item.path, item.stat, item.checksum, item.object_hash, item.hashed);
+            } catch (std::exception &e) {
+                RBLog("Scanner >> Error while processing " + item.path + ": " + e.what(), LogLevel::ERROR);
+            }
+        }
+    }
+
+    for (auto &t : threads) t.join();
+}
@@ -28,12 +28,34 @@ int main(int argc, char **argv) {
     config["username"] = "";
     config["password"] = "";
     config["watcher_interval"] = "3000";
-    config["sender_threads_num"] = std::to_string(n_cpu_thrds);
-
+    config["watcher_mode"] = "inotify";   // inotify | polling
+    config["index_file"] = "./rbclient.index";
+    config["scan_threads"] = std::to_string(n_cpu_thrds);
+    config["scan_inflight_mb"] = "256";
+    config["max_transfers"] = "64";       // files uploaded or removed at the same time
+    config["disk_threads"] = std::to_string(n_cpu_thrds);
+    config["upload_window"] = "8";
+    config["upload_stripes"] = "4";
+    config["restore_files"] = "16";      // files restored at the same time
+    config["restore_segments"] = "4";
+    config["pool_max_idle"] = "64";       // idle connections kept open
+    config["pool_idle_timeout_secs"] = "60";
+    config["pool_keepalive_secs"] = "15"; // 0 disables the keep-alive NOPs
+
+    RBLog("Main >> CRC32 kernel: " + std::string(crc32_kernel_name()), LogLevel::DEBUG);
     RBLog("Main >> Reading config...", LogLevel::INFO);
     config.load(CONFIG_FILE_PATH);
     config.store(CONFIG_FILE_PATH);
 
+    WatcherMode watcher_mode = WatcherMode::INOTIFY;
+    if (config["watcher_mode"] == "polling") {
+        watcher_mode = WatcherMode::POLLING;
+    } else if (config["watcher_mode"] != "inotify") {
+        RBLog("Main >> Invalid value of property <watcher_mode>: " + config["watcher_mode"] +
+              " (expected inotify or polling)", LogLevel::ERROR);
+        exit(-2);
+    }
+
     fs::path root_folder(config["root_folder"]);
     fs::create_directory(root_folder);   // directory is created only if not already present
 
@@ -51,7 +73,19 @@ int main(int argc, char **argv) {
         config["username"], config["password"],
         restore_option,
         std::chrono::milliseconds(config.get_numeric("watcher_interval")),
-        config.get_numeric("sender_threads_num")
+        watcher_mode,
+        config["index_file"],
+        config.get_numeric("scan_threads"),
+        uint64_t(config.get_numeric("scan_inflight_mb")) * 1024 * 1024,
+        config.get_numeric("max_transfers"),
+        config.get_numeric("disk_threads"),
+        config.get_numeric("upload_window"),
+        config.get_numeric("upload_stripes"),
+        config.get_numeric("restore_files"),
+        config.get_numeric("restore_segments"),
+        config.get_numeric("pool_max_idle"),
+        std::chrono::seconds(config.get_numeric("pool_idle_timeout_secs")),
+        std::chrono::seconds(config.get_numeric("pool_keepalive_secs"))
     );
 
     std::mutex waiter;
@@ -39,7 +39,7 @@ public:
         atomic_map<K,V> &m;
     };
     
-    atomic_map<K, V>(size_t limit) : limit(limit){};
+    atomic_map(size_t limit) : limit(limit){};
 
     guard make_guard(K &key, V &value) {
         return guard(*this, key, value);
@@ -64,6 +64,13 @@ public:
         return map.find(key) != map.end();
     }
 
+    // Some key starts with prefix, for string keys
+    bool has_prefix(const K &prefix) {
+        std::shared_lock<std::shared_mutex> slock(m);
+        auto it = map.lower_bound(prefix);
+        return it != map.end() && it->first.compare(0, prefix.size(), prefix) == 0;
+    }
+
     V get(K key) {
         std::shared_lock<std::shared_mutex> slock(m);
         return map[key];
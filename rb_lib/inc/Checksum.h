@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32 (IEEE 802.3, reflected 0xEDB88320), bit-identical to boost::crc_32_type.
+// The kernel is chosen at startup: carry-less multiplication folding (PCLMULQDQ)
+// when the CPU supports it, slicing-by-8 tables otherwise.
+
+// Continues the checksum crc (0 for a new one) over len bytes of data
+std::uint32_t rb_crc32(std::uint32_t crc, const void *data, std::size_t len);
+
+// Checksum of the concatenation A|B, given crc1 = crc(A), crc2 = crc(B) and len2 = length of B
+std::uint32_t crc32_combine(std::uint32_t crc1, std::uint32_t crc2, std::uint64_t len2);
+
+// Name of the kernel selected for this CPU, for logging
+const char *crc32_kernel_name();
+
+// Drop-in replacement for boost::crc_32_type
+class RBCrc32 {
+public:
+    void process_bytes(const void *data, std::size_t len) { value = rb_crc32(value, data, len); }
+    std::uint32_t checksum() const { return value; }
+    void reset() { value = 0; }
+
+private:
+    std::uint32_t value = 0;
+};
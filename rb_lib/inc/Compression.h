@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "rbproto.pb.h"
+
+// Segment compression. The codecs are optional at build time: RB_WITH_ZSTD and
+// RB_WITH_LZ4 are defined by CMake when the libraries are found, and only the
+// compiled codecs are advertised during authentication.
+
+// A compressed segment has to save at least this fraction of its size, or it's sent raw
+#define RB_COMPRESSION_MIN_GAIN 0.1
+#define RB_ZSTD_LEVEL 3
+
+// Codecs compiled in, in order of preference
+const std::vector<RBCompression> &available_codecs();
+bool codec_available(RBCompression codec);
+// Capability advertising the codec
+RBCapability codec_capability(RBCompression codec);
+const char *codec_name(RBCompression codec);
+
+// Compresses in into out, returning false (out unspecified) if that doesn't save RB_COMPRESSION_MIN_GAIN
+bool rb_compress(RBCompression codec, const std::string &in, std::string &out);
+// It throws an RBException if data is corrupted or doesn't decompress to exactly raw_size bytes
+std::string rb_decompress(RBCompression codec, std::string_view in, size_t raw_size);
+
+// Replaces the segment's data with its compressed form if it pays off, telling if it did.
+// The data is left in a single entry
+bool compress_segment(RBCompression codec, RBFileSegment &segment);
+// The segment's data, decompressed if needed. It points into the segment when its data is a
+// single raw entry, as senders make it, otherwise into scratch. It throws an RBException for
+// invalid segments
+std::string_view segment_payload(const RBFileSegment &segment, std::string &scratch);
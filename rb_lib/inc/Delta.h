@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// rsync-style delta transfer helpers, shared by client and server.
+// The server describes its copy of a file as a list of fixed-size blocks, each one
+// with a weak rolling checksum and a strong hash; the client slides a window over
+// its version looking for those blocks and sends only what doesn't match.
+
+#define RB_DELTA_MIN_BLOCK_SIZE (2 * 1024)
+#define RB_DELTA_MAX_BLOCK_SIZE (128 * 1024)
+// Bytes of the SHA-256 digest kept as the strong signature of a block
+#define RB_DELTA_STRONG_SIZE 16
+
+// Block size used for a file of the given size: about sqrt(size), as rsync does,
+// which balances the signature list against the literal data around each edit
+std::uint32_t delta_block_size(std::uint64_t file_size);
+
+std::string delta_strong_hash(const void *data, std::size_t len);
+
+// Adler-like checksum of a window, updatable in O(1) while the window slides by one byte
+class RollingChecksum {
+public:
+    void reset(const unsigned char *data, std::size_t len);
+    // Slides the window: out leaves at the front, in enters at the back
+    void roll(unsigned char out, unsigned char in) {
+        a += in - out;
+        b += a - static_cast<std::uint32_t>(len) * out;
+    }
+    std::uint32_t digest() const { return (a & 0xffff) | (b << 16); }
+
+private:
+    std::uint32_t a = 0;
+    std::uint32_t b = 0;
+    std::size_t len = 0;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Merkle tree of a set of files by directory, shared by client and server (CAP_TREE_PROBE).
+// The summary of a directory is the sum of the SHA-256 of its entries: its files, with their
+// checksum and size, and its subdirectories, with their own summary. The last write time is
+// left out: a file whose content didn't change isn't sent again, whatever its time.
+// A sum doesn't depend on the order of the entries and is updated without rehashing
+// the others, an empty directory sums to zero and isn't an entry of its parent.
+
+// Summary of a directory, the digests of its entries added in four 64-bit lanes
+struct tree_hash {
+    std::uint64_t lanes[4] = {};
+
+    void add(const tree_hash &other);
+    bool empty() const;
+    bool operator==(const tree_hash &other) const;
+    // 32 bytes, little-endian lanes
+    std::string bytes() const;
+    // Parses bytes(), anything that isn't 32 bytes long is the empty summary
+    static tree_hash from_bytes(const std::string &bytes);
+};
+
+tree_hash file_entry_hash(std::string_view name, std::uint32_t checksum, std::uint64_t size);
+tree_hash dir_entry_hash(std::string_view name, const tree_hash &summary);
+
+// Directory holding a relative path, "" for the root, and its name in it
+std::string_view parent_dir(std::string_view path);
+std::string_view base_name(std::string_view path);
+// Relative path of the entry name of dir
+std::string child_path(std::string_view dir, std::string_view name);
+// Levels of the directory below the root, 0 for the root itself
+std::size_t dir_depth(std::string_view path);
+
+class DirTree {
+public:
+    struct dir_node {
+        tree_hash files;                      // sum of the entries of its files
+        std::size_t file_count = 0;
+        tree_hash summary;                    // of the whole subtree, updated by sum
+        std::set<std::string> subdirs;        // names
+        std::vector<std::string> file_names;  // only if the tree keeps them
+    };
+
+    explicit DirTree(bool keep_file_names = false);
+
+    // Adds a file by relative path, and the directories up to it
+    void add_file(std::string_view path, std::uint32_t checksum, std::uint64_t size);
+    // The directory, added with its parents if it's missing
+    dir_node &add_dir(std::string_view path);
+    dir_node *find(const std::string &path);
+    // Updates the summary of the directory from its files and the summaries of its subdirectories
+    void sum(const std::string &path);
+    // Updates every summary, the deepest directories first
+    void sum_all();
+    // Removes the directory and its subtree, the root is only emptied
+    void remove_dir(const std::string &path);
+    void clear();
+
+private:
+    bool keep_file_names;
+    std::unordered_map<std::string, dir_node> dirs;
+};
@@ -11,4 +11,15 @@ namespace google::protobuf::io {
     bool readDelimitedFrom(
         google::protobuf::MessageLite* message,
         google::protobuf::io::ZeroCopyInputStream* rawInput);
+
+    // Reads the size prefix of a delimited message from a buffer holding its first
+    // bytes. False while the prefix isn't all there; a prefix is at most 5 bytes long.
+    bool readDelimitedSize(
+        const void* data, size_t size,
+        uint32_t* message_size, size_t* prefix_size);
+
+    // Serializes a delimited message into a buffer, for asynchronous writes.
+    bool serializeDelimited(
+        const google::protobuf::MessageLite& message,
+        std::string* output);
 }
\ No newline at end of file
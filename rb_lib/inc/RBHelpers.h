@@ -1,6 +1,7 @@
 #pragma once
 
-#include <boost/crc.hpp>
+#include "Checksum.h"
+#include <utility>  // boost::asio's awaitable.hpp uses std::exchange without including it
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
 #include <exception>
@@ -54,8 +55,29 @@ public:
 
 // Utils function shared between client and server
 int count_segments(uint64_t size);
-// It can throw a runtime error because of file errors
-std::uint32_t calculate_checksum(const fs::path &file_path);
+// It can throw a runtime error because of file errors.
+// With object_hash, its strong_hash is calculated in the same read
+std::uint32_t calculate_checksum(const fs::path &file_path, std::string *object_hash = nullptr);
+// SHA-256 digest (32 raw bytes), used to identify contents
+std::string strong_hash(const void *data, std::size_t len);
+std::string to_hex(const std::string &bytes);
+
+struct evp_md_ctx_st;
+
+// Incremental strong_hash, for contents that don't fit in memory
+class RBSha256 {
+public:
+    RBSha256();
+    ~RBSha256();
+    RBSha256(const RBSha256 &) = delete;
+    RBSha256 &operator=(const RBSha256 &) = delete;
+
+    void process_bytes(const void *data, std::size_t len);
+    std::string digest();
+
+private:
+    evp_md_ctx_st *ctx;
+};
 
 void validateRBProto(RBRequest &, RBMsgType, int ver, bool exactVer = false);
 void validateRBProto(RBResponse &, RBMsgType, int ver, bool exactVer = false);
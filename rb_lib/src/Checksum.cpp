@@ -0,0 +1,237 @@
+#include "Checksum.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define RB_CRC32_HAS_PCLMUL 1
+#include <immintrin.h>
+#endif
+
+#define RB_CRC32_POLY 0xedb88320u
+// below this size the table kernel is faster than setting up the folding
+#define RB_CRC32_PCLMUL_MIN_LEN 64
+
+namespace {
+
+struct crc32_tables {
+    std::uint32_t slice[8][256];
+    // x2n[k] = x^(2^k) mod P, used to shift a crc by a number of zero bytes
+    std::uint32_t x2n[32];
+
+    crc32_tables();
+};
+
+// a(x) * b(x) mod P(x), in the reflected domain
+std::uint32_t multmodp(std::uint32_t a, std::uint32_t b) {
+    std::uint32_t m = 1u << 31;
+    std::uint32_t p = 0;
+    while (true) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ RB_CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+crc32_tables::crc32_tables() {
+    for (std::uint32_t n = 0; n < 256; n++) {
+        std::uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ RB_CRC32_POLY : c >> 1;
+        slice[0][n] = c;
+    }
+    for (std::uint32_t n = 0; n < 256; n++) {
+        std::uint32_t c = slice[0][n];
+        for (int k = 1; k < 8; k++) {
+            c = slice[0][c & 0xff] ^ (c >> 8);
+            slice[k][n] = c;
+        }
+    }
+
+    std::uint32_t p = 1u << 30;  // x^1
+    x2n[0] = p;
+    for (int k = 1; k < 32; k++)
+        x2n[k] = p = multmodp(p, p);
+}
+
+const crc32_tables tables;
+
+// Kernels work on the pre-inverted crc register
+
+std::uint32_t crc32_bytes(std::uint32_t c, const unsigned char *buf, std::size_t len) {
+    while (len--)
+        c = tables.slice[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+std::uint32_t crc32_slice8(std::uint32_t c, const unsigned char *buf, std::size_t len) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    auto &t = tables.slice;
+    while (len >= 8) {
+        std::uint32_t one, two;
+        std::memcpy(&one, buf, 4);
+        std::memcpy(&two, buf + 4, 4);
+        one ^= c;
+        c = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+            t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+        buf += 8;
+        len -= 8;
+    }
+#endif
+    return crc32_bytes(c, buf, len);
+}
+
+#ifdef RB_CRC32_HAS_PCLMUL
+
+// Folding with carry-less multiplication, from Intel's "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction". len must be a multiple of 16, at least 64
+__attribute__((target("pclmul,sse4.1")))
+std::uint32_t crc32_pclmul_fold(std::uint32_t crc, const unsigned char *buf, std::size_t len) {
+    alignas(16) static const std::uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const std::uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const std::uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const std::uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x00));
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x10));
+    x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x20));
+    x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+    buf += 64;
+    len -= 64;
+
+    // fold 4x128 bits in parallel
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        y5 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x00));
+        y6 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x10));
+        y7 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x20));
+        y8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + 0x30));
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+        buf += 64;
+        len -= 64;
+    }
+
+    // fold into 128 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // single fold of the remaining 16 bytes blocks
+    while (len >= 16) {
+        x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf));
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        buf += 16;
+        len -= 16;
+    }
+
+    // fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return static_cast<std::uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+std::uint32_t crc32_pclmul(std::uint32_t c, const unsigned char *buf, std::size_t len) {
+    if (len >= RB_CRC32_PCLMUL_MIN_LEN) {
+        std::size_t chunk = len & ~std::size_t(15);
+        c = crc32_pclmul_fold(c, buf, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+    return crc32_slice8(c, buf, len);
+}
+
+#endif
+
+struct crc32_kernel {
+    std::uint32_t (*fn)(std::uint32_t, const unsigned char *, std::size_t);
+    const char *name;
+};
+
+crc32_kernel select_kernel() {
+#ifdef RB_CRC32_HAS_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        return {crc32_pclmul, "pclmul"};
+#endif
+    return {crc32_slice8, "slice8"};
+}
+
+const crc32_kernel kernel = select_kernel();
+
+}  // namespace
+
+
+std::uint32_t rb_crc32(std::uint32_t crc, const void *data, std::size_t len) {
+    return ~kernel.fn(~crc, static_cast<const unsigned char *>(data), len);
+}
+
+std::uint32_t crc32_combine(std::uint32_t crc1, std::uint32_t crc2, std::uint64_t len2) {
+    // crc1 * x^(8 * len2) mod P: shift crc1 past len2 zero bytes
+    std::uint32_t p = 1u << 31;  // x^0
+    unsigned k = 3;
+    while (len2) {
+        if (len2 & 1)
+            p = multmodp(tables.x2n[k & 31], p);
+        len2 >>= 1;
+        k++;
+    }
+    return multmodp(p, crc1) ^ crc2;
+}
+
+const char *crc32_kernel_name() {
+    return kernel.name;
+}
@@ -0,0 +1,146 @@
+#include "Compression.h"
+
+#include "RBHelpers.h"
+
+#ifdef RB_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef RB_WITH_LZ4
+#include <lz4.h>
+#endif
+
+const std::vector<RBCompression> &available_codecs() {
+    static const std::vector<RBCompression> codecs = {
+#ifdef RB_WITH_ZSTD
+        RBCompression::COMP_ZSTD,
+#endif
+#ifdef RB_WITH_LZ4
+        RBCompression::COMP_LZ4,
+#endif
+    };
+    return codecs;
+}
+
+bool codec_available(RBCompression codec) {
+    for (auto available : available_codecs())
+        if (available == codec) return true;
+    return false;
+}
+
+RBCapability codec_capability(RBCompression codec) {
+    switch (codec) {
+    case RBCompression::COMP_ZSTD:
+        return RBCapability::CAP_COMPRESSION_ZSTD;
+    case RBCompression::COMP_LZ4:
+        return RBCapability::CAP_COMPRESSION_LZ4;
+    default:
+        return RBCapability::CAP_NONE;
+    }
+}
+
+const char *codec_name(RBCompression codec) {
+    switch (codec) {
+    case RBCompression::COMP_ZSTD:
+        return "zstd";
+    case RBCompression::COMP_LZ4:
+        return "lz4";
+    default:
+        return "none";
+    }
+}
+
+bool rb_compress(RBCompression codec, const std::string &in, [[maybe_unused]] std::string &out) {
+    size_t max_size = in.size() - static_cast<size_t>(in.size() * RB_COMPRESSION_MIN_GAIN);
+    if (in.empty() || max_size == 0) return false;
+
+    switch (codec) {
+#ifdef RB_WITH_ZSTD
+    case RBCompression::COMP_ZSTD: {
+        out.resize(ZSTD_compressBound(in.size()));
+        size_t len = ZSTD_compress(&out[0], out.size(), in.data(), in.size(), RB_ZSTD_LEVEL);
+        if (ZSTD_isError(len) || len > max_size) return false;
+        out.resize(len);
+        return true;
+    }
+#endif
+#ifdef RB_WITH_LZ4
+    case RBCompression::COMP_LZ4: {
+        // the output is bounded to max_size: LZ4 gives up as soon as it doesn't fit
+        out.resize(max_size);
+        int len = LZ4_compress_default(in.data(), &out[0], static_cast<int>(in.size()), static_cast<int>(max_size));
+        if (len <= 0) return false;
+        out.resize(len);
+        return true;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+std::string rb_decompress(RBCompression codec, [[maybe_unused]] std::string_view in, size_t raw_size) {
+    std::string out(raw_size, 0);
+
+    switch (codec) {
+#ifdef RB_WITH_ZSTD
+    case RBCompression::COMP_ZSTD: {
+        size_t len = ZSTD_decompress(&out[0], out.size(), in.data(), in.size());
+        if (ZSTD_isError(len) || len != raw_size)
+            throw RBException("invalid_compressed_data");
+        return out;
+    }
+#endif
+#ifdef RB_WITH_LZ4
+    case RBCompression::COMP_LZ4: {
+        int len = LZ4_decompress_safe(in.data(), &out[0], static_cast<int>(in.size()), static_cast<int>(raw_size));
+        if (len < 0 || static_cast<size_t>(len) != raw_size)
+            throw RBException("invalid_compressed_data");
+        return out;
+    }
+#endif
+    default:
+        throw RBException("unsupported_compression");
+    }
+}
+
+bool compress_segment(RBCompression codec, RBFileSegment &segment) {
+    if (segment.data_size() == 0) return false;
+    if (segment.data_size() > 1) {
+        std::string raw;
+        for (const auto &datum : segment.data())
+            raw += datum;
+        segment.clear_data();
+        segment.add_data(std::move(raw));
+    }
+
+    // the compressed form is built in a buffer kept by the thread, then swapped with
+    // the segment's one: senders reusing their message don't allocate for each segment
+    thread_local std::string packed;
+    auto &raw = *segment.mutable_data(0);
+    if (!rb_compress(codec, raw, packed)) return false;
+
+    segment.set_raw_size(raw.size());
+    raw.swap(packed);
+    segment.set_compression(codec);
+    return true;
+}
+
+std::string_view segment_payload(const RBFileSegment &segment, std::string &scratch) {
+    std::string_view payload;
+    if (segment.data_size() == 1) {
+        payload = segment.data(0);
+    } else {
+        scratch.clear();
+        for (const auto &datum : segment.data())
+            scratch += datum;
+        payload = scratch;
+    }
+    if (segment.compression() == RBCompression::COMP_NONE) return payload;
+
+    if (!codec_available(segment.compression()))
+        throw RBException("unsupported_compression");
+    if (segment.raw_size() > RB_MAX_SEGMENT_SIZE)
+        throw RBException("invalid_compressed_data");
+    scratch = rb_decompress(segment.compression(), payload, segment.raw_size());
+    return scratch;
+}
@@ -0,0 +1,24 @@
+#include "Delta.h"
+
+#include "RBHelpers.h"
+
+std::uint32_t delta_block_size(std::uint64_t file_size) {
+    std::uint64_t size = RB_DELTA_MIN_BLOCK_SIZE;
+    while (size < RB_DELTA_MAX_BLOCK_SIZE && size * size < file_size)
+        size *= 2;
+    return static_cast<std::uint32_t>(size);
+}
+
+std::string delta_strong_hash(const void *data, std::size_t len) {
+    return strong_hash(data, len).substr(0, RB_DELTA_STRONG_SIZE);
+}
+
+void RollingChecksum::reset(const unsigned char *data, std::size_t len) {
+    this->len = len;
+    a = 0;
+    b = 0;
+    for (std::size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += a;
+    }
+}
@@ -0,0 +1,160 @@
+#include "DirTree.h"
+
+#include <algorithm>
+
+#include "RBHelpers.h"
+
+namespace {
+
+void put_le(std::string &out, std::uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+std::uint64_t get_le(const char *data) {
+    std::uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | static_cast<unsigned char>(data[i]);
+    return value;
+}
+
+// The digest of an encoded entry, read as the lanes of a summary
+tree_hash entry_hash(const std::string &entry) {
+    std::string digest = strong_hash(entry.data(), entry.size());
+    return tree_hash::from_bytes(digest);
+}
+
+}
+
+void tree_hash::add(const tree_hash &other) {
+    for (int i = 0; i < 4; i++)
+        lanes[i] += other.lanes[i];
+}
+
+bool tree_hash::empty() const {
+    return !lanes[0] && !lanes[1] && !lanes[2] && !lanes[3];
+}
+
+bool tree_hash::operator==(const tree_hash &other) const {
+    return std::equal(lanes, lanes + 4, other.lanes);
+}
+
+std::string tree_hash::bytes() const {
+    std::string out;
+    out.reserve(32);
+    for (auto lane : lanes)
+        put_le(out, lane, 8);
+    return out;
+}
+
+tree_hash tree_hash::from_bytes(const std::string &bytes) {
+    tree_hash hash;
+    if (bytes.size() != 32) return hash;
+    for (int i = 0; i < 4; i++)
+        hash.lanes[i] = get_le(bytes.data() + 8 * i);
+    return hash;
+}
+
+tree_hash file_entry_hash(std::string_view name, std::uint32_t checksum, std::uint64_t size) {
+    std::string entry = "f";
+    entry.append(name);
+    entry.push_back('\0');
+    put_le(entry, checksum, 4);
+    put_le(entry, size, 8);
+    return entry_hash(entry);
+}
+
+tree_hash dir_entry_hash(std::string_view name, const tree_hash &summary) {
+    std::string entry = "d";
+    entry.append(name);
+    entry.push_back('\0');
+    entry += summary.bytes();
+    return entry_hash(entry);
+}
+
+std::string_view parent_dir(std::string_view path) {
+    auto pos = path.rfind('/');
+    return pos == std::string_view::npos ? std::string_view() : path.substr(0, pos);
+}
+
+std::string_view base_name(std::string_view path) {
+    auto pos = path.rfind('/');
+    return pos == std::string_view::npos ? path : path.substr(pos + 1);
+}
+
+std::string child_path(std::string_view dir, std::string_view name) {
+    std::string path(dir);
+    if (!path.empty()) path.push_back('/');
+    path.append(name);
+    return path;
+}
+
+std::size_t dir_depth(std::string_view path) {
+    return path.empty() ? 0 : std::count(path.begin(), path.end(), '/') + 1;
+}
+
+DirTree::DirTree(bool keep_file_names) : keep_file_names(keep_file_names) {
+    dirs[""];
+}
+
+void DirTree::add_file(std::string_view path, std::uint32_t checksum, std::uint64_t size) {
+    auto name = base_name(path);
+    auto &dir = add_dir(parent_dir(path));
+    dir.files.add(file_entry_hash(name, checksum, size));
+    dir.file_count++;
+    if (keep_file_names)
+        dir.file_names.emplace_back(name);
+}
+
+DirTree::dir_node &DirTree::add_dir(std::string_view path) {
+    auto it = dirs.find(std::string(path));
+    if (it != dirs.end()) return it->second;
+
+    add_dir(parent_dir(path)).subdirs.emplace(base_name(path));
+    return dirs[std::string(path)];
+}
+
+DirTree::dir_node *DirTree::find(const std::string &path) {
+    auto it = dirs.find(path);
+    return it == dirs.end() ? nullptr : &it->second;
+}
+
+void DirTree::sum(const std::string &path) {
+    auto &dir = dirs.at(path);
+    dir.summary = dir.files;
+    for (auto &name : dir.subdirs)
+        dir.summary.add(dir_entry_hash(name, dirs.at(child_path(path, name)).summary));
+}
+
+void DirTree::sum_all() {
+    std::vector<const std::string *> paths;
+    paths.reserve(dirs.size());
+    for (auto &[path, dir] : dirs)
+        paths.push_back(&path);
+    std::sort(paths.begin(), paths.end(), [](const std::string *a, const std::string *b) {
+        return dir_depth(*a) > dir_depth(*b);
+    });
+    for (auto path : paths)
+        sum(*path);
+}
+
+void DirTree::remove_dir(const std::string &path) {
+    auto it = dirs.find(path);
+    if (it == dirs.end()) return;
+
+    // each one erases itself from subdirs
+    auto subdirs = it->second.subdirs;
+    for (auto &name : subdirs)
+        remove_dir(child_path(path, name));
+    if (path.empty()) {
+        it->second = dir_node();
+        return;
+    }
+    dirs.at(std::string(parent_dir(path))).subdirs.erase(std::string(base_name(path)));
+    dirs.erase(it);
+}
+
+void DirTree::clear() {
+    dirs.clear();
+    dirs[""];
+}
@@ -1,5 +1,9 @@
 #include "ProtobufHelpers.h"
 
+#include <algorithm>
+
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
 namespace google::protobuf::io {
     bool writeDelimitedTo(
         const google::protobuf::MessageLite& message,
@@ -52,4 +56,21 @@ namespace google::protobuf::io {
 
         return true;
     }
-}
\ No newline at end of file
+
+    bool readDelimitedSize(
+        const void* data, size_t size,
+        uint32_t* message_size, size_t* prefix_size) {
+        google::protobuf::io::CodedInputStream input(
+            static_cast<const uint8_t*>(data), static_cast<int>(std::min<size_t>(size, 5)));
+        if (!input.ReadVarint32(message_size)) return false;
+        *prefix_size = input.CurrentPosition();
+        return true;
+    }
+
+    bool serializeDelimited(
+        const google::protobuf::MessageLite& message,
+        std::string* output) {
+        google::protobuf::io::StringOutputStream raw_output(output);
+        return writeDelimitedTo(message, &raw_output);
+    }
+}
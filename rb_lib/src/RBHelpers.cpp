@@ -1,7 +1,10 @@
 #include "RBHelpers.h"
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <openssl/evp.h>
 
 void RBLog(const std::string & s, LogLevel level) {
     // catching time
@@ -45,7 +48,7 @@ int count_segments(uint64_t size) {
 }
 
 
-std::uint32_t calculate_checksum(const fs::path &file_path) {
+std::uint32_t calculate_checksum(const fs::path &file_path, std::string *object_hash) {
     std::ifstream ifs(file_path.string(), std::ios::binary);
     if (ifs.fail())
         throw std::runtime_error("RBHelpers->Error opening file");
@@ -54,7 +57,9 @@ std::uint32_t calculate_checksum(const fs::path &file_path) {
 
     int chunk_size = 1000000;
     std::vector<char> chunk(chunk_size, 0);
-    boost::crc_32_type crc;
+    RBCrc32 crc;
+    std::unique_ptr<RBSha256> sha;
+    if (object_hash) sha = std::make_unique<RBSha256>();
 
     size_t tot_read = 0;
     size_t current_read;
@@ -70,14 +75,60 @@ std::uint32_t calculate_checksum(const fs::path &file_path) {
 
         current_read = ifs.gcount();
         crc.process_bytes(&chunk[0], current_read);
+        if (sha) sha->process_bytes(&chunk[0], current_read);
 
         tot_read += current_read;
     }
 
+    if (sha) *object_hash = sha->digest();
     return crc.checksum();
 }
 
 
+std::string strong_hash(const void *data, std::size_t len) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    if (!EVP_Digest(data, len, md, &md_len, EVP_sha256(), nullptr))
+        throw std::runtime_error("RBHelpers->Error calculating hash");
+    return std::string(reinterpret_cast<char *>(md), md_len);
+}
+
+RBSha256::RBSha256() : ctx(EVP_MD_CTX_new()) {
+    if (!ctx || !EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr)) {
+        EVP_MD_CTX_free(ctx);
+        throw std::runtime_error("RBHelpers->Error initializing hash");
+    }
+}
+
+RBSha256::~RBSha256() {
+    EVP_MD_CTX_free(ctx);
+}
+
+void RBSha256::process_bytes(const void *data, std::size_t len) {
+    if (!EVP_DigestUpdate(ctx, data, len))
+        throw std::runtime_error("RBHelpers->Error calculating hash");
+}
+
+std::string RBSha256::digest() {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    if (!EVP_DigestFinal_ex(ctx, md, &md_len))
+        throw std::runtime_error("RBHelpers->Error calculating hash");
+    return std::string(reinterpret_cast<char *>(md), md_len);
+}
+
+std::string to_hex(const std::string &bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(bytes.size() * 2);
+    for (unsigned char c : bytes) {
+        hex.push_back(digits[c >> 4]);
+        hex.push_back(digits[c & 0xf]);
+    }
+    return hex;
+}
+
+
 void validateRBProto(RBResponse & res, RBMsgType type, int ver, bool exactVer) {
     if (res.type() != type)
         throw RBProtoTypeException("unexpected_rbproto_response_type");
@@ -89,6 +140,14 @@ void validateRBProto(RBResponse & res, RBMsgType type, int ver, bool exactVer) {
 
     if (res.type() == RBMsgType::AUTH && !res.has_auth_response())
         throw RBException("invalid_rbproto_auth_response");
+    if (res.type() == RBMsgType::CHUNK_OFFER && !res.has_chunk_offer_response())
+        throw RBException("invalid_rbproto_chunk_offer_response");
+    if (res.type() == RBMsgType::SIGNATURE && !res.has_signature_response())
+        throw RBException("invalid_rbproto_signature_response");
+    if (res.type() == RBMsgType::LINK && !res.has_link_response())
+        throw RBException("invalid_rbproto_link_response");
+    if (res.type() == RBMsgType::TREE && !res.has_tree_response())
+        throw RBException("invalid_rbproto_tree_response");
 }
 
 
@@ -99,9 +158,15 @@ void validateRBProto(RBRequest & req, RBMsgType type, int ver, bool exactVer) {
         throw RBProtoVerException("unsupported_rbproto_version");
     if (type == RBMsgType::AUTH && !req.has_auth_request())
         throw RBProtoTypeException("invalid_rbproto_auth_request");
-    if ((type == RBMsgType::UPLOAD || type == RBMsgType::REMOVE || type == RBMsgType::ABORT)
-        && !req.has_file_segment())
+    if ((type == RBMsgType::UPLOAD || type == RBMsgType::REMOVE || type == RBMsgType::ABORT ||
+         type == RBMsgType::SIGNATURE || type == RBMsgType::LINK) && !req.has_file_segment())
         throw RBProtoTypeException("invalid_rbproto_file_request");
+    if (type == RBMsgType::CHUNK_OFFER && !req.has_chunk_offer())
+        throw RBProtoTypeException("invalid_rbproto_chunk_offer_request");
+    if (type == RBMsgType::CHUNK_UPLOAD && !req.has_chunk_data())
+        throw RBProtoTypeException("invalid_rbproto_chunk_upload_request");
+    if (type == RBMsgType::TREE && !req.has_tree_request())
+        throw RBProtoTypeException("invalid_rbproto_tree_request");
 }
 
 std::thread make_watchdog(
@@ -5,8 +5,12 @@
 #include <string>
 #include <sstream>
 #include <openssl/sha.h>
+#include <atomic>
 #include <chrono>
 #include <ctime>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "AsioAdapting.h"
 #include "ProtobufHelpers.h"
@@ -14,6 +18,13 @@
 #include "rbproto.pb.h"
 #include "Database.h"
 
+// Sessions unused for this long expire
+#define RB_SESSION_IDLE_TIMEOUT_SECS (7 * 24 * 3600)
+// The last use of a session is written to the database at most this often, for the expiry after a restart
+#define RB_SESSION_USE_STORE_INTERVAL_SECS 3600
+// Sessions a user can have at the same time (e.g. one per device), the least recently used go first
+#define RB_MAX_SESSIONS_PER_USER 16
+
 // Singleton implementation
 class AuthController {
 public:
@@ -28,12 +39,36 @@ public:
 
     void auth_by_credentials(std::string, std::string);
     void auth_by_token(std::string);
+    // Validates the token of a request, without touching the database
     std::string auth_get_user_by_token(const std::string&);
-    std::string generate_token(std::string);
+    // Opens a new session for the user. previous_token, the one the client had before
+    // authenticating again, is invalidated if it's one of the user's sessions
+    std::string generate_token(const std::string & username, const std::string & previous_token = "");
     std::string sha256(const std::string);
 
     void add_user(const std::string & username, const std::string & pw);
+    // Loads the sessions stored in the database, once it has been opened
+    void load_sessions();
 
 private:
     AuthController();
+
+    struct session {
+        session(const std::string & username, int64_t last_use)
+            : username(username), last_use(last_use), stored_use(last_use) {}
+        std::string username;
+        // refreshed by every request, under the shared lock
+        std::atomic<int64_t> last_use;
+        // the last use in the database
+        std::atomic<int64_t> stored_use;
+    };
+    // Authenticated sessions by token. They're stored in the sessions table too, so that
+    // they survive restarts, but tokens are only looked up here
+    std::unordered_map<std::string, session> sessions;
+    std::unordered_map<std::string, std::unordered_set<std::string>> user_sessions;
+    std::shared_mutex sessions_mutex;
+    // Called with sessions_mutex held exclusively. The token is added to dropped, to be
+    // deleted from the database by forget_sessions once the lock is released
+    void drop_session(const std::string & token, std::vector<std::string> & dropped);
+    void forget_sessions(const std::vector<std::string> & dropped);
 };
\ No newline at end of file
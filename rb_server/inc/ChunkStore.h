@@ -0,0 +1,34 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <ostream>
+#include <string>
+
+#include "RBHelpers.h"
+
+namespace fs = boost::filesystem;
+
+// Chunks older than this (since their last upload, offer or use) are collected
+#define RB_CHUNK_TTL_HOURS (24 * 30)
+
+// Content-addressed store of the chunks uploaded with CAP_CHUNKED_UPLOAD.
+// Chunks live in <root>/<username>/<hh>/<sha256 hex>, one file each. The store works
+// as a cache: every use refreshes the chunk's write time and the garbage collector
+// removes the ones that have not been used for RB_CHUNK_TTL_HOURS.
+class ChunkStore {
+public:
+    explicit ChunkStore(const fs::path &root) : root(root) {}
+
+    // Tells if the chunk is available, refreshing its age
+    bool has(const std::string &username, const std::string &hash);
+    // It throws an RBException if data doesn't match hash
+    void put(const std::string &username, const std::string &hash, const std::string &data);
+    // Appends the chunk to os, checking its size. It throws an RBException if it's missing
+    void copy_to(const std::string &username, const std::string &hash, uint32_t size, std::ostream &os);
+    void collect_garbage();
+
+private:
+    fs::path root;
+    fs::path chunk_path(const std::string &username, const std::string &hash);
+};
@@ -1,11 +1,95 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sqlite3.h>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
 #include <vector>
 
 #include "RBHelpers.h"
 
+// Prepared statements kept for reuse at most, by each connection
+#define RB_DB_STATEMENT_CACHE_MAX 64
+// Time a connection waits for a lock held by another one before failing
+#define RB_DB_BUSY_TIMEOUT_MS 5000
+// Layout of the tables, in PRAGMA user_version. Version 0 stored the numbers as TEXT
+#define RB_DB_SCHEMA_VERSION 1
+// fs rows copied to a new layout in each transaction, by the migration running in the background.
+// The server's writes wait for the batch being copied
+#define RB_DB_MIGRATION_BATCH_ROWS 2000
+// Times the migration tries to replace fs with the new table, 100ms apart
+#define RB_DB_MIGRATION_SWITCH_ATTEMPTS 50
+
+// Blob statement parameter, bound without copying it
+struct DbBlob {
+    const void *data;
+    size_t size;
+};
+
+// Statement parameter: text, integer or blob. Text and blobs refer to the caller's
+// data, which has to outlive the query
+class DbParam {
+public:
+    DbParam(const std::string & text) : value(std::string_view(text)) {}
+    DbParam(const char * text) : value(std::string_view(text)) {}
+    template <typename T, typename std::enable_if_t<std::is_integral_v<T>, int> = 0>
+    DbParam(T integer) : value(static_cast<int64_t>(integer)) {}
+    DbParam(DbBlob blob) : value(blob) {}
+
+    int bind(sqlite3_stmt * stmt, int index) const;
+
+private:
+    std::variant<std::string_view, int64_t, DbBlob> value;
+};
+
+class DbRow;
+
+// Result column, readable as text (or blob bytes) or as an integer
+class DbValue {
+public:
+    DbValue(const DbRow & row, int col);
+
+    const std::string & text() const { return text_value; }
+    // 0 for NULL and for text that isn't a number
+    int64_t int64() const { return int_value; }
+    bool is_null() const { return null; }
+
+private:
+    std::string text_value;
+    int64_t int_value;
+    bool null;
+};
+
+typedef std::unordered_map<int, std::vector<DbValue>> db_results_t;
+
+// The row a statement is on, read in place: text views are valid until the next row
+class DbRow {
+public:
+    explicit DbRow(sqlite3_stmt * stmt) : stmt(stmt) {}
+
+    // text (or blob bytes), empty for NULL
+    std::string_view text(int col) const;
+    // 0 for NULL and for text that isn't a number
+    int64_t int64(int col) const { return sqlite3_column_int64(stmt, col); }
+    bool is_null(int col) const { return sqlite3_column_type(stmt, col) == SQLITE_NULL; }
+    // NULL or empty text, which is how version 0 of the schema stored missing values
+    bool is_empty(int col) const;
+    int size() const { return sqlite3_column_count(stmt); }
+
+private:
+    sqlite3_stmt * stmt;
+};
+
+typedef std::function<void(const DbRow &)> db_row_visitor_t;
+
 // Singleton implementation
 class Database
 {
@@ -19,37 +103,81 @@ public:
     Database(Database const &) = delete;
     void operator=(Database const &) = delete;
 
-    void open();
+    // With readers > 0 the database is in WAL mode: queries run with read() use a pool of
+    // that many read-only connections, and don't wait for the writes. synchronous is the
+    // PRAGMA value, the WAL is checkpointed once it's checkpoint_pages long
+    void open(int readers = 0, const std::string &synchronous = "FULL", int checkpoint_pages = 1000);
     void close();
     void clear();
     void exec(std::string); // For statements without parameters, no returned results
-    std::unordered_map<int, std::vector<std::string>> query(const std::string &, const std::initializer_list<std::string> &, bool throwOnStep = false); // For statements with parameters, with returned results
+    db_results_t query(const std::string &, const std::initializer_list<DbParam> &, bool throwOnStep = false); // For statements with parameters, with returned results
+    // Like query, each row is given to visit as it's stepped. It sees the writes not yet committed
+    void query_each(const std::string &, const std::initializer_list<DbParam> &, const db_row_visitor_t & visit,
+                    bool throwOnStep = false);
+    // Like query, for statements that only read, on a reader connection if there are any.
+    // What the other threads are writing in a transaction isn't visible until it's committed
+    db_results_t read(const std::string &, const std::initializer_list<DbParam> &, bool throwOnStep = false);
+    // Like read, each row is given to visit as it's stepped instead of being copied in the results
+    void read_each(const std::string &, const std::initializer_list<DbParam> &, const db_row_visitor_t & visit,
+                   bool throwOnStep = false);
+    // Runs f in a single transaction, rolled back if it or the COMMIT throws. The other
+    // threads' statements on the writer connection wait for it to end
+    void transaction(const std::function<void()> & f);
 
 private:
     Database();
 
     void init(); // Prepare database
 
-    sqlite3 *db = nullptr;
+    // fs is being copied to a new layout by the migration thread
+    std::atomic<bool> migrating = false;
+    std::thread migration;
+    void migrate_fs();
+
+    struct connection {
+        sqlite3 *handle = nullptr;
+        // Prepared statements by SQL text, reset and ready to be used again. A statement is
+        // taken out while it runs, concurrent queries with the same SQL prepare one more
+        std::unordered_multimap<std::string, sqlite3_stmt *> statements;
+        std::mutex statements_mutex;
+    };
+    sqlite3_stmt * acquire_statement(connection &, const std::string &);
+    void release_statement(connection &, const std::string &, sqlite3_stmt *);
+    void close_connection(connection &);
+
+    // the connection every write goes through, shared by all the threads. They use it one
+    // at a time, a transaction holds it until it ends
+    connection writer;
     std::string db_path = "database.db";
+    std::recursive_mutex writer_mutex;
+
+    // read-only connections, each one used by a thread at a time
+    std::vector<std::unique_ptr<connection>> readers;
+    std::vector<connection *> idle_readers;
+    std::mutex readers_mutex;
+    std::condition_variable readers_cv;
     
     friend class Statement;
 };
 
+// A query on a statement from the cache of its connection, given back reset when it's destroyed
 class Statement
 {
 public:
-    Statement(const std::string &, const std::initializer_list<std::string> &, bool);
+    typedef Database::connection connection;
+    Statement(connection &, const std::string &, const std::initializer_list<DbParam> &, bool);
     ~Statement();
-    void prepare();
+    Statement(const Statement &) = delete;
     void bind();
-    std::unordered_map<int, std::vector<std::string>> step();
-    void print_results(const std::unordered_map<int, std::vector<std::string>> &);
+    db_results_t step();
+    void each(const db_row_visitor_t &);
+    void print_results(const db_results_t &);
 
 private:
     Database &db;
-    std::string sql;
-    const std::initializer_list<std::string> & params;
+    connection &conn;
+    const std::string & sql;
+    const std::initializer_list<DbParam> & params;
     bool throwOnStep;
     sqlite3_stmt *stmt;
-};
\ No newline at end of file
+};
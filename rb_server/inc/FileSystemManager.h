@@ -6,44 +6,136 @@
 #include <chrono>
 #include <fstream>
 #include <iomanip>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <string>
 #include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "ChunkStore.h"
+#include "Compression.h"
 #include "Database.h"
+#include "Delta.h"
+#include "ObjectStore.h"
 #include "RBHelpers.h"
+#include "TreeIndex.h"
+#include "WriteEngine.h"
 
 namespace fs = boost::filesystem;
 namespace ch = std::chrono;
 
+// Files in a PROBE page at most (CAP_PAGED_PROBE)
+#define RB_PROBE_PAGE_MAX 65536
+// The progress of the uploads is written to the db at most this often, batched in one transaction
+#define RB_PROGRESS_FLUSH_INTERVAL_SECS 2
+// Blocks in a SIGNATURE response at most, about 26 MB of them: a larger stored version (past 128 GB)
+// gets no blocks, so its file is uploaded whole instead of going over RB_MAX_REQUEST_SIZE
+#define RB_SIGNATURE_MAX_BLOCKS (1 << 20)
+
 class FileSystemManager {
 public:
-    FileSystemManager(const fs::path & root) : root(root) {
+    FileSystemManager(const fs::path & root)
+        : root(root),
+          chunk_store(root / ".rbstore" / "chunks"),
+          object_store(root / ".rbstore"),
+          delta_root(root / ".rbstore" / "delta"),
+          write_engine(RB_WRITE_SESSIONS_MAX, std::chrono::seconds(RB_WRITE_SESSION_TIMEOUT_SECS)),
+          tree_index(RB_TREES_MAX, std::chrono::seconds(RB_TREE_IDLE_TIMEOUT_SECS)) {
         cleanup_empty_folders();
     };
-    std::unordered_map<std::string, RBFileMetadata> get_files(const std::string&);
+    // Adds the files of the user to files
+    void get_files(const std::string&, google::protobuf::Map<std::string, RBFileMetadata>& files);
+    // Adds to page the files of the user that come after the path after, by path, at most limit
+    // of them (CAP_PAGED_PROBE). page.more is set if there are others
+    void get_files_page(const std::string&, const std::string& after, size_t limit, RBProbeResponse& page);
+    // Lists the directories of req whose summary differs from the user's tree (CAP_TREE_PROBE)
+    void compare_tree(const std::string&, const RBTreeRequest& req, RBTreeResponse& res);
     bool file_exists(std::string, const fs::path&);
     void write_file(const std::string & username, const RBRequest & req);
     void remove_file(const std::string & username, const RBRequest & req);
+    // Drops the upload of the file in progress. A complete version, the base of a delta
+    // or a file the upload didn't reach, stays with its row
+    void abort_upload(const std::string & username, const RBRequest & req);
     void read_file_segment(const std::string&, const RBRequest&, RBResponse&);
+    void offer_chunks(const std::string&, const RBRequest&, RBResponse&);
+    void store_chunks(const std::string&, const RBRequest&);
+    void file_signature(const std::string&, const RBRequest&, RBResponse&);
+    void link_file(const std::string&, const RBRequest&, RBResponse&);
     std::string md5(fs::path);
-    std::string get_hash(std::string, const fs::path&);
-    std::string get_size(std::string, const fs::path&);
-    std::string get_last_write_time(std::string, const fs::path&);
+    // the values of complete versions, none while the file is being uploaded
+    std::optional<uint32_t> get_hash(std::string, const fs::path&);
+    std::optional<uint64_t> get_size(std::string, const fs::path&);
+    std::optional<int64_t> get_last_write_time(std::string, const fs::path&);
     void clear();
+    // Writes the progress of the uploads to the db
+    void flush_progress();
     ~FileSystemManager() {
         keep_going = false;
         watchdog.join();
+        progress_watchdog.join();
     }
 
 private:
     std::string to_string(unsigned char*);
     fs::path root;
+    ChunkStore chunk_store;
+    ObjectStore object_store;
+    void collect_objects();
+    // Forgets the upload in progress of the file, and removes the new version of a delta
+    void discard_upload(const std::string & username, const std::string & normal_path);
+    // new versions of the files being uploaded as a delta
+    fs::path delta_root;
+    fs::path delta_path(const std::string & username, const std::string & normal_path);
+    void apply_delta(const fs::path & base_path, const RBFileSegment & file_segment, std::ostream & os);
+    // the files being uploaded, open between their segments
+    WriteEngine write_engine;
+    // the users' trees, told about every change to fs
+    TreeIndex tree_index;
+
+    // Striped uploads in progress, by "username>path": which segments have been written
+    struct striped_upload {
+        RBFileMetadata metadata;
+        std::vector<bool> received;
+        size_t received_count = 0;
+    };
+    std::unordered_map<std::string, striped_upload> striped_uploads;
+    std::mutex striped_mutex;
+    void write_striped_segment(const std::string & username, const std::string & normal_path,
+                               const fs::path & path, const RBFileSegment & file_segment);
+    // Checks the complete file, written by session, against its metadata and records it
+    void finalize_file(const std::string & username, const std::string & normal_path,
+                       const fs::path & path, const RBFileMetadata & metadata,
+                       std::shared_ptr<WriteSession> session, int64_t last_segment);
+
+    // Sequential uploads in progress, by "username>path": the last segment written and the
+    // size of the file after it. The first segment creates the row of the upload right away,
+    // the progress after it is recorded by flush_progress and with the metadata at the end
+    struct upload_progress_t {
+        std::string username;
+        std::string normal_path;
+        int64_t last_segment;
+        uint64_t written;
+        bool dirty;
+        ch::steady_clock::time_point last_use;
+    };
+    std::unordered_map<std::string, upload_progress_t> upload_progress;
+    std::mutex progress_mutex;
     std::shared_mutex mutex;
     void cleanup_empty_folders();
-    std::atomic<bool> keep_going;
+    std::atomic<bool> keep_going = true;
     std::thread watchdog = make_watchdog(std::chrono::seconds(600),
         [this]() { return keep_going.load(); },
-        [this]() { cleanup_empty_folders(); }
+        [this]() {
+            cleanup_empty_folders();
+            chunk_store.collect_garbage();
+            collect_objects();
+        }
     );  
+    std::thread progress_watchdog = make_watchdog(std::chrono::seconds(RB_PROGRESS_FLUSH_INTERVAL_SECS),
+        [this]() { return keep_going.load(); },
+        [this]() { flush_progress(); }
+    );
 };
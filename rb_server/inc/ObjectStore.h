@@ -0,0 +1,38 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+#include "RBHelpers.h"
+
+namespace fs = boost::filesystem;
+
+// Content-addressed store of the complete files, shared by all users.
+// Objects live in <root>/objects/<hh>/<sha256 hex> and the users' files are hard links
+// to them, so identical contents take space once. The references are kept by the
+// fs table (object column): objects no row refers to, and no file links to, are collected.
+// Users' files must never be modified in place, only replaced.
+class ObjectStore {
+public:
+    // Removes the links left aside in <root>/tmp by a previous run
+    explicit ObjectStore(const fs::path &root);
+
+    bool has(const std::string &hex);
+    // Replaces dest with a link to the object. It throws an RBException if it's missing
+    void link_to(const std::string &hex, const fs::path &dest);
+    // Makes file an instance of the object with its content: the existing object if
+    // there's one (file is replaced), file itself otherwise
+    void ingest(const std::string &hex, const fs::path &file);
+    // Removes the objects that aren't referenced and have no other link, checked again
+    // one at a time: the files linked to one after the references were read keep it
+    void collect_garbage(const std::unordered_set<std::string> &referenced);
+
+private:
+    fs::path root;
+    // held while an object is linked to or removed
+    std::mutex mutex;
+    fs::path object_path(const std::string &hex);
+    void link_locked(const std::string &hex, const fs::path &dest);
+};
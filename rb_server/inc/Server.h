@@ -1,11 +1,13 @@
 #pragma once
 
 #include <atomic>
-#include <boost/asio.hpp>
 #include <iostream>
 #include <memory>
 #include <thread>
 #include <functional>
+#include <utility>
+
+#include <boost/asio.hpp>
 
 #include "RBHelpers.h"
 #include "rbproto.pb.h"
@@ -20,30 +22,43 @@ typedef
   std::function<RBResponse(RBRequest&, std::shared_ptr<Service>)>
   RBSrvCallback;
 
+// Largest request frame accepted from a client, protobuf's own default limit
+#define RB_MAX_REQUEST_SIZE (64 * RB_MAX_SEGMENT_SIZE)
+
+// One client connection. Requests are read and answered asynchronously on the
+// connection's strand, while the callback runs on the server's disk pool, so an
+// idle connection holds no thread.
 class Service : public std::enable_shared_from_this<Service> {
 public:
   ~Service() {
     RBLog("~Service()\n");
   }
 
-  static std::shared_ptr<Service> create(sockPtr_t sock, RBSrvCallback);
-  void handle_request();
+  static std::shared_ptr<Service> create(sockPtr_t sock, RBSrvCallback, asio::thread_pool &);
+  void start();
 private:
-  Service(sockPtr_t sock, RBSrvCallback);
+  Service(sockPtr_t sock, RBSrvCallback, asio::thread_pool &);
 
-  sockPtr_t sock;
-  std::function<void(sockPtr_t)> handler;
+  void read_request();
+  bool take_request(RBRequest &req);
+  void handle_request(RBRequest req);
+  void write_response(bool final);
+  void close();
 
-  struct FileData {
-    std::map<uint64_t, std::string> segment_map;
-    uint64_t size = 0;
-    uint64_t last_write_time = 0;
-  } file_data;
+  sockPtr_t sock;
+  asio::strand<asio::ip::tcp::socket::executor_type> strand;
+  RBSrvCallback callback;
+  asio::thread_pool &disk_pool;
+  asio::streambuf in_buf;
+  // bytes still needed to complete the request being received
+  size_t missing = 1;
+  // the serialized response, reused from request to request
+  std::string out_buf;
 };
 
 class Server {
 public:
-  Server(unsigned short port_num, int n_workers, const RBSrvCallback &);
+  Server(unsigned short port_num, int n_io_threads, int n_workers, const RBSrvCallback &);
 
   void start();
   void stop();
@@ -54,18 +69,17 @@ public:
   }
 
 private:
-  void run();
+  void accept();
 
   unsigned short port; // WARNING: if moved at the end the server breaks!!
-  std::unique_ptr<std::thread> thread_ptr;
   std::atomic<bool> running;
   asio::io_service ios;
+  asio::executor_work_guard<asio::io_service::executor_type> work;
   asio::ip::tcp::acceptor tcp_acceptor;
   RBSrvCallback callback;
-  std::vector<std::thread> workers;
+  std::vector<std::thread> io_threads;
+  int n_io_threads = 1;
+  // blocking request handling (disk and database) runs here, off the io threads
+  asio::thread_pool disk_pool;
   int n_workers = 16;
-
-  std::condition_variable req_cv;
-  std::mutex req_mutex;
-  std::list<std::shared_ptr<Service>> requests;
 };
@@ -4,21 +4,26 @@
 #include "AuthController.h"
 #include "AtomicMap.hpp"
 
+#include <unordered_set>
+
 
 typedef atomic_map<std::string, std::shared_ptr<Service>> svc_atomic_map_t;
 
 class ServerFlow {
 public:
-    ServerFlow(unsigned short port, int workersLimit, const std::string & rootPath) 
-        : svc_map(workersLimit), fsm(rootPath), 
-        srv(port, workersLimit,[&](RBRequest req, std::shared_ptr<Service> worker) {
+    ServerFlow(unsigned short port, int ioThreads, int workersLimit, const std::string & rootPath,
+               int dbReaders, const std::string & dbSynchronous, int dbCheckpointPages, bool objectLink) 
+        : svc_map(workersLimit), fsm(rootPath), dbReaders(dbReaders), dbSynchronous(dbSynchronous),
+        dbCheckpointPages(dbCheckpointPages), 
+        srv(port, ioThreads, workersLimit,[&](RBRequest req, std::shared_ptr<Service> worker) {
             return flow(req, worker);
-        }) {
+        }), capabilities(supported_capabilities(objectLink)) {
             start();
     }
 
     void start() {
-        db.open();
+        db.open(dbReaders, dbSynchronous, dbCheckpointPages);
+        auth_controller.load_sessions();
         srv.start();
     }
 
@@ -73,6 +78,7 @@ public:
     void stop() {
         RBLog("ServerFlow >> Stopping server...", LogLevel::INFO);
         srv.stop();
+        fsm.flush_progress();
         db.close();
     }
 
@@ -84,11 +90,41 @@ public:
         RBLog("ServerFlow >> Server cleared!", LogLevel::INFO);
     }
 private:
-    Server srv;
-    FileSystemManager fsm;
+    // in the order they're initialized: the server starts after the state its requests use
     svc_atomic_map_t svc_map;
+    FileSystemManager fsm;
     Database & db = Database::get_instance();
+    int dbReaders;
+    std::string dbSynchronous;
+    int dbCheckpointPages;
+    Server srv;
     AuthController & auth_controller = AuthController::get_instance();
+    // optional RBProto features supported by this server
+    static std::unordered_set<int> supported_capabilities(bool objectLink) {
+        std::unordered_set<int> capabilities = {
+            RBCapability::CAP_CHUNKED_UPLOAD,
+            RBCapability::CAP_DELTA_UPLOAD,
+            RBCapability::CAP_PIPELINED_UPLOAD,
+            RBCapability::CAP_STRIPED_UPLOAD,
+            RBCapability::CAP_PAGED_PROBE,
+            RBCapability::CAP_TREE_PROBE,
+        };
+        // contents are shared by hash, see the trust model in RBProto.md
+        if (objectLink)
+            capabilities.insert(RBCapability::CAP_OBJECT_LINK);
+        for (auto codec : available_codecs())
+            capabilities.insert(codec_capability(codec));
+        return capabilities;
+    }
+    const std::unordered_set<int> capabilities;
+
+    // Holds the file for a request, also against the striped segments of it being written
+    svc_atomic_map_t::guard file_guard(std::string & file_token, std::shared_ptr<Service> & worker) {
+        auto svc_grd = svc_map.make_guard(file_token, worker);
+        if (svc_map.has_prefix(file_token + ">"))
+            throw svc_atomic_map_t::key_already_present();
+        return svc_grd;
+    }
 
     RBResponse inline flow(RBRequest req, std::shared_ptr<Service> worker) {
         if (!srv.is_running()) throw RBException("Server stopped");
@@ -107,9 +143,12 @@ private:
                 auth_controller.auth_by_credentials(username, password);
                 RBLog("RB >> USER <" + username + "> authenticated!", LogLevel::INFO);
                 
-                std::string token = auth_controller.generate_token(username);
+                std::string token = auth_controller.generate_token(username, req.token());
                 auto auth_response = std::make_unique<RBAuthResponse>();
                 auth_response->set_token(token);
+                for (auto capability : req.auth_request().capabilities())
+                    if (capabilities.count(capability))
+                        auth_response->add_capabilities(static_cast<RBCapability>(capability));
                 res.set_allocated_auth_response(auth_response.release());
                 res.set_success(true);
             } else if (req.type() == RBMsgType::UPLOAD) {
@@ -122,9 +161,18 @@ private:
                 try {
                     std::string file_token = 
                         username + ">" + req.file_segment().path();
-                    auto svc_grd = svc_map.make_guard(file_token, worker);
-
-                    fsm.write_file(username, req);
+                    // the segments of a striped upload after the first one are written in parallel,
+                    // each one at its offset, but not while anything else holds the whole file
+                    if (req.file_segment().striped() && req.file_segment().segmentid() != 0) {
+                        std::string segment_token = file_token + ">" + std::to_string(req.file_segment().segmentid());
+                        auto svc_grd = svc_map.make_guard(segment_token, worker);
+                        if (svc_map.has(file_token))
+                            throw svc_atomic_map_t::key_already_present();
+                        fsm.write_file(username, req);
+                    } else {
+                        auto svc_grd = file_guard(file_token, worker);
+                        fsm.write_file(username, req);
+                    }
                     res.set_success(true);
                 } catch (svc_atomic_map_t::key_already_present  &e) {
                     throw RBException("concurrent_write");
@@ -140,7 +188,7 @@ private:
                 try {
                     std::string file_token = 
                         username + ">" + req.file_segment().path();
-                    auto sv_grd = svc_map.make_guard(file_token, worker);
+                    auto svc_grd = file_guard(file_token, worker);
 
                     fsm.remove_file(username, req);
                     res.set_success(true);
@@ -157,9 +205,9 @@ private:
                 try {
                     std::string file_token = 
                         username + ">" + req.file_segment().path();
-                    auto sv_grd = svc_map.make_guard(file_token, worker);
+                    auto svc_grd = file_guard(file_token, worker);
 
-                    fsm.remove_file(username, req);
+                    fsm.abort_upload(username, req);
                     res.set_success(true);
                 } catch (svc_atomic_map_t::key_already_present  &e) {
                     throw RBException("concurrent_write");
@@ -171,14 +219,26 @@ private:
                 auto username = auth_controller.auth_get_user_by_token(req.token());
                 RBLog("RB >> PROBE request received from <" + username + ">", LogLevel::INFO);
 
-                auto files = fsm.get_files(username);
-
                 auto probe_res = std::make_unique<RBProbeResponse>();
-                auto mutable_files = probe_res->mutable_files();
-                mutable_files->insert(files.begin(), files.end());
+                if (req.has_probe_request())
+                    fsm.get_files_page(username, req.probe_request().after(), req.probe_request().limit(), *probe_res);
+                else
+                    fsm.get_files(username, *probe_res->mutable_files());
 
                 res.set_allocated_probe_response(probe_res.release());
                 res.set_success(true);
+            } else if (req.type() == RBMsgType::TREE) {
+                validateRBProto(req, RBMsgType::TREE, 3);
+
+                // Authenticate the request
+                auto username = auth_controller.auth_get_user_by_token(req.token());
+                RBLog("RB >> TREE request received from <" + username + ">", LogLevel::INFO);
+
+                auto tree_res = std::make_unique<RBTreeResponse>();
+                fsm.compare_tree(username, req.tree_request(), *tree_res);
+
+                res.set_allocated_tree_response(tree_res.release());
+                res.set_success(true);
             } else if (req.type() == RBMsgType::RESTORE) {
                 validateRBProto(req, RBMsgType::RESTORE, 3);
 
@@ -188,6 +248,50 @@ private:
 
                 fsm.read_file_segment(username, req, res);
                 res.set_success(true);
+            } else if (req.type() == RBMsgType::CHUNK_OFFER) {
+                validateRBProto(req, RBMsgType::CHUNK_OFFER, 3);
+
+                // Authenticate the request
+                auto username = auth_controller.auth_get_user_by_token(req.token());
+                RBLog("RB >> CHUNK_OFFER request received from <" + username + ">", LogLevel::INFO);
+
+                fsm.offer_chunks(username, req, res);
+                res.set_success(true);
+            } else if (req.type() == RBMsgType::CHUNK_UPLOAD) {
+                validateRBProto(req, RBMsgType::CHUNK_UPLOAD, 3);
+
+                // Authenticate the request
+                auto username = auth_controller.auth_get_user_by_token(req.token());
+                RBLog("RB >> CHUNK_UPLOAD request received from <" + username + ">", LogLevel::INFO);
+
+                fsm.store_chunks(username, req);
+                res.set_success(true);
+            } else if (req.type() == RBMsgType::SIGNATURE) {
+                validateRBProto(req, RBMsgType::SIGNATURE, 3);
+
+                // Authenticate the request
+                auto username = auth_controller.auth_get_user_by_token(req.token());
+                RBLog("RB >> SIGNATURE request received from <" + username + ">", LogLevel::INFO);
+
+                fsm.file_signature(username, req, res);
+                res.set_success(true);
+            } else if (req.type() == RBMsgType::LINK) {
+                validateRBProto(req, RBMsgType::LINK, 3);
+
+                // Authenticate the request
+                auto username = auth_controller.auth_get_user_by_token(req.token());
+                RBLog("RB >> LINK request received from <" + username + ">", LogLevel::INFO);
+
+                try {
+                    std::string file_token = 
+                        username + ">" + req.file_segment().path();
+                    auto svc_grd = file_guard(file_token, worker);
+
+                    fsm.link_file(username, req, res);
+                    res.set_success(true);
+                } catch (svc_atomic_map_t::key_already_present  &e) {
+                    throw RBException("concurrent_write");
+                }
             } else if (req.type() == RBMsgType::NOP) {
                 res.set_success(true);
                 RBLog("RB >> NOP", LogLevel::INFO);
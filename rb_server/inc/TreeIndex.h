@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "Database.h"
+#include "DirTree.h"
+#include "RBHelpers.h"
+
+// Entries (files and subdirectories) in the listings of a TREE response at most
+#define RB_TREE_RESPONSE_MAX_ENTRIES 65536
+// fs rows read by each query when going through the files of a directory
+#define RB_TREE_SCAN_ROWS 4096
+// Users' trees kept in memory at most, the least recently compared ones are dropped first
+#define RB_TREES_MAX 64
+// Trees not compared for longer than this are dropped, and loaded again by the next TREE request
+#define RB_TREE_IDLE_TIMEOUT_SECS 600
+
+// Merkle trees of the users' files by directory, compared with the client's in TREE
+// requests (CAP_TREE_PROBE). A user's tree is loaded from the db the first time it's
+// asked for and then kept in memory, directories only. The writes to fs mark the
+// directory of the file they touched: its files are read again from the db, and the
+// summaries up to the root updated, before the next comparison.
+// Each tree has a lock of its own, held by the comparisons while they read the db: the
+// lock of the index only guards the list of the trees and the marks, so the writes
+// marking a directory don't wait for them.
+class TreeIndex {
+public:
+    TreeIndex(size_t max_trees, std::chrono::seconds idle_timeout);
+    TreeIndex(const TreeIndex &) = delete;
+    ~TreeIndex();
+
+    // The file at normal_path was written or removed, after the change is in the db
+    void touch(const std::string & username, const std::string & normal_path);
+    // Adds to res the listing of each directory of req whose summary differs from the server's one,
+    // from its cursor on, as long as the response has room
+    void compare(const std::string & username, const RBTreeRequest & req, RBTreeResponse & res);
+    void clear();
+
+private:
+    typedef std::chrono::steady_clock clock;
+    struct user_tree {
+        // held while the tree is loaded, refreshed and compared
+        std::mutex mutex;
+        bool loaded = false;
+        DirTree tree;
+        // directories whose files changed since they were summed, guarded by the index's mutex
+        std::unordered_set<std::string> changed;
+        std::list<std::string>::iterator lru_it;
+        clock::time_point last_use;
+    };
+
+    size_t max_trees;
+    clock::duration idle_timeout;
+    // a comparison keeps using a tree dropped meanwhile, the next one loads it again
+    std::unordered_map<std::string, std::shared_ptr<user_tree>> trees;
+    // users of the trees, the most recently compared first
+    std::list<std::string> lru;
+    std::mutex mutex;
+
+    // The tree of the user, added if it's missing, as the most recently used
+    std::shared_ptr<user_tree> use(const std::string & username);
+    void drop_idle();
+    void load(const std::string & username, user_tree & user);
+    // Reads again the files of the changed directories and sums them up to the root
+    void refresh(const std::string & username, user_tree & user, const std::unordered_set<std::string> & changed);
+
+    // Stops going through the rows when it returns false
+    typedef std::function<bool(const DbRow &)> file_visitor_t;
+
+    // Gives visit the rows of the files directly in the directory whose name comes after after, by name,
+    // skipping the ranges of its subdirectories. False if visit stopped it
+    bool each_file(const std::string & username, const std::string & path, const DirTree::dir_node & dir,
+                   const std::string & after, const file_visitor_t & visit);
+    // Gives visit the rows of the paths in [from, to), to "" for no bound, RB_TREE_SCAN_ROWS at a time
+    bool scan(const std::string & username, std::string from, const std::string & to, const file_visitor_t & visit);
+
+    std::atomic<bool> keep_going = true;
+    std::thread watchdog;
+};
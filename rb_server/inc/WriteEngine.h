@@ -0,0 +1,114 @@
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "RBHelpers.h"
+
+namespace fs = boost::filesystem;
+
+// Upload sessions kept open at most, the least recently used ones are closed first
+#define RB_WRITE_SESSIONS_MAX 256
+// Upload sessions idle for longer than this are closed
+#define RB_WRITE_SESSION_TIMEOUT_SECS 120
+
+// An open file being uploaded. Its segments are written with pwrite, at their offset
+// or after the previous one; writing to it as a streambuf appends as well.
+// The content is checksummed as it's written, in order: what is written ahead of the
+// rest is read back once the gap before it has been filled.
+class WriteSession : public std::streambuf {
+public:
+    WriteSession(int fd, const fs::path &path, uint64_t end);
+    WriteSession(const WriteSession &) = delete;
+    ~WriteSession();
+
+    // It throws an RBException if the data can't be written
+    void write_at(uint64_t offset, const char *data, size_t size);
+    void append(const char *data, size_t size);
+    const fs::path &get_path() const { return path; }
+    // the size of a sequential upload so far
+    uint64_t get_end() const { return end; }
+
+    // The checksum and the SHA-256 of the file, if exactly its first size bytes have been
+    // written and checksummed. False if it has to be read again to know them
+    bool digests(uint64_t size, uint32_t &checksum, std::string &sha256);
+    // Checksums the first size bytes already in the file, for reopened sessions
+    void rehash(uint64_t size);
+    // Stops checksumming, for reopened sessions of files written with gaps
+    void stop_hashing();
+
+protected:
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+    int_type overflow(int_type c) override;
+
+private:
+    int fd;
+    fs::path path;
+    // the segments of a sequential upload are written one at a time
+    uint64_t end;
+
+    std::mutex hash_mutex;
+    bool hashing = true;
+    // the content before hashed has been checksummed, written_ahead (offset -> size) not yet
+    uint64_t hashed = 0;
+    std::map<uint64_t, uint64_t> written_ahead;
+    RBCrc32 crc;
+    RBSha256 sha;
+    // data is read back from the file if it's null
+    void hash_written(uint64_t offset, const char *data, size_t size);
+    void stop_hashing_locked();
+};
+
+// Files being uploaded, by "username>path", kept open from the first segment to the
+// last one or an abort. The first segment preallocates the whole file, so that an
+// upload that doesn't fit fails right away and the file is laid out contiguously.
+// Sessions evicted for the limits above are reopened by their next segment.
+class WriteEngine {
+public:
+    WriteEngine(size_t max_sessions, std::chrono::seconds idle_timeout);
+    WriteEngine(const WriteEngine &) = delete;
+    ~WriteEngine();
+
+    // Creates path, replacing the file there, preallocating size bytes, and opens the session of key on it
+    std::shared_ptr<WriteSession> start(const std::string &key, const fs::path &path, uint64_t size);
+    // The session of key on path, reopened if it has been evicted or the server restarted.
+    // contiguous tells that the file has been written from the start without gaps, so
+    // that a reopened session can checksum it again. A reopened session drops what is
+    // past size, when it's given: what was written after the recorded progress
+    std::shared_ptr<WriteSession> resume(const std::string &key, const fs::path &path, bool contiguous,
+                                         std::optional<uint64_t> size = std::nullopt);
+    // Closes the session of key, if it's open
+    void finish(const std::string &key);
+
+private:
+    typedef std::chrono::steady_clock clock;
+    struct entry {
+        std::shared_ptr<WriteSession> session;
+        std::list<std::string>::iterator lru_it;
+        clock::time_point last_use;
+    };
+
+    size_t max_sessions;
+    clock::duration idle_timeout;
+    std::unordered_map<std::string, entry> sessions;
+    // keys of the sessions, the most recently used first
+    std::list<std::string> lru;
+    std::mutex mutex;
+
+    // Replaces the session of key, called with the mutex held
+    std::shared_ptr<WriteSession> insert(const std::string &key, std::shared_ptr<WriteSession> session);
+    void close_idle();
+
+    std::atomic<bool> keep_going = true;
+    std::thread watchdog;
+};
@@ -2,6 +2,7 @@
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include <boost/lexical_cast.hpp>
+#include <algorithm>
 #include "AuthController.h"
 
 AuthController::AuthController() {
@@ -16,63 +17,130 @@ void AuthController::auth_by_credentials(std::string username, std::string passw
 
     std::string hash = sha256(password);
     std::string sql = "SELECT COUNT(*) FROM users WHERE username = ? AND password = ?;";
-    auto results = db.query(sql, {username, hash});
+    auto results = db.read(sql, {username, hash});
 
-    auto count = std::stoi(results[0][0]);
+    auto count = results[0][0].int64();
     if (!count) throw RBException("login_failed_wrong_credentials");
 
     if (count > 1) RBLog("WARNING: DUPLICATED USER", LogLevel::INFO);
 }
 
 void AuthController::auth_by_token(std::string token) {
-    auto& db = Database::get_instance();
-
-    if (token.empty()) throw RBException("unauthorized");
-
-    std::string sql = "SELECT COUNT(*) FROM users WHERE token = ?;";
-    auto results = db.query(sql, {token});
-
-    auto count = std::stoi(results[0][0]);
-    if (!count) throw RBException("unauthorized");
-
-    if (count > 1) RBLog("WARNING: DUPLICATED USER", LogLevel::INFO);
+    auth_get_user_by_token(token);
 }
 
 std::string AuthController::auth_get_user_by_token(const std::string& token) {
-    auto& db = Database::get_instance();
-
     if (token.empty()) throw RBException("unauthenticated");
 
-    std::string sql = "SELECT username FROM users WHERE token = ?;";
-    auto results = db.query(sql, {token});
-
-    if (results.empty())
-        throw RBException("unauthenticated");
-
-    auto username = results[0][0];
-
-    return username;
+    auto now = std::time(nullptr);
+    {
+        std::shared_lock<std::shared_mutex> slock(sessions_mutex);
+        auto it = sessions.find(token);
+        if (it == sessions.end())
+            throw RBException("unauthenticated");
+        if (it->second.last_use + RB_SESSION_IDLE_TIMEOUT_SECS > now) {
+            it->second.last_use = now;
+            auto username = it->second.username;
+            // a request per session and interval stores its last use, once the lock is released
+            int64_t stored = it->second.stored_use;
+            bool store = now - stored >= RB_SESSION_USE_STORE_INTERVAL_SECS &&
+                         it->second.stored_use.compare_exchange_strong(stored, now);
+            slock.unlock();
+            if (store)
+                Database::get_instance().query("UPDATE sessions SET last_use = ? WHERE token = ?;", {now, token});
+            return username;
+        }
+    }
+
+    std::vector<std::string> dropped;
+    {
+        std::unique_lock<std::shared_mutex> ulock(sessions_mutex);
+        auto it = sessions.find(token);
+        if (it != sessions.end() && it->second.last_use + RB_SESSION_IDLE_TIMEOUT_SECS <= now) {
+            RBLog("AuthController >> Session of <" + it->second.username + "> expired", LogLevel::INFO);
+            drop_session(token, dropped);
+        }
+    }
+    forget_sessions(dropped);
+    throw RBException("unauthenticated");
 }
 
-std::string AuthController::generate_token(std::string username) {
+std::string AuthController::generate_token(const std::string & username, const std::string & previous_token) {
     auto& db = Database::get_instance();
 
-    using namespace std::chrono;
-    auto time = system_clock::to_time_t(system_clock::now());
+    static thread_local boost::uuids::random_generator gen;
+    std::string token = boost::lexical_cast<std::string>(gen());
+    auto now = std::time(nullptr);
 
-    boost::mt19937 ran;
-    ran.seed(time);
-    boost::uuids::basic_random_generator<boost::mt19937> gen(&ran);
-    boost::uuids::uuid u = gen();
-    std::string token = boost::lexical_cast<std::string>(u);
+    // stored first, the token checks don't wait for the database
     db.query(
-        "UPDATE users SET token = ? WHERE username = ?;",
-        {token, username}
+        "INSERT INTO sessions (token, username, created, last_use) VALUES (?, ?, ?, ?);",
+        {token, username, now, now}, true
     );
 
+    std::vector<std::string> dropped;
+    {
+        std::unique_lock<std::shared_mutex> ulock(sessions_mutex);
+        auto user_it = user_sessions.find(username);
+        // a client authenticating again replaces its own session only
+        if (user_it != user_sessions.end() && user_it->second.count(previous_token))
+            drop_session(previous_token, dropped);
+        // looked up again each time, drop_session erases the set of a user left without sessions
+        while ((user_it = user_sessions.find(username)) != user_sessions.end() &&
+               user_it->second.size() >= RB_MAX_SESSIONS_PER_USER) {
+            auto& tokens = user_it->second;
+            auto oldest = std::min_element(tokens.begin(), tokens.end(), [&](const auto& a, const auto& b) {
+                return sessions.at(a).last_use < sessions.at(b).last_use;
+            });
+            drop_session(*oldest, dropped);
+        }
+
+        sessions.try_emplace(token, username, now);
+        user_sessions[username].insert(token);
+    }
+    forget_sessions(dropped);
+
     return token;
 }
 
+void AuthController::drop_session(const std::string& token, std::vector<std::string>& dropped) {
+    auto it = sessions.find(token);
+    if (it == sessions.end()) return;
+
+    // copied first, token can be the element of user_sessions erased below
+    dropped.push_back(token);
+    auto user_it = user_sessions.find(it->second.username);
+    if (user_it != user_sessions.end()) {
+        user_it->second.erase(dropped.back());
+        if (user_it->second.empty()) user_sessions.erase(user_it);
+    }
+    sessions.erase(it);
+}
+
+void AuthController::forget_sessions(const std::vector<std::string>& dropped) {
+    for (auto& token : dropped)
+        Database::get_instance().query("DELETE FROM sessions WHERE token = ?;", {token});
+}
+
+void AuthController::load_sessions() {
+    auto& db = Database::get_instance();
+    auto now = std::time(nullptr);
+    // expired by their last use, as stored every RB_SESSION_USE_STORE_INTERVAL_SECS at most.
+    // Sessions stored before it was recorded count from their creation
+    db.query("DELETE FROM sessions WHERE COALESCE(last_use, created) <= ?;",
+             {now - RB_SESSION_IDLE_TIMEOUT_SECS});
+    auto results = db.query("SELECT token, username, COALESCE(last_use, created) FROM sessions;", {});
+
+    std::unique_lock<std::shared_mutex> ulock(sessions_mutex);
+    sessions.clear();
+    user_sessions.clear();
+    for (auto& [row, columns] : results) {
+        sessions.try_emplace(columns[0].text(), columns[1].text(), columns[2].int64());
+        user_sessions[columns[1].text()].insert(columns[0].text());
+    }
+    RBLog("AuthController >> Loaded " + std::to_string(sessions.size()) + " sessions", LogLevel::INFO);
+}
+
 std::string AuthController::sha256(const std::string str) {
     unsigned char hash[SHA256_DIGEST_LENGTH];
     SHA256_CTX sha256;
@@ -89,6 +157,9 @@ std::string AuthController::sha256(const std::string str) {
 
 void AuthController::add_user(const std::string & username, const std::string & pw) {
     auto& db = Database::get_instance();
+    // user folders share the data root with the server's own folders (e.g. .rbstore)
+    if (username.empty() || username[0] == '.' || username.find('/') != std::string::npos)
+        throw RBException("invalid_username");
     std::string hash = AuthController::get_instance().sha256(pw);
     db.query("INSERT INTO users (username, password) VALUES (?, ?);", 
         {username, hash}, true);
@@ -0,0 +1,83 @@
+#include "ChunkStore.h"
+
+#include <atomic>
+#include <fstream>
+
+#define RB_CHUNK_HASH_SIZE 32
+
+fs::path ChunkStore::chunk_path(const std::string &username, const std::string &hash) {
+    if (hash.size() != RB_CHUNK_HASH_SIZE)
+        throw RBException("invalid_chunk_hash");
+    auto hex = to_hex(hash);
+    return root / username / hex.substr(0, 2) / hex;
+}
+
+bool ChunkStore::has(const std::string &username, const std::string &hash) {
+    auto path = chunk_path(username, hash);
+    boost::system::error_code ec;
+    // refreshing the write time keeps the chunk away from the garbage collector
+    fs::last_write_time(path, std::time(nullptr), ec);
+    return !ec;
+}
+
+void ChunkStore::put(const std::string &username, const std::string &hash, const std::string &data) {
+    auto path = chunk_path(username, hash);
+    if (strong_hash(data.data(), data.size()) != hash) {
+        RBLog("ChunkStore >> Chunk data doesn't match its hash", LogLevel::ERROR);
+        throw RBException("chunk_hash_mismatch");
+    }
+
+    if (has(username, hash)) return;
+
+    fs::create_directories(path.parent_path());
+
+    // written aside and renamed, so a chunk is either complete or missing
+    static std::atomic<uint64_t> tmp_counter{0};
+    fs::path tmp_path = path;
+    tmp_path += "." + std::to_string(tmp_counter++) + ".tmp";
+    {
+        std::ofstream ofs(tmp_path.string(), std::ios::binary | std::ios::trunc);
+        ofs.write(data.data(), data.size());
+        ofs.close();
+        if (!ofs) {
+            fs::remove(tmp_path);
+            RBLog("ChunkStore >> Cannot write chunk " + path.string(), LogLevel::ERROR);
+            throw RBException("internal_server_error");
+        }
+    }
+    fs::rename(tmp_path, path);
+}
+
+void ChunkStore::copy_to(const std::string &username, const std::string &hash, uint32_t size, std::ostream &os) {
+    auto path = chunk_path(username, hash);
+    std::ifstream ifs(path.string(), std::ios::binary);
+    if (!ifs) throw RBException("missing_chunk");
+
+    boost::system::error_code ec;
+    if (fs::file_size(path, ec) != size || ec) throw RBException("invalid_chunk_size");
+
+    os << ifs.rdbuf();
+    if (!os) {
+        RBLog("ChunkStore >> Cannot copy chunk " + path.string(), LogLevel::ERROR);
+        throw RBException("internal_server_error");
+    }
+    fs::last_write_time(path, std::time(nullptr), ec);
+}
+
+void ChunkStore::collect_garbage() {
+    if (!fs::is_directory(root)) return;
+
+    auto expiry = std::time(nullptr) - RB_CHUNK_TTL_HOURS * 3600;
+    size_t removed = 0;
+    boost::system::error_code ec;
+    for (fs::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec)) {
+        if (!fs::is_regular_file(it->path())) continue;
+        boost::system::error_code file_ec;
+        auto lwt = fs::last_write_time(it->path(), file_ec);
+        if (!file_ec && lwt < expiry && fs::remove(it->path(), file_ec))
+            removed++;
+    }
+
+    if (removed)
+        RBLog("ChunkStore >> Collected " + std::to_string(removed) + " unused chunks", LogLevel::INFO);
+}
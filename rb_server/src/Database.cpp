@@ -19,50 +19,246 @@ Database::Database() {
     RBLog("DB >> Database()");
 }
 
+// The typed fs table, rows are clustered by user and path
+static std::string fs_table_sql(const std::string& name) {
+    return "CREATE TABLE IF NOT EXISTS " + name + " (username TEXT NOT NULL, path TEXT NOT NULL, hash INTEGER, "
+           "last_write_time INTEGER, size INTEGER, last_segment INTEGER NOT NULL DEFAULT 0, "
+           "object TEXT NOT NULL DEFAULT '', written INTEGER, "
+           "PRIMARY KEY (username, path) ON CONFLICT REPLACE) WITHOUT ROWID;";
+}
+
+static const char* fs_columns = "username, path, hash, last_write_time, size, last_segment, object, written";
+
+// The values of a version 0 fs row in the typed layout, empty TEXT being NULL
+static std::string fs_v0_values(const std::string& row) {
+    return row + ".username, " + row + ".path, CAST(NULLIF(" + row + ".hash, '') AS INTEGER), "
+           "CAST(NULLIF(" + row + ".last_write_time, '') AS INTEGER), CAST(NULLIF(" + row + ".size, '') AS INTEGER), "
+           "COALESCE(CAST(NULLIF(" + row + ".last_segment, '') AS INTEGER), 0), " + row + ".object, "
+           "CAST(NULLIF(" + row + ".written, '') AS INTEGER)";
+}
+
 void Database::init() {
     exec("CREATE TABLE IF NOT EXISTS users (id INTEGER PRIMARY KEY, username TEXT UNIQUE NOT NULL, password TEXT NOT NULL, token TEXT);");
-    exec("CREATE TABLE IF NOT EXISTS fs (id INTEGER PRIMARY KEY, username TEXT NOT NULL, path TEXT NOT NULL, hash TEXT NOT NULL DEFAULT '', last_write_time TEXT NOT NULL DEFAULT '', size TEXT NOT NULL DEFAULT '', last_segment TEXT NOT NULL DEFAULT '', UNIQUE(username, path) ON CONFLICT REPLACE);");
+
+    auto version = query("PRAGMA user_version;", {})[0][0].int64();
+    auto tables = query("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'fs';", {});
+    if (tables[0][0].int64() == 0) {
+        exec(fs_table_sql("fs"));
+        // link_file and the garbage collection of the objects only read this index
+        exec("CREATE INDEX IF NOT EXISTS fs_by_object ON fs (object, hash, size);");
+        // users can have several sessions, users.token is not used anymore
+        exec("CREATE TABLE IF NOT EXISTS sessions (token TEXT PRIMARY KEY, username TEXT NOT NULL, created INTEGER NOT NULL, "
+             "last_use INTEGER);");
+        exec("PRAGMA user_version = " + std::to_string(RB_DB_SCHEMA_VERSION) + ";");
+        return;
+    }
+    // Databases created before the last use of the sessions was stored
+    auto sessions_table = query("SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'sessions';", {});
+    auto last_use = query("SELECT COUNT(*) FROM pragma_table_info('sessions') WHERE name = 'last_use';", {});
+    if (sessions_table[0][0].int64() > 0 && last_use[0][0].int64() == 0)
+        exec("ALTER TABLE sessions ADD COLUMN last_use INTEGER;");
+    if (version >= RB_DB_SCHEMA_VERSION)
+        return;
+
+    // Version 0 stored the numbers as TEXT. Databases created before the object store
+    auto columns = query("SELECT COUNT(*) FROM pragma_table_info('fs') WHERE name = 'object';", {});
+    if (columns[0][0].int64() == 0)
+        exec("ALTER TABLE fs ADD COLUMN object TEXT NOT NULL DEFAULT '';");
+    // Databases created before the progress of the uploads was recorded with their size
+    columns = query("SELECT COUNT(*) FROM pragma_table_info('fs') WHERE name = 'written';", {});
+    if (columns[0][0].int64() == 0)
+        exec("ALTER TABLE fs ADD COLUMN written TEXT NOT NULL DEFAULT '';");
+
+    // There are a few sessions per user, they're converted right away
+    exec("CREATE TABLE IF NOT EXISTS sessions (token TEXT PRIMARY KEY, username TEXT NOT NULL, created TEXT NOT NULL, "
+         "last_use INTEGER);");
+    columns = query("SELECT type FROM pragma_table_info('sessions') WHERE name = 'created';", {});
+    if (columns[0][0].text() != "INTEGER") {
+        exec("BEGIN;"
+             "CREATE TABLE sessions_v1 (token TEXT PRIMARY KEY, username TEXT NOT NULL, created INTEGER NOT NULL, "
+             "last_use INTEGER);"
+             "INSERT INTO sessions_v1 SELECT token, username, CAST(created AS INTEGER), last_use FROM sessions;"
+             "DROP TABLE sessions;"
+             "ALTER TABLE sessions_v1 RENAME TO sessions;"
+             "COMMIT;");
+    }
+
+    // fs is copied to fs_v1 in the background, while the server uses it. The triggers
+    // keep the rows already copied up to date, fs_v1 replaces fs once they're all there
+    std::string trigger_values = fs_v0_values("NEW");
+    exec("BEGIN;" + fs_table_sql("fs_v1") +
+         "CREATE INDEX IF NOT EXISTS fs_by_object ON fs_v1 (object, hash, size);"
+         "CREATE TRIGGER IF NOT EXISTS fs_v1_insert AFTER INSERT ON fs BEGIN "
+         "INSERT OR REPLACE INTO fs_v1 (" + fs_columns + ") VALUES (" + trigger_values + "); END;"
+         "CREATE TRIGGER IF NOT EXISTS fs_v1_update AFTER UPDATE ON fs BEGIN "
+         "INSERT OR REPLACE INTO fs_v1 (" + fs_columns + ") VALUES (" + trigger_values + "); END;"
+         "CREATE TRIGGER IF NOT EXISTS fs_v1_delete AFTER DELETE ON fs BEGIN "
+         "DELETE FROM fs_v1 WHERE username = OLD.username AND path = OLD.path; END;"
+         "CREATE TABLE IF NOT EXISTS fs_migration (last_id INTEGER NOT NULL);"
+         "INSERT INTO fs_migration SELECT 0 WHERE NOT EXISTS (SELECT * FROM fs_migration);"
+         "COMMIT;");
+    migrating = true;
+}
+
+void Database::migrate_fs() {
+    RBLog("DB >> Migrating fs to schema version " + std::to_string(RB_DB_SCHEMA_VERSION) + " in the background",
+          LogLevel::INFO);
+    try {
+        // rows are copied by id, a batch per transaction. Each one holds the writer connection,
+        // the other threads' writes wait for it instead of being part of it
+        bool copied = false;
+        int64_t rows = 0;
+        while (!copied && migrating) {
+            transaction([&]() {
+                auto last_id = query("SELECT last_id FROM fs_migration;", {}, true)[0][0].int64();
+                auto batch = query("SELECT MAX(id), COUNT(*) FROM (SELECT id FROM fs WHERE id > ? ORDER BY id LIMIT ?);",
+                                   {last_id, RB_DB_MIGRATION_BATCH_ROWS}, true);
+                if (batch[0][1].int64() == 0) {
+                    copied = true;
+                    return;
+                }
+                query(std::string("INSERT OR IGNORE INTO fs_v1 (") + fs_columns + ") SELECT " + fs_v0_values("fs") +
+                          " FROM fs WHERE id > ? AND id <= ?;",
+                      {last_id, batch[0][0].int64()}, true);
+                query("UPDATE fs_migration SET last_id = ?;", {batch[0][0].int64()}, true);
+                rows += batch[0][1].int64();
+            });
+            // lets the writes waiting for the connection go first
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (!copied)
+            return;
+
+        // The switch is a single call, holding the writer connection. It can fail while a
+        // statement still reads fs, and is tried again with the connection free meanwhile
+        for (int attempt = 0; migrating; attempt++) {
+            bool switched = false;
+            {
+                std::lock_guard<std::recursive_mutex> lg(writer_mutex);
+                try {
+                    exec("BEGIN;"
+                         "DROP TRIGGER fs_v1_insert;"
+                         "DROP TRIGGER fs_v1_update;"
+                         "DROP TRIGGER fs_v1_delete;"
+                         "DROP TABLE fs;"
+                         "ALTER TABLE fs_v1 RENAME TO fs;"
+                         "DROP TABLE fs_migration;"
+                         "PRAGMA user_version = " + std::to_string(RB_DB_SCHEMA_VERSION) + ";"
+                         "COMMIT;");
+                    switched = true;
+                } catch (RBException& e) {
+                    if (!sqlite3_get_autocommit(writer.handle))
+                        sqlite3_exec(writer.handle, "ROLLBACK;", nullptr, nullptr, nullptr);
+                    if (attempt == RB_DB_MIGRATION_SWITCH_ATTEMPTS)
+                        throw;
+                }
+            }
+            if (switched) {
+                RBLog("DB >> Migrated " + std::to_string(rows) + " fs rows to schema version " +
+                      std::to_string(RB_DB_SCHEMA_VERSION), LogLevel::INFO);
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    } catch (RBException& e) {
+        RBLog("DB >> The migration of fs stopped, it goes on at the next start: " + e.getMsg(), LogLevel::ERROR);
+    }
 }
 
-void Database::open() {
+void Database::open(int readers, const std::string& synchronous, int checkpoint_pages) {
     RBLog(std::string("DB >> SQLite version: ") + sqlite3_libversion(), LogLevel::INFO);
 
-    int res = sqlite3_open(db_path.c_str(), &db);
+    int res = sqlite3_open(db_path.c_str(), &writer.handle);
     if (res != SQLITE_OK) {
-        RBLog(std::string("DB >> Cannot open database: ") + sqlite3_errmsg(db), LogLevel::ERROR);
+        RBLog(std::string("DB >> Cannot open database: ") + sqlite3_errmsg(writer.handle), LogLevel::ERROR);
         // CHECK
         close();
         throw RBException("db_open_error");
     }
+    sqlite3_busy_timeout(writer.handle, RB_DB_BUSY_TIMEOUT_MS);
+
+    // readers need WAL mode to go on while the writer writes
+    if (readers > 0) {
+        exec("PRAGMA journal_mode = WAL;");
+        exec("PRAGMA wal_autocheckpoint = " + std::to_string(checkpoint_pages) + ";");
+    }
+    exec("PRAGMA synchronous = " + synchronous + ";");
 
     RBLog("DB >> Database opened successfully", LogLevel::INFO);
 
     init();
+
+    for (int i = 0; i < readers; i++) {
+        auto reader = std::make_unique<connection>();
+        res = sqlite3_open_v2(db_path.c_str(), &reader->handle, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr);
+        if (res != SQLITE_OK) {
+            RBLog(std::string("DB >> Cannot open reader connection: ") + sqlite3_errmsg(reader->handle), LogLevel::ERROR);
+            sqlite3_close(reader->handle);
+            close();
+            throw RBException("db_open_error");
+        }
+        sqlite3_busy_timeout(reader->handle, RB_DB_BUSY_TIMEOUT_MS);
+        idle_readers.push_back(reader.get());
+        this->readers.push_back(std::move(reader));
+    }
+    if (readers > 0)
+        RBLog("DB >> WAL mode, " + std::to_string(readers) + " reader connections", LogLevel::INFO);
+
+    if (migrating)
+        migration = std::thread([this]() { migrate_fs(); });
 }
 
 void Database::close() {
-    if (db == nullptr) return;
-    int res = sqlite3_close(db);
-    if (res != SQLITE_OK) {
-        RBLog(std::string("DB >> Cannot close database: ") + sqlite3_errmsg(db), LogLevel::ERROR);
-        throw RBException("db_close_error");
+    if (writer.handle == nullptr) return;
+    migrating = false;
+    if (migration.joinable())
+        migration.join();
+    {
+        std::unique_lock<std::mutex> ul(readers_mutex);
+        readers_cv.wait(ul, [this]() { return idle_readers.size() == readers.size(); });
+        for (auto& reader : readers)
+            close_connection(*reader);
+        idle_readers.clear();
+        readers.clear();
     }
-    db = nullptr;
 
+    {
+        // a statement of another thread can still be running
+        std::lock_guard<std::recursive_mutex> lg(writer_mutex);
+        close_connection(writer);
+    }
     RBLog("DB >> Database closed successfully", LogLevel::INFO);
 }
 
+void Database::close_connection(connection& conn) {
+    {
+        std::lock_guard<std::mutex> lg(conn.statements_mutex);
+        for (auto& [sql, stmt] : conn.statements)
+            sqlite3_finalize(stmt);
+        conn.statements.clear();
+    }
+    int res = sqlite3_close(conn.handle);
+    if (res != SQLITE_OK) {
+        RBLog(std::string("DB >> Cannot close database: ") + sqlite3_errmsg(conn.handle), LogLevel::ERROR);
+        throw RBException("db_close_error");
+    }
+    conn.handle = nullptr;
+}
+
 void Database::clear() {
-    if (db != nullptr) throw RBException("no_clear_open_db");
+    if (writer.handle != nullptr) throw RBException("no_clear_open_db");
     boost::filesystem::remove(db_path);
+    boost::filesystem::remove(db_path + "-wal");
+    boost::filesystem::remove(db_path + "-shm");
 }
 
 void Database::exec(std::string sql) {
+    std::lock_guard<std::recursive_mutex> lg(writer_mutex);
     char* errmsg = 0;
 
-    int res = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg);
+    int res = sqlite3_exec(writer.handle, sql.c_str(), nullptr, nullptr, &errmsg);
     if (res != SQLITE_OK) {
-        RBLog(std::string("DB >> Cannot execute statement: ") + errmsg, LogLevel::ERROR);
+        RBLog(std::string("DB >> Cannot execute statement: ") + (errmsg ? errmsg : sqlite3_errstr(res)), LogLevel::ERROR);
         sqlite3_free(errmsg);
         throw RBException("internal_server_error");
     }
@@ -70,39 +266,158 @@ void Database::exec(std::string sql) {
     RBLog("DB >> " + sql, LogLevel::DEBUG);
 }
 
-std::unordered_map<int, std::vector<std::string>> Database::query(
-    const std::string& sql, const std::initializer_list<std::string>& params, bool throwOnStep) {
-    Statement stmt{sql, params, throwOnStep};
-    stmt.prepare();
+void Database::transaction(const std::function<void()>& f) {
+    std::lock_guard<std::recursive_mutex> lg(writer_mutex);
+    exec("BEGIN;");
+    try {
+        f();
+        exec("COMMIT;");
+    } catch (...) {
+        // a COMMIT that failed can leave the transaction open as well
+        if (!sqlite3_get_autocommit(writer.handle))
+            sqlite3_exec(writer.handle, "ROLLBACK;", nullptr, nullptr, nullptr);
+        throw;
+    }
+}
+
+db_results_t Database::query(
+    const std::string& sql, const std::initializer_list<DbParam>& params, bool throwOnStep) {
+    std::lock_guard<std::recursive_mutex> lg(writer_mutex);
+    Statement stmt{writer, sql, params, throwOnStep};
     stmt.bind();
     return stmt.step();
 }
 
-Statement::Statement(const std::string& sql, const std::initializer_list<std::string>& params, bool throwOnStep)
-    : sql(sql), params(params), throwOnStep(throwOnStep), db(Database::get_instance()) {
-    RBLog("Statement()");
+void Database::query_each(const std::string& sql, const std::initializer_list<DbParam>& params,
+                          const db_row_visitor_t& visit, bool throwOnStep) {
+    std::lock_guard<std::recursive_mutex> lg(writer_mutex);
+    Statement stmt{writer, sql, params, throwOnStep};
+    stmt.bind();
+    stmt.each(visit);
 }
 
-Statement::~Statement() {
-    sqlite3_finalize(stmt);
-    RBLog("~Statement()");
+db_results_t Database::read(
+    const std::string& sql, const std::initializer_list<DbParam>& params, bool throwOnStep) {
+    db_results_t results;
+    int row = 0;
+    read_each(sql, params, [&](const DbRow& columns) {
+        auto& values = results[row++];
+        for (int col = 0; col < columns.size(); col++)
+            values.emplace_back(columns, col);
+    }, throwOnStep);
+    return results;
+}
+
+void Database::read_each(const std::string& sql, const std::initializer_list<DbParam>& params,
+                         const db_row_visitor_t& visit, bool throwOnStep) {
+    connection* reader = &writer;
+    {
+        std::unique_lock<std::mutex> ul(readers_mutex);
+        if (!readers.empty()) {
+            readers_cv.wait(ul, [this]() { return !idle_readers.empty(); });
+            reader = idle_readers.back();
+            idle_readers.pop_back();
+        }
+    }
+    auto release = [&]() {
+        if (reader == &writer) return;
+        {
+            std::lock_guard<std::mutex> lg(readers_mutex);
+            idle_readers.push_back(reader);
+        }
+        readers_cv.notify_all();
+    };
+
+    std::unique_lock<std::recursive_mutex> writer_lock(writer_mutex, std::defer_lock);
+    if (reader == &writer)
+        writer_lock.lock();
+    try {
+        Statement stmt{*reader, sql, params, throwOnStep};
+        stmt.bind();
+        stmt.each(visit);
+    } catch (...) {
+        release();
+        throw;
+    }
+    release();
 }
 
-void Statement::prepare() {
-    int res = sqlite3_prepare_v2(db.db, sql.c_str(), -1, &stmt, nullptr);
+sqlite3_stmt* Database::acquire_statement(connection& conn, const std::string& sql) {
+    {
+        std::lock_guard<std::mutex> lg(conn.statements_mutex);
+        auto it = conn.statements.find(sql);
+        if (it != conn.statements.end()) {
+            auto stmt = it->second;
+            conn.statements.erase(it);
+            return stmt;
+        }
+    }
+
+    sqlite3_stmt* stmt;
+    int res = sqlite3_prepare_v2(conn.handle, sql.c_str(), -1, &stmt, nullptr);
     if (res != SQLITE_OK) {
-        RBLog(std::string("DB >> Prepare error: ") + sqlite3_errmsg(db.db), LogLevel::ERROR);
+        RBLog(std::string("DB >> Prepare error: ") + sqlite3_errmsg(conn.handle), LogLevel::ERROR);
         RBLog("DB >> Cannot execute statement: " + sql, LogLevel::ERROR);
         throw RBException("internal_server_error");
     }
+    return stmt;
+}
+
+void Database::release_statement(connection& conn, const std::string& sql, sqlite3_stmt* stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    {
+        std::lock_guard<std::mutex> lg(conn.statements_mutex);
+        if (conn.statements.size() < RB_DB_STATEMENT_CACHE_MAX) {
+            conn.statements.emplace(sql, stmt);
+            return;
+        }
+    }
+    sqlite3_finalize(stmt);
+}
+
+int DbParam::bind(sqlite3_stmt* stmt, int index) const {
+    if (auto text = std::get_if<std::string_view>(&value))
+        return sqlite3_bind_text(stmt, index, text->data(), text->size(), SQLITE_STATIC);
+    if (auto integer = std::get_if<int64_t>(&value))
+        return sqlite3_bind_int64(stmt, index, *integer);
+    auto blob = std::get<DbBlob>(value);
+    return sqlite3_bind_blob64(stmt, index, blob.data, blob.size, SQLITE_STATIC);
+}
+
+DbValue::DbValue(const DbRow& row, int col)
+    : int_value(row.int64(col)), null(row.is_null(col)) {
+    // the integer is read first: reading it after the text could invalidate the text
+    auto text = row.text(col);
+    text_value.assign(text.data(), text.size());
+}
+
+bool DbRow::is_empty(int col) const {
+    auto type = sqlite3_column_type(stmt, col);
+    return type == SQLITE_NULL || (type == SQLITE_TEXT && sqlite3_column_bytes(stmt, col) == 0);
+}
+
+std::string_view DbRow::text(int col) const {
+    auto data = sqlite3_column_blob(stmt, col);
+    if (!data) return {};
+    return std::string_view(static_cast<const char*>(data), sqlite3_column_bytes(stmt, col));
+}
+
+Statement::Statement(connection& conn, const std::string& sql, const std::initializer_list<DbParam>& params,
+                     bool throwOnStep)
+    : db(Database::get_instance()), conn(conn), sql(sql), params(params), throwOnStep(throwOnStep),
+      stmt(db.acquire_statement(conn, sql)) {}
+
+Statement::~Statement() {
+    db.release_statement(conn, sql, stmt);
 }
 
 void Statement::bind() {
     int i = 1;
-    for (auto param : params) {
-        int res = sqlite3_bind_text(stmt, i, param.c_str(), param.length(), SQLITE_TRANSIENT);
+    for (auto& param : params) {
+        int res = param.bind(stmt, i);
         if (res != SQLITE_OK) {
-            RBLog(std::string("DB >> Bind error: ") + sqlite3_errmsg(db.db), LogLevel::ERROR);
+            RBLog(std::string("DB >> Bind error: ") + sqlite3_errmsg(conn.handle), LogLevel::ERROR);
             RBLog("DB >> Cannot execute statement: " + sql, LogLevel::ERROR);
             throw RBException("internal_server_error");
         }
@@ -110,43 +425,47 @@ void Statement::bind() {
     }
 }
 
-std::unordered_map<int, std::vector<std::string>> Statement::step() {
-    std::unordered_map<int, std::vector<std::string>> results;  // Defaults to {}, i.e. an empty map
+db_results_t Statement::step() {
+    db_results_t results;  // Defaults to {}, i.e. an empty map
 
     // Populate map<row, vector of columns> with db results
     // Note: SELECT COUNT(*) always returns one row and one column, even if WHERE clause is not met (count is 0).
     //       SELECT <field> can return no rows (and therefore no columns), if WHERE clause is not met.
-    int res;
     int row = 0;
-    while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {                // While there are rows in the result set
-        for (int col = 0; col < sqlite3_column_count(stmt); col++) {  // Iterate over the row's columns
-            auto result = sqlite3_column_text(stmt, col);
-            results[row].push_back(std::string(reinterpret_cast<const char*>(result)));
-        }
-        row++;
-    }
+    each([&](const DbRow& columns) {
+        auto& values = results[row++];
+        for (int col = 0; col < columns.size(); col++)    // Iterate over the row's columns
+            values.emplace_back(columns, col);
+    });
+
+    return results;
+}
+
+void Statement::each(const db_row_visitor_t& visit) {
+    int res;
+    DbRow row(stmt);
+    while ((res = sqlite3_step(stmt)) == SQLITE_ROW)                  // While there are rows in the result set
+        visit(row);
 
     if (res != SQLITE_DONE) {
         if (throwOnStep) {
             throw RBException(
-                std::string("db_step_error:") + sqlite3_errmsg(db.db));
+                std::string("db_step_error:") + sqlite3_errmsg(conn.handle));
         } else
             RBLog(std::string("DB >> Step error: ") +
-                      sqlite3_errmsg(db.db),
+                      sqlite3_errmsg(conn.handle),
                   LogLevel::ERROR);
     } else
         RBLog("DB >> " + sql, LogLevel::DEBUG);
-
-    return results;
 }
 
-void Statement::print_results(const std::unordered_map<int, std::vector<std::string>>& results) {
+void Statement::print_results(const db_results_t& results) {
     std::ostringstream oss;
     oss << "Query rows: " << results.size() << std::endl;
     for (auto& [key, value] : results) {
         oss << "       [row " << key << "] ";
         for (auto& col : value)
-            oss << col << ", ";
+            oss << col.text() << ", ";
         oss << std::endl;
     }
     RBLog("DB >> " + oss.str());
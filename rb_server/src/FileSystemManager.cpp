@@ -2,32 +2,55 @@
 
 #include <utility>
 
-std::unordered_map<std::string, RBFileMetadata> FileSystemManager::get_files(const std::string& username) {
+void FileSystemManager::get_files(const std::string& username,
+                                  google::protobuf::Map<std::string, RBFileMetadata>& files) {
     std::shared_lock<std::shared_mutex> slock(mutex);
     auto& db = Database::get_instance();
     std::string sql = "SELECT path, hash, last_write_time, size FROM fs WHERE username = ?;";
-    auto results = db.query(sql, {username});
 
-    std::unordered_map<std::string, RBFileMetadata> files;
-
-    if (results.empty())
-        return files;
-
-    for (auto & [key, value] : results) {
-
-        RBFileMetadata meta;
-        if (!value[1].empty())
-            meta.set_checksum(std::stoul(value[1]));
-        if (!value[2].empty())
-            meta.set_last_write_time(std::stoll(value[2]));
-        if (!value[3].empty())
-            meta.set_size(std::stoull(value[3]));
+    // Rows go straight into the map as they're read
+    db.read_each(sql, {username}, [&](const DbRow& row) {
+        auto path = row.text(0);
+        auto& meta = files[std::string(path.data(), path.size())];
+        if (!row.is_empty(1))
+            meta.set_checksum(row.int64(1));
+        if (!row.is_empty(2))
+            meta.set_last_write_time(row.int64(2));
+        if (!row.is_empty(3))
+            meta.set_size(row.int64(3));
+    });
+}
 
-        // Add metadata
-        files[value[0]] = meta;
-    }
+void FileSystemManager::get_files_page(const std::string& username, const std::string& after, size_t limit,
+                                       RBProbeResponse& page) {
+    std::shared_lock<std::shared_mutex> slock(mutex);
+    auto& db = Database::get_instance();
+    limit = limit == 0 ? RB_PROBE_PAGE_MAX : std::min<size_t>(limit, RB_PROBE_PAGE_MAX);
+    // one more row tells if there are files after the page
+    std::string sql = "SELECT path, hash, last_write_time, size FROM fs WHERE username = ? AND path > ? "
+                      "ORDER BY path LIMIT ?;";
+
+    db.read_each(sql, {username, after, limit + 1}, [&](const DbRow& row) {
+        if (static_cast<size_t>(page.entries_size()) == limit) {
+            page.set_more(true);
+            return;
+        }
+        auto entry = page.add_entries();
+        auto path = row.text(0);
+        entry->set_path(path.data(), path.size());
+        auto meta = entry->mutable_metadata();
+        if (!row.is_empty(1))
+            meta->set_checksum(row.int64(1));
+        if (!row.is_empty(2))
+            meta->set_last_write_time(row.int64(2));
+        if (!row.is_empty(3))
+            meta->set_size(row.int64(3));
+    });
+}
 
-    return files;
+void FileSystemManager::compare_tree(const std::string& username, const RBTreeRequest& req, RBTreeResponse& res) {
+    std::shared_lock<std::shared_mutex> slock(mutex);
+    tree_index.compare(username, req, res);
 }
 
 bool FileSystemManager::file_exists(std::string username, const fs::path& path) {
@@ -45,9 +68,9 @@ bool FileSystemManager::file_exists(std::string username, const fs::path& path)
     auto& db = Database::get_instance();
 
     std::string sql = "SELECT COUNT(*) FROM fs WHERE username = ? AND path = ?;";
-    auto results = db.query(sql, {username, path.string()});
+    auto results = db.read(sql, {username, path.string()});
 
-    auto count = std::stoi(results[0][0]);
+    auto count = results[0][0].int64();
     if (count == 0) {
         RBLog("FSM >> The file provided exists but is not present in the db", LogLevel::ERROR);
         return false;
@@ -76,74 +99,270 @@ void FileSystemManager::write_file(const std::string& username, const RBRequest&
     auto segment_id = file_segment.segmentid();
     auto req_normal_path = fs::path(req_path).lexically_normal().string();
 
-    // Check correct segment number from db before writing it
-    auto& db = Database::get_instance();
-    std::string sql = "SELECT last_segment FROM fs WHERE username = ? AND path = ?;";
-    auto results = db.query(sql, {username, req_normal_path});
+    // Striped uploads: after the first one, segments come in any order from several channels
+    if (file_segment.striped() && segment_id != 0) {
+        write_striped_segment(username, req_normal_path, path, file_segment);
+        return;
+    }
 
-    auto last_segment = 0;
-    if (!results.empty())
-        last_segment = std::stoi(results[0][0]);
+    // Check correct segment number before writing it. Uploads that aren't in progress here,
+    // after a restart, continue from what the db has
+    auto& db = Database::get_instance();
+    auto key = username + ">" + req_normal_path;
+    int64_t last_segment = 0;
+    std::optional<uint64_t> written;
+    bool in_progress = false;
+    {
+        std::lock_guard<std::mutex> lg(progress_mutex);
+        auto it = upload_progress.find(key);
+        if (it != upload_progress.end()) {
+            last_segment = it->second.last_segment;
+            written = it->second.written;
+            in_progress = true;
+        }
+    }
+    if (!in_progress && segment_id != 0) {
+        // only an upload that didn't end goes on: a row with its hash is a complete file,
+        // finished or linked, whose content can be shared with other users
+        std::string sql = "SELECT last_segment, written, hash FROM fs WHERE username = ? AND path = ?;";
+        auto results = db.query(sql, {username, req_normal_path});
+        if (results.empty() || !results[0][2].text().empty())
+            throw RBException("wrong_segment");
+        last_segment = results[0][0].int64();
+        if (!results[0][1].text().empty())
+            written = results[0][1].int64();
+    }
 
     // Skip this check if segment_id == 0 to allow starting over at any time
     if (segment_id != 0 && segment_id != last_segment + 1)
         throw RBException("wrong_segment");
-    
+
+    // Delta uploads are built aside: the stored version is their base until the last segment
+    bool delta = file_segment.delta_block_size() > 0;
+    if (delta && file_segment.delta_block_size() > RB_DELTA_MAX_BLOCK_SIZE)
+        throw RBException("invalid_delta");
+    if (delta && segment_id == 0 &&
+        get_hash(username, req_normal_path) != file_segment.delta_base_checksum())
+        throw RBException("delta_base_changed");
+    auto write_path = delta ? delta_path(username, req_normal_path) : path;
+
     // Create directories containing the file
     fs::create_directories(path.parent_path());
+    fs::create_directories(write_path.parent_path());
     
-    // Create or overwrite file if it's the first segment (segment_id == 0), otherwise append to file
-    auto open_mode = segment_id == 0 ? std::ios::trunc : std::ios::app;
-    std::ofstream ofs = std::ofstream(
-        path.string(), open_mode | std::ios::binary
-    );
-    
-    if (ofs.is_open()) {
-        for (const std::string& datum : file_segment.data())
-            ofs << datum;
-        ofs.close();
-    } else {
-        RBLog("FSM >> Cannot open file", LogLevel::ERROR);
-        throw RBException("internal_server_error");
+    // The first segment (segment_id == 0) creates or overwrites the file, the others are appended to it
+    auto session = segment_id == 0
+        ? write_engine.start(key, write_path, file_segment.file_metadata().size())
+        : write_engine.resume(key, write_path, true, written);
+
+    std::string scratch;
+    auto payload = segment_payload(file_segment, scratch);
+    session->append(payload.data(), payload.size());
+    if (file_segment.chunk_refs_size() > 0 || delta) {
+        std::ostream os(session.get());
+        os.exceptions(std::ios::badbit);
+        // chunked uploads: the content comes from the chunk store
+        for (const auto& chunk_ref : file_segment.chunk_refs())
+            chunk_store.copy_to(username, chunk_ref.hash(), chunk_ref.size(), os);
+        if (delta)
+            apply_delta(path, file_segment, os);
     }
 
-    // Save number of written-to-file segments
-    if (segment_id == 0) {
+    // The first segment replaces the stored version right away: the row doesn't tell
+    // a complete file anymore. A delta leaves it in place, and its row, until it's checked
+    if (segment_id == 0 && !delta) {
         // CHECK Entry automatically replaced on insert if pair (username, path) conflict
         db.query(
-            "INSERT INTO fs (username, path, last_segment) VALUES (?, ?, ?);",
-            {username, req_normal_path, std::to_string(segment_id)}
-        );
-    } else {
-        db.query(
-            "UPDATE fs SET last_segment = ? WHERE username = ? AND path = ?;",
-            {std::to_string(segment_id), username, req_normal_path}
+            "INSERT INTO fs (username, path, last_segment, written) VALUES (?, ?, ?, ?);",
+            {username, req_normal_path, segment_id, session->get_end()}
         );
+        tree_index.touch(username, req_normal_path);
     }
 
     // Stop here if it's not the last segment
-    int num_segments = count_segments(file_segment.file_metadata().size());
-    if (num_segments != segment_id + 1)
+    int num_segments = file_segment.segment_count() > 0
+        ? file_segment.segment_count()
+        : count_segments(file_segment.file_metadata().size());
+    bool last = num_segments == segment_id + 1;
+    {
+        std::lock_guard<std::mutex> lg(progress_mutex);
+        if (last || file_segment.striped())
+            upload_progress.erase(key);
+        else
+            // the row of a delta is the stored version's one, its progress isn't recorded
+            upload_progress[key] = {username, req_normal_path, segment_id, session->get_end(),
+                                    segment_id != 0 && !delta, ch::steady_clock::now()};
+    }
+    if (!last) {
+        if (file_segment.striped()) {
+            std::lock_guard<std::mutex> lg(striped_mutex);
+            auto& upload = striped_uploads[key];
+            upload.metadata = file_segment.file_metadata();
+            upload.received.assign(num_segments, false);
+            upload.received[0] = true;
+            upload.received_count = 1;
+        }
         return;
+    }
+
+    write_engine.finish(key);
+    finalize_file(username, req_normal_path, path, file_segment.file_metadata(), std::move(session), segment_id);
+}
+
+void FileSystemManager::write_striped_segment(const std::string& username, const std::string& normal_path,
+                                              const fs::path& path, const RBFileSegment& file_segment) {
+    auto key = username + ">" + normal_path;
+    auto segment_id = file_segment.segmentid();
+
+    uint64_t size;
+    {
+        std::lock_guard<std::mutex> lg(striped_mutex);
+        auto it = striped_uploads.find(key);
+        // the first segment creates the upload, which ends when it's complete or aborted
+        if (it == striped_uploads.end() || segment_id < 0 ||
+            static_cast<uint64_t>(segment_id) >= it->second.received.size())
+            throw RBException("wrong_segment");
+        size = it->second.metadata.size();
+    }
+
+    // Every segment is RB_MAX_SEGMENT_SIZE long, except the last one: this gives its offset
+    std::string scratch;
+    auto payload = segment_payload(file_segment, scratch);
+    uint64_t offset = static_cast<uint64_t>(segment_id) * RB_MAX_SEGMENT_SIZE;
+    if (offset + payload.size() != std::min<uint64_t>(offset + RB_MAX_SEGMENT_SIZE, size))
+        throw RBException("invalid_segment_size");
+
+    auto session = write_engine.resume(key, path, false);
+    session->write_at(offset, payload.data(), payload.size());
+
+    RBFileMetadata metadata;
+    int64_t last_segment;
+    {
+        std::lock_guard<std::mutex> lg(striped_mutex);
+        auto it = striped_uploads.find(key);
+        if (it == striped_uploads.end())
+            throw RBException("wrong_segment");
+
+        auto& upload = it->second;
+        if (!upload.received[segment_id]) {
+            upload.received[segment_id] = true;
+            upload.received_count++;
+        }
+        if (upload.received_count != upload.received.size())
+            return;
+
+        metadata = upload.metadata;
+        last_segment = static_cast<int64_t>(upload.received.size()) - 1;
+        striped_uploads.erase(it);
+    }
+    write_engine.finish(key);
+
+    finalize_file(username, normal_path, path, metadata, std::move(session), last_segment);
+}
+
+void FileSystemManager::finalize_file(const std::string& username, const std::string& normal_path,
+                                      const fs::path& path, const RBFileMetadata& metadata,
+                                      std::shared_ptr<WriteSession> session, int64_t last_segment) {
+    auto& db = Database::get_instance();
 
-    // Calculate final checksum
-    auto checksum = calculate_checksum(path);
-    if (checksum != file_segment.file_metadata().checksum()) {
+    // The final checksum, and the content hash for the object store, come from the
+    // session that wrote the file. It's read again only if the session couldn't tell them.
+    // A delta has been written aside, the version it's built from stays until it's checked
+    auto written_path = session->get_path();
+    uint32_t checksum;
+    std::string digest;
+    if (!session->digests(metadata.size(), checksum, digest)) {
+        RBLog("FSM >> Reading " + written_path.string() + " again to checksum it");
+        RBCrc32 crc;
+        RBSha256 sha;
+        std::ifstream ifs(written_path.string(), std::ios::binary);
+        std::vector<char> buffer(RB_MAX_SEGMENT_SIZE);
+        while (ifs.read(&buffer[0], buffer.size()) || ifs.gcount()) {
+            crc.process_bytes(&buffer[0], ifs.gcount());
+            sha.process_bytes(&buffer[0], ifs.gcount());
+        }
+        checksum = crc.checksum();
+        digest = sha.digest();
+    }
+    session.reset();
+
+    if (checksum != metadata.checksum()) {
         // CHECK Clean up file and related db entry
-        fs::remove(path);
-        db.query(
-            "DELETE FROM fs WHERE username = ? AND path = ?;",
-            {username, req_normal_path}
-        );
+        fs::remove(written_path);
+        if (written_path == path) {
+            db.query(
+                "DELETE FROM fs WHERE username = ? AND path = ?;",
+                {username, normal_path}
+            );
+            tree_index.touch(username, normal_path);
+        }
         throw RBException("invalid_checksum");
     }
+    if (written_path != path)
+        fs::rename(written_path, path);
+
+    auto object = to_hex(digest);
+    object_store.ingest(object, path);
 
-    auto hash = std::to_string(checksum);
-    auto lwt_str = std::to_string(file_segment.file_metadata().last_write_time());
-    auto size_str = std::to_string(file_segment.file_metadata().size());
-    sql = "UPDATE fs SET hash = ?, last_write_time = ?, size = ? WHERE username = ? AND path = ?;";
+    std::string sql = "UPDATE fs SET hash = ?, last_write_time = ?, size = ?, object = ?, last_segment = ?, written = ? "
+                      "WHERE username = ? AND path = ?;";
     
-    db.query(sql, {hash, lwt_str, size_str, username, req_normal_path});
+    db.query(sql, {checksum, metadata.last_write_time(), metadata.size(), object, last_segment, metadata.size(),
+                   username, normal_path});
+    tree_index.touch(username, normal_path);
+}
+
+void FileSystemManager::flush_progress() {
+    auto& db = Database::get_instance();
+
+    // The dirty entries are copied within the transaction, which holds the writer connection:
+    // the row of an upload that ends meanwhile is finalized after it. progress_mutex is only
+    // held while copying, the uploads don't wait for the db
+    std::vector<std::pair<std::string, upload_progress_t>> flushed;
+    bool dirty = false;
+    {
+        std::lock_guard<std::mutex> lg(progress_mutex);
+        for (auto& [key, progress] : upload_progress)
+            dirty = dirty || progress.dirty;
+    }
+    if (dirty) {
+        try {
+            db.transaction([&]() {
+                {
+                    std::lock_guard<std::mutex> lg(progress_mutex);
+                    for (auto& [key, progress] : upload_progress)
+                        if (progress.dirty) flushed.emplace_back(key, progress);
+                }
+                for (auto& [key, progress] : flushed)
+                    db.query(
+                        "UPDATE fs SET last_segment = ?, written = ? WHERE username = ? AND path = ?;",
+                        {progress.last_segment, progress.written, progress.username, progress.normal_path},
+                        true
+                    );
+            });
+        } catch (RBException& e) {
+            RBLog("FSM >> Cannot record the progress of the uploads: " + e.getMsg(), LogLevel::ERROR);
+            return;
+        }
+    }
+
+    std::lock_guard<std::mutex> lg(progress_mutex);
+    // the ones that went on meanwhile are still dirty
+    for (auto& [key, progress] : flushed) {
+        auto it = upload_progress.find(key);
+        if (it != upload_progress.end() && it->second.last_segment == progress.last_segment &&
+            it->second.written == progress.written)
+            it->second.dirty = false;
+    }
+
+    // abandoned uploads are left to the db, as after a restart
+    auto expiry = ch::steady_clock::now() - ch::seconds(RB_WRITE_SESSION_TIMEOUT_SECS);
+    for (auto it = upload_progress.begin(); it != upload_progress.end();) {
+        if (!it->second.dirty && it->second.last_use < expiry)
+            it = upload_progress.erase(it);
+        else
+            ++it;
+    }
 }
 
 void FileSystemManager::remove_file(const std::string& username, const RBRequest& req) {
@@ -168,12 +387,39 @@ void FileSystemManager::remove_file(const std::string& username, const RBRequest
     fs::remove(path);
     
     auto req_normal_path = fs::path(req_path).lexically_normal().string();
+    discard_upload(username, req_normal_path);
 
     auto& db = Database::get_instance();
     db.query(
         "DELETE FROM fs WHERE username = ? AND path = ?;",
         {username, req_normal_path}
     );
+    tree_index.touch(username, req_normal_path);
+}
+
+void FileSystemManager::abort_upload(const std::string& username, const RBRequest& req) {
+    auto req_normal_path = fs::path(req.file_segment().path()).lexically_normal().string();
+    if (!get_hash(username, req_normal_path)) {
+        remove_file(username, req);
+        return;
+    }
+
+    std::shared_lock<std::shared_mutex> slock(mutex);
+    discard_upload(username, req_normal_path);
+}
+
+void FileSystemManager::discard_upload(const std::string& username, const std::string& normal_path) {
+    auto key = username + ">" + normal_path;
+    fs::remove(delta_path(username, normal_path));
+    {
+        std::lock_guard<std::mutex> lg(striped_mutex);
+        striped_uploads.erase(key);
+    }
+    {
+        std::lock_guard<std::mutex> lg(progress_mutex);
+        upload_progress.erase(key);
+    }
+    write_engine.finish(key);
 }
 
 void FileSystemManager::read_file_segment(const std::string& username, const RBRequest& req, RBResponse& res) {
@@ -202,7 +448,7 @@ void FileSystemManager::read_file_segment(const std::string& username, const RBR
     }
 
     ifs.seekg(0, ifs.end);
-    int length = ifs.tellg(); // Get length of file
+    int64_t length = ifs.tellg(); // Get length of file
 
     /*
     RBLog("Path: " + path.string());
@@ -216,19 +462,189 @@ void FileSystemManager::read_file_segment(const std::string& username, const RBR
         throw RBException("invalid_read");
     }
 
-    std::vector<char> buffer(RB_MAX_SEGMENT_SIZE, 0);
+    // the segment is read straight into the response
+    auto file_segment = std::make_unique<RBFileSegment>();
+    auto data = file_segment->add_data();
+    data->resize(std::min<int64_t>(RB_MAX_SEGMENT_SIZE, length - pos));
     ifs.seekg(pos);
-    ifs.read(&buffer[0], RB_MAX_SEGMENT_SIZE);
-    auto read = ifs.gcount(); // Get the number of characters that have been read
+    ifs.read(data->data(), data->size());
+    if (!ifs) {
+        RBLog("FSM >> Cannot read file \"" + path.string() + "\"", LogLevel::ERROR);
+        throw RBException("cannot_read_file");
+    }
     ifs.close();
 
-    auto file_segment = std::make_unique<RBFileSegment>();
-    file_segment->add_data(&buffer[0], read);
     file_segment->set_segmentid(segment_id);
     file_segment->set_path(fs::path(req_path).lexically_normal().string());
+    if (file_segment_info.compression() != RBCompression::COMP_NONE && codec_available(file_segment_info.compression()))
+        compress_segment(file_segment_info.compression(), *file_segment);
     res.set_allocated_file_segment(file_segment.release());
 }
 
+void FileSystemManager::offer_chunks(const std::string& username, const RBRequest& req, RBResponse& res) {
+    std::shared_lock<std::shared_mutex> slock(mutex);
+    const auto& chunks = req.chunk_offer().chunks();
+
+    auto offer_response = std::make_unique<RBChunkOfferResponse>();
+    for (int i = 0; i < chunks.size(); i++) {
+        if (!chunk_store.has(username, chunks[i].hash()))
+            offer_response->add_missing(i);
+    }
+
+    RBLog("FSM >> " + std::to_string(offer_response->missing_size()) + "/" +
+          std::to_string(chunks.size()) + " offered chunks are missing");
+    res.set_allocated_chunk_offer_response(offer_response.release());
+}
+
+void FileSystemManager::store_chunks(const std::string& username, const RBRequest& req) {
+    std::shared_lock<std::shared_mutex> slock(mutex);
+    for (const auto& chunk : req.chunk_data().chunks())
+        chunk_store.put(username, chunk.hash(), chunk.data());
+}
+
+void FileSystemManager::file_signature(const std::string& username, const RBRequest& req, RBResponse& res) {
+    std::shared_lock<std::shared_mutex> slock(mutex);
+    const std::string& req_path = req.file_segment().path();
+    if (req_path.find("..") != std::string::npos) {
+        RBLog("FSM >> The path provided contains '..' (forbidden)", LogLevel::ERROR);
+        throw RBException("forbidden_path");
+    }
+
+    auto path = root / username / fs::path(req_path).lexically_normal();
+    if (path.filename().empty()) {
+        RBLog("FSM >> The path provided is not formatted as a valid file path", LogLevel::ERROR);
+        throw RBException("malformed_path");
+    }
+
+    auto signature = std::make_unique<RBSignatureResponse>();
+
+    // Only complete versions have a checksum, partial uploads can't be a delta base
+    auto hash = get_hash(username, fs::path(req_path).lexically_normal().string());
+    boost::system::error_code ec;
+    auto file_size = fs::file_size(path, ec);
+    std::ifstream ifs(path.string(), std::ios::binary);
+    auto block_size = delta_block_size(file_size);
+    // a version with too many blocks gets none, as a file without one
+    bool too_large = file_size / block_size > RB_SIGNATURE_MAX_BLOCKS;
+    if (hash && !ec && ifs && !too_large) {
+        signature->set_block_size(block_size);
+        signature->set_checksum(*hash);
+
+        // the trailing partial block is left out, it's sent as literal data, as the blocks
+        // of a file grown meanwhile past the limit
+        std::vector<unsigned char> block(block_size);
+        RollingChecksum weak;
+        while (signature->blocks_size() < RB_SIGNATURE_MAX_BLOCKS &&
+               ifs.read(reinterpret_cast<char*>(&block[0]), block_size)) {
+            weak.reset(&block[0], block_size);
+            auto block_signature = signature->add_blocks();
+            block_signature->set_weak(weak.digest());
+            block_signature->set_strong(delta_strong_hash(&block[0], block_size));
+        }
+    }
+
+    RBLog("FSM >> Signature of " + path.string() + ": " + std::to_string(signature->blocks_size()) + " blocks");
+    res.set_allocated_signature_response(signature.release());
+}
+
+void FileSystemManager::link_file(const std::string& username, const RBRequest& req, RBResponse& res) {
+    std::shared_lock<std::shared_mutex> slock(mutex);
+    auto& file_segment = req.file_segment();
+
+    const std::string& req_path = file_segment.path();
+    if (req_path.find("..") != std::string::npos) {
+        RBLog("FSM >> The path provided contains '..' (forbidden)", LogLevel::ERROR);
+        throw RBException("forbidden_path");
+    }
+
+    auto path = root / username / fs::path(req_path).lexically_normal();
+    if (path.filename().empty()) {
+        RBLog("FSM >> The path provided is not formatted as a valid file path", LogLevel::ERROR);
+        throw RBException("malformed_path");
+    }
+
+    auto req_normal_path = fs::path(req_path).lexically_normal().string();
+    auto object = to_hex(file_segment.object_hash());
+    auto& metadata = file_segment.file_metadata();
+
+    // The checksum and the size of the content are known from the files already
+    // referring to it, they have to match as well as the hash
+    auto& db = Database::get_instance();
+    auto results = db.query("SELECT hash, size FROM fs WHERE object = ? LIMIT 1;", {object});
+    bool linked = !results.empty() && !results[0][0].text().empty() &&
+                  results[0][0].int64() == metadata.checksum() &&
+                  results[0][1].int64() == static_cast<int64_t>(metadata.size()) &&
+                  object_store.has(object);
+
+    if (linked) {
+        // an upload of the file in progress is over, its next segment starts it again
+        discard_upload(username, req_normal_path);
+        fs::create_directories(path.parent_path());
+        object_store.link_to(object, path);
+        db.query(
+            "INSERT INTO fs (username, path, hash, last_write_time, size, last_segment, object) VALUES (?, ?, ?, ?, ?, ?, ?);",
+            {username, req_normal_path, metadata.checksum(), metadata.last_write_time(), metadata.size(), 0, object}
+        );
+        tree_index.touch(username, req_normal_path);
+        RBLog("FSM >> " + path.string() + " linked to object " + object);
+    }
+
+    auto link_response = std::make_unique<RBLinkResponse>();
+    link_response->set_linked(linked);
+    res.set_allocated_link_response(link_response.release());
+}
+
+void FileSystemManager::collect_objects() {
+    // the uploads and the links go on meanwhile, the store checks each object again
+    std::shared_lock<std::shared_mutex> slock(mutex);
+    auto& db = Database::get_instance();
+    std::unordered_set<std::string> referenced;
+    db.read_each("SELECT DISTINCT object FROM fs WHERE object != '';", {}, [&](const DbRow& row) {
+        referenced.emplace(row.text(0));
+    });
+
+    object_store.collect_garbage(referenced);
+}
+
+void FileSystemManager::apply_delta(const fs::path& base_path, const RBFileSegment& file_segment, std::ostream& os) {
+    uint64_t block_size = file_segment.delta_block_size();
+    std::ifstream base;
+    uint64_t base_blocks = 0;
+    std::vector<char> buffer;
+
+    for (const auto& op : file_segment.delta()) {
+        if (op.block_count() == 0) {
+            os << op.literal();
+            continue;
+        }
+        if (!op.literal().empty())
+            throw RBException("invalid_delta");
+
+        if (!base.is_open()) {
+            base.open(base_path.string(), std::ios::binary);
+            if (!base) throw RBException("missing_delta_base");
+            base_blocks = fs::file_size(base_path) / block_size;
+            buffer.resize(block_size);
+        }
+        if (op.block() > base_blocks || op.block_count() > base_blocks - op.block())
+            throw RBException("invalid_delta");
+
+        base.seekg(op.block() * block_size);
+        for (uint32_t i = 0; i < op.block_count(); i++) {
+            base.read(&buffer[0], block_size);
+            if (!base) {
+                RBLog("FSM >> Cannot read delta base " + base_path.string(), LogLevel::ERROR);
+                throw RBException("internal_server_error");
+            }
+            os.write(&buffer[0], block_size);
+        }
+    }
+}
+
+fs::path FileSystemManager::delta_path(const std::string& username, const std::string& normal_path) {
+    return delta_root / username / to_hex(strong_hash(normal_path.data(), normal_path.size()));
+}
+
 std::string FileSystemManager::md5(fs::path path) {
     std::shared_lock<std::shared_mutex> slock(mutex);
     MD5_CTX md5_ctx;
@@ -258,50 +674,45 @@ std::string FileSystemManager::to_string(unsigned char* md) {
     return ss.str();
 }
 
-std::string FileSystemManager::get_hash(std::string username, const fs::path& path) {
+std::optional<uint32_t> FileSystemManager::get_hash(std::string username, const fs::path& path) {
     auto& db = Database::get_instance();
 
     std::string sql = "SELECT hash FROM fs WHERE username = ? AND path = ?";
 
-    auto results = db.query(sql, {username, path.string()});
-    if (results.empty())
-        return "";
+    auto results = db.read(sql, {username, path.string()});
+    if (results.empty() || results[0][0].text().empty())
+        return std::nullopt;
 
-    auto hash = results[0][0];
-
-    return hash;
+    return results[0][0].int64();
 }
 
-std::string FileSystemManager::get_size(std::string username, const fs::path& path) {
+std::optional<uint64_t> FileSystemManager::get_size(std::string username, const fs::path& path) {
     auto& db = Database::get_instance();
 
     std::string sql = "SELECT size FROM fs WHERE username = ? AND path = ?;";
 
-    auto results = db.query(sql, {username, path.string()});
-    if (results.empty())
-        return "";
+    auto results = db.read(sql, {username, path.string()});
+    if (results.empty() || results[0][0].text().empty())
+        return std::nullopt;
 
-    auto size = results[0][0];
-
-    return size;
+    return results[0][0].int64();
 }
 
-std::string FileSystemManager::get_last_write_time(std::string username, const fs::path& path) {
+std::optional<int64_t> FileSystemManager::get_last_write_time(std::string username, const fs::path& path) {
     auto& db = Database::get_instance();
 
     std::string sql = "SELECT last_write_time FROM fs WHERE username = ? AND path = ?;";
 
-    auto results = db.query(sql, {username, path.string()});
-    if (results.empty())
-        return "";
-
-    auto last_write_time = results[0][0];
+    auto results = db.read(sql, {username, path.string()});
+    if (results.empty() || results[0][0].text().empty())
+        return std::nullopt;
 
-    return last_write_time;
+    return results[0][0].int64();
 }
 
 void FileSystemManager::clear() {
     std::unique_lock<std::shared_mutex> ulock(mutex);
+    tree_index.clear();
     boost::filesystem::remove_all(root);
 }
 
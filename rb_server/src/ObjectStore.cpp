@@ -0,0 +1,89 @@
+#include "ObjectStore.h"
+
+#include <vector>
+
+#define RB_OBJECT_HEX_SIZE 64
+
+ObjectStore::ObjectStore(const fs::path &root) : root(root) {
+    boost::system::error_code ec;
+    fs::remove_all(root / "tmp", ec);
+    if (ec)
+        RBLog("ObjectStore >> Cannot clean " + (root / "tmp").string() + ": " + ec.message(), LogLevel::ERROR);
+}
+
+fs::path ObjectStore::object_path(const std::string &hex) {
+    if (hex.size() != RB_OBJECT_HEX_SIZE)
+        throw RBException("invalid_object_hash");
+    return root / "objects" / hex.substr(0, 2) / hex;
+}
+
+bool ObjectStore::has(const std::string &hex) {
+    boost::system::error_code ec;
+    return fs::is_regular_file(object_path(hex), ec);
+}
+
+void ObjectStore::link_to(const std::string &hex, const fs::path &dest) {
+    std::lock_guard<std::mutex> lg(mutex);
+    link_locked(hex, dest);
+}
+
+void ObjectStore::link_locked(const std::string &hex, const fs::path &dest) {
+    auto path = object_path(hex);
+
+    // linked aside and renamed, so dest is replaced atomically. Random names don't collide
+    // with the ones of another thread or left by a crash
+    auto tmp_path = root / "tmp" / fs::unique_path("%%%%%%%%%%%%%%%%");
+    fs::create_directories(tmp_path.parent_path());
+
+    boost::system::error_code ec;
+    fs::create_hard_link(path, tmp_path, ec);
+    if (ec) {
+        RBLog("ObjectStore >> Cannot link object " + hex + ": " + ec.message(), LogLevel::ERROR);
+        throw RBException("missing_object");
+    }
+    fs::rename(tmp_path, dest);
+}
+
+void ObjectStore::ingest(const std::string &hex, const fs::path &file) {
+    std::lock_guard<std::mutex> lg(mutex);
+    if (has(hex)) {
+        link_locked(hex, file);
+        return;
+    }
+
+    auto path = object_path(hex);
+    fs::create_directories(path.parent_path());
+    boost::system::error_code ec;
+    fs::create_hard_link(file, path, ec);
+    // somebody else stored the same content in the meantime
+    if (ec == boost::system::errc::file_exists)
+        link_locked(hex, file);
+    else if (ec)
+        throw RBException("internal_server_error");
+}
+
+void ObjectStore::collect_garbage(const std::unordered_set<std::string> &referenced) {
+    auto objects = root / "objects";
+    if (!fs::is_directory(objects)) return;
+
+    size_t removed = 0;
+    boost::system::error_code ec;
+    for (fs::directory_iterator dir(objects, ec), end; !ec && dir != end; dir.increment(ec)) {
+        // the objects of a directory are listed before any of them is removed
+        std::vector<fs::path> unreferenced;
+        boost::system::error_code dir_ec;
+        for (fs::directory_iterator it(dir->path(), dir_ec); !dir_ec && it != end; it.increment(dir_ec))
+            if (fs::is_regular_file(it->path()) && !referenced.count(it->path().filename().string()))
+                unreferenced.push_back(it->path());
+
+        for (auto& path : unreferenced) {
+            std::lock_guard<std::mutex> lg(mutex);
+            boost::system::error_code file_ec;
+            if (fs::hard_link_count(path, file_ec) == 1 && !file_ec && fs::remove(path, file_ec))
+                removed++;
+        }
+    }
+
+    if (removed)
+        RBLog("ObjectStore >> Collected " + std::to_string(removed) + " unreferenced objects", LogLevel::INFO);
+}
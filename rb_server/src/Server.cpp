@@ -2,116 +2,170 @@
 
 using namespace boost;
 
-Service::Service(sockPtr_t sock, RBSrvCallback callback)
+Service::Service(sockPtr_t sock, RBSrvCallback callback, asio::thread_pool &disk_pool)
     : sock(sock),
-      handler([callback, this](sockPtr_t sock) {
-          AsioInputStream<boost::asio::ip::tcp::socket> ais(sock);
-          AsioOutputStream<boost::asio::ip::tcp::socket> aos(sock);
-          CopyingInputStreamAdaptor cis_adp(&ais);
-          CopyingOutputStreamAdaptor cos_adp(&aos);
-
-          bool final = false;
-          while (!final) {
-              RBRequest req;
+      strand(asio::make_strand(sock->get_executor())),
+      callback(callback),
+      disk_pool(disk_pool)
+{
+    RBLog("Service()");
+}
 
-              bool op = google::protobuf::io::readDelimitedFrom(&req, &cis_adp);
+std::shared_ptr<Service> Service::create(sockPtr_t sock, RBSrvCallback callback, asio::thread_pool &disk_pool) {
+    return std::shared_ptr<Service>(new Service(sock, callback, disk_pool));
+}
 
-              if (!op)
-                  throw RBException("request_receive_fail");
+void Service::start() {
+    asio::dispatch(strand, [self = shared_from_this()]() { self->read_request(); });
+}
 
-              RBResponse res = callback(req, shared_from_this());
+// Parses the next delimited request out of in_buf, if it has been received entirely
+bool Service::take_request(RBRequest &req) {
+    missing = 1;
+    auto data = static_cast<const uint8_t *>(in_buf.data().data());
 
-              op = google::protobuf::io::writeDelimitedTo(res, &cos_adp);
-              cos_adp.Flush();
-              if (!op)
-                  throw RBException("response_send_fail");
+    uint32_t size;
+    size_t prefix_size;
+    if (!google::protobuf::io::readDelimitedSize(data, in_buf.size(), &size, &prefix_size)) {
+        if (in_buf.size() >= 5) throw RBException("request_receive_fail");
+        return false;
+    }
+    if (size > RB_MAX_REQUEST_SIZE) throw RBException("request_too_large");
 
-              final = req.final();
-          }
-      })
-{
-    RBLog("Service()");
-}
+    size_t frame_size = prefix_size + size;
+    if (in_buf.size() < frame_size) {
+        missing = frame_size - in_buf.size();
+        return false;
+    }
 
-std::shared_ptr<Service> Service::create(sockPtr_t sock, RBSrvCallback callback) {
-    return std::shared_ptr<Service>(new Service(sock, callback));
+    if (!req.ParseFromArray(data + prefix_size, size))
+        throw RBException("request_receive_fail");
+    in_buf.consume(frame_size);
+    return true;
 }
 
-void Service::handle_request() {
+void Service::read_request() {
     try {
-        handler(sock);
-        sock.get()->close();
+        RBRequest req;
+        // pipelining clients may have already sent the next request
+        if (take_request(req)) {
+            handle_request(std::move(req));
+            return;
+        }
     } catch (RBException &e) {
         RBLog("Server >> RBProto failure: " + e.getMsg(), LogLevel::ERROR);
-    } catch (std::exception &e) {
-        RBLog("Server >> RBProto failure: " + std::string(e.what()), LogLevel::ERROR);
+        close();
+        return;
     }
+
+    asio::async_read(*sock, in_buf, asio::transfer_at_least(missing),
+        asio::bind_executor(strand, [self = shared_from_this()](const system::error_code &ec, size_t) {
+            if (ec) {
+                if (ec != asio::error::eof && ec != asio::error::operation_aborted)
+                    RBLog("Server >> RBProto failure: " + ec.message(), LogLevel::ERROR);
+                self->close();
+                return;
+            }
+            self->read_request();
+        }));
+}
+
+void Service::handle_request(RBRequest req) {
+    asio::post(disk_pool, [self = shared_from_this(), req = std::move(req)]() mutable {
+        // a connection handles a request at a time, its buffer is free until the response is written
+        auto &out = self->out_buf;
+        out.clear();
+        try {
+            RBResponse res = self->callback(req, self);
+            // requests are answered in order, seq lets pipelining clients check it
+            res.set_seq(req.seq());
+
+            if (!google::protobuf::io::serializeDelimited(res, &out))
+                throw RBException("response_send_fail");
+        } catch (RBException &e) {
+            RBLog("Server >> RBProto failure: " + e.getMsg(), LogLevel::ERROR);
+            asio::post(self->strand, [self]() { self->close(); });
+            return;
+        } catch (std::exception &e) {
+            RBLog("Server >> RBProto failure: " + std::string(e.what()), LogLevel::ERROR);
+            asio::post(self->strand, [self]() { self->close(); });
+            return;
+        }
+
+        bool final = req.final();
+        asio::post(self->strand, [self, final]() { self->write_response(final); });
+    });
+}
+
+void Service::write_response(bool final) {
+    asio::async_write(*sock, asio::buffer(out_buf),
+        asio::bind_executor(strand, [self = shared_from_this(), final](const system::error_code &ec, size_t) {
+            if (ec) {
+                RBLog("Server >> RBProto failure: " + ec.message(), LogLevel::ERROR);
+                self->close();
+            } else if (final) {
+                self->close();
+            } else {
+                self->read_request();
+            }
+        }));
+}
+
+void Service::close() {
+    system::error_code ec;
+    sock->shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+    sock->close(ec);
 }
 
 using asio::ip::tcp;
 
-Server::Server(unsigned short port_num, int n_workers, const RBSrvCallback & callback)
-    : port(port_num), running(true), callback(callback), n_workers(n_workers),
-    tcp_acceptor(ios, tcp::endpoint(tcp::v4(), port)){
+Server::Server(unsigned short port_num, int n_io_threads, int n_workers, const RBSrvCallback & callback)
+    : port(port_num), running(true), work(asio::make_work_guard(ios)),
+    tcp_acceptor(ios, tcp::endpoint(tcp::v4(), port)), callback(callback),
+    n_io_threads(n_io_threads), disk_pool(n_workers), n_workers(n_workers) {
         RBLog("Server(" + std::to_string(port) + ")", LogLevel::DEBUG);
     }
 
 void Server::start() {
-    thread_ptr.reset(new std::thread([this]() { run(); }));
-    RBLog("Server >> Starting " + std::to_string(n_workers) + " workers...", LogLevel::INFO);
-    for (int i = 0; i < n_workers; i++) {
-        workers.emplace_back([this]() {
-            while(running) {
-                std::unique_lock ul(req_mutex);
-                req_cv.wait(ul, [this]() { return requests.size() > 0 || !running; });
-                if (!running) return;
-                auto svc = requests.front();
-                requests.pop_front();
-                ul.unlock();
-                svc->handle_request();
+    RBLog("Server >> Starting " + std::to_string(n_io_threads) + " io threads and " +
+          std::to_string(n_workers) + " workers...", LogLevel::INFO);
+    accept();
+    for (int i = 0; i < n_io_threads; i++) {
+        io_threads.emplace_back([this]() {
+            try {
+                ios.run();
+            } catch (std::exception &e) {
+                RBLog("SERVER >> std::exception in io thread: " + std::string(e.what()), LogLevel::ERROR);
             }
         });
     }
-    RBLog("Server >> Workers ready!", LogLevel::INFO);
+    RBLog("SERVER >> Server started", LogLevel::INFO);
 }
 
 void Server::stop() {
     if (!running) return;
     running = false;
-    
-    asio::io_service ios2;
-    tcp::endpoint ep(asio::ip::address::from_string("127.0.0.1"), port);
-    tcp::socket sock(ios2, tcp::v4());
-    try {
-        RBLog("SERVER >> Self-connecting to wake acceptor... (" + std::to_string(port) + ")", LogLevel::DEBUG);
-        sock.connect(ep);
-    } catch(std::exception &e) {
-        RBLog("SERVER >> FAILED!", LogLevel::ERROR);
-    }
-    thread_ptr->join();
-    RBLog("SERVER >> Acceptor thread joined.", LogLevel::DEBUG);
+
+    asio::post(ios, [this]() {
+        system::error_code ec;
+        tcp_acceptor.close(ec);
+    });
+    work.reset();
+    ios.stop();
+    for (auto & t : io_threads) t.join();
+    RBLog("SERVER >> IO threads joined.", LogLevel::DEBUG);
     RBLog("SERVER >> Waiting for workers to terminate...", LogLevel::INFO);
-    req_cv.notify_all();
-    for (auto & w : workers) {
-        try {
-            w.join();
-        } catch (RBException &e) {
-            RBLog("SERVER >> RBException while joining worker: " + e.getMsg(), LogLevel::ERROR);
-        } catch (std::exception &e) {
-            RBLog("SERVER >> std::exception while joining worker: " + std::string(e.what()), LogLevel::ERROR);
-        }
-    }
+    disk_pool.join();
 }
 
-void Server::run() {
-    RBLog("SERVER >> Server started", LogLevel::INFO);
-    while (running) {
-        sockPtr_t sock(new asio::ip::tcp::socket(ios));
-        tcp_acceptor.accept(*sock); // This function blocks until a connection has been accepted
-        if (running) {
-            std::lock_guard lg(req_mutex);
-            requests.emplace_back(Service::create(sock, callback));
-            req_cv.notify_all();
-        } else sock->close();
-    }
+void Server::accept() {
+    auto sock = std::make_shared<tcp::socket>(ios);
+    tcp_acceptor.async_accept(*sock, [this, sock](const system::error_code &ec) {
+        if (!running) return;
+        if (!ec)
+            Service::create(sock, callback, disk_pool)->start();
+        else
+            RBLog("SERVER >> accept failed: " + ec.message(), LogLevel::ERROR);
+        accept();
+    });
 }
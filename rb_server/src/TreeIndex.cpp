@@ -0,0 +1,253 @@
+#include "TreeIndex.h"
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+namespace {
+
+// Fills the metadata of a fs row as PROBE does: missing values are 0
+void set_metadata(const DbRow& row, RBFileMetadata& meta) {
+    if (!row.is_empty(1))
+        meta.set_checksum(row.int64(1));
+    if (!row.is_empty(2))
+        meta.set_last_write_time(row.int64(2));
+    if (!row.is_empty(3))
+        meta.set_size(row.int64(3));
+}
+
+tree_hash row_entry_hash(const DbRow& row) {
+    RBFileMetadata meta;
+    set_metadata(row, meta);
+    return file_entry_hash(base_name(row.text(0)), meta.checksum(), meta.size());
+}
+
+}
+
+TreeIndex::TreeIndex(size_t max_trees, std::chrono::seconds idle_timeout)
+    : max_trees(max_trees), idle_timeout(idle_timeout) {
+    watchdog = make_watchdog(idle_timeout,
+        [this]() { return keep_going.load(); },
+        [this]() { drop_idle(); }
+    );
+}
+
+TreeIndex::~TreeIndex() {
+    keep_going = false;
+    watchdog.join();
+}
+
+void TreeIndex::touch(const std::string& username, const std::string& normal_path) {
+    std::lock_guard<std::mutex> lg(mutex);
+    auto it = trees.find(username);
+    // a tree that isn't there yet reads the change when it's loaded
+    if (it == trees.end()) return;
+    it->second->changed.emplace(parent_dir(normal_path));
+}
+
+void TreeIndex::compare(const std::string& username, const RBTreeRequest& req, RBTreeResponse& res) {
+    auto user = use(username);
+    std::lock_guard<std::mutex> lg(user->mutex);
+    // the writes after the tree has been added are marked, the ones before are read by load
+    if (!user->loaded)
+        load(username, *user);
+    std::unordered_set<std::string> changed;
+    {
+        std::lock_guard<std::mutex> ilg(mutex);
+        changed.swap(user->changed);
+    }
+    refresh(username, *user, changed);
+
+    // entries left in the response, the listings after it's full are sent empty with more set
+    size_t budget = RB_TREE_RESPONSE_MAX_ENTRIES;
+    for (auto& client_dir : req.dirs()) {
+        auto dir = user->tree.find(client_dir.path());
+        tree_hash summary = dir ? dir->summary : tree_hash();
+        if (summary == tree_hash::from_bytes(client_dir.hash()))
+            continue;
+
+        auto listing = res.add_listings();
+        listing->set_path(client_dir.path());
+        if (!dir) continue;
+
+        // the subdirectories and the files after the cursor, merged by name
+        auto subdir = dir->subdirs.upper_bound(client_dir.after());
+        auto add_subdirs = [&](std::string_view until) {
+            for (; subdir != dir->subdirs.end() && (until.empty() || *subdir < until); subdir++) {
+                if (budget == 0) return false;
+                auto path = child_path(client_dir.path(), *subdir);
+                auto entry = listing->add_dirs();
+                entry->set_hash(user->tree.find(path)->summary.bytes());
+                entry->set_path(std::move(path));
+                budget--;
+            }
+            return true;
+        };
+        bool full = budget == 0;
+        if (!full)
+            each_file(username, client_dir.path(), *dir, client_dir.after(), [&](const DbRow& row) {
+                auto path = row.text(0);
+                if (!add_subdirs(base_name(path)) || budget == 0) {
+                    full = true;
+                    return false;
+                }
+                auto entry = listing->add_files();
+                entry->set_path(path.data(), path.size());
+                set_metadata(row, *entry->mutable_metadata());
+                budget--;
+                return true;
+            });
+        if (full || !add_subdirs({}))
+            listing->set_more(true);
+    }
+}
+
+void TreeIndex::clear() {
+    std::lock_guard<std::mutex> lg(mutex);
+    trees.clear();
+    lru.clear();
+}
+
+std::shared_ptr<TreeIndex::user_tree> TreeIndex::use(const std::string& username) {
+    std::lock_guard<std::mutex> lg(mutex);
+    auto& slot = trees[username];
+    if (slot)
+        lru.erase(slot->lru_it);
+    else
+        slot = std::make_shared<user_tree>();
+    lru.push_front(username);
+    slot->lru_it = lru.begin();
+    slot->last_use = clock::now();
+    auto user = slot;
+
+    // the least recently used trees no comparison is holding
+    auto it = lru.end();
+    while (trees.size() > max_trees && it != lru.begin()) {
+        auto tree = trees.find(*--it);
+        if (tree->second.use_count() > 1) continue;
+        trees.erase(tree);
+        it = lru.erase(it);
+    }
+    return user;
+}
+
+void TreeIndex::drop_idle() {
+    std::lock_guard<std::mutex> lg(mutex);
+    auto expiry = clock::now() - idle_timeout;
+    size_t dropped = 0;
+    while (!lru.empty() && trees.at(lru.back())->last_use < expiry) {
+        trees.erase(lru.back());
+        lru.pop_back();
+        dropped++;
+    }
+    if (dropped)
+        RBLog("TreeIndex >> Dropped " + std::to_string(dropped) + " idle trees", LogLevel::INFO);
+}
+
+void TreeIndex::load(const std::string& username, user_tree& user) {
+    scan(username, "", "", [&](const DbRow& row) {
+        RBFileMetadata meta;
+        set_metadata(row, meta);
+        user.tree.add_file(row.text(0), meta.checksum(), meta.size());
+        return true;
+    });
+    user.tree.sum_all();
+    user.loaded = true;
+    RBLog("TreeIndex >> Loaded the tree of <" + username + ">");
+}
+
+void TreeIndex::refresh(const std::string& username, user_tree& user, const std::unordered_set<std::string>& changed) {
+    if (changed.empty()) return;
+
+    // the changed directories and the ones above them, the deepest first
+    std::set<std::string> affected;
+    for (auto& path : changed) {
+        user.tree.add_dir(path);
+        std::string_view dir = path;
+        while (affected.insert(std::string(dir)).second && !dir.empty())
+            dir = parent_dir(dir);
+    }
+    std::vector<std::string> order(affected.begin(), affected.end());
+    std::stable_sort(order.begin(), order.end(), [](const std::string& a, const std::string& b) {
+        return dir_depth(a) > dir_depth(b);
+    });
+
+    for (auto& path : order) {
+        auto dir = user.tree.find(path);
+        if (!dir) continue;
+
+        if (changed.count(path)) {
+            dir->files = tree_hash();
+            dir->file_count = 0;
+            each_file(username, path, *dir, "", [&](const DbRow& row) {
+                dir->files.add(row_entry_hash(row));
+                dir->file_count++;
+                return true;
+            });
+        }
+        // a directory left empty isn't an entry of its parent anymore
+        if (!path.empty() && dir->file_count == 0 && dir->subdirs.empty())
+            user.tree.remove_dir(path);
+        else
+            user.tree.sum(path);
+    }
+}
+
+bool TreeIndex::each_file(const std::string& username, const std::string& path, const DirTree::dir_node& dir,
+                          const std::string& after, const file_visitor_t& visit) {
+    // The paths in the directory sort between prefix and path + "0", '0' following '/', and the
+    // ones in a subdirectory between prefix + name + "/" and prefix + name + "0": the files
+    // directly in it are in the gaps between the subdirectories
+    std::string prefix = path.empty() ? "" : path + "/";
+    auto in_gap = [&](const DbRow& row) {
+        // a file in a directory not touched yet, it's read again after its touch
+        if (row.text(0).find('/', prefix.size()) != std::string_view::npos)
+            return true;
+        return visit(row);
+    };
+
+    // the first path after prefix + after, "\0" being the smallest character
+    std::string from = prefix + after;
+    if (!after.empty()) from.push_back('\0');
+    for (auto& name : dir.subdirs) {
+        std::string to = prefix + name + "/";
+        std::string end = prefix + name + "0";
+        if (end <= from) continue;
+        if (from < to && !scan(username, from, to, in_gap))
+            return false;
+        from = std::move(end);
+    }
+    return scan(username, from, path.empty() ? "" : path + "0", in_gap);
+}
+
+bool TreeIndex::scan(const std::string& username, std::string from, const std::string& to,
+                     const file_visitor_t& visit) {
+    auto& db = Database::get_instance();
+    std::string sql = to.empty()
+        ? "SELECT path, hash, last_write_time, size FROM fs WHERE username = ? AND path >= ? "
+          "ORDER BY path LIMIT ?;"
+        : "SELECT path, hash, last_write_time, size FROM fs WHERE username = ? AND path >= ? AND path < ? "
+          "ORDER BY path LIMIT ?;";
+    int64_t limit = RB_TREE_SCAN_ROWS;
+
+    while (true) {
+        int64_t rows = 0;
+        bool stopped = false;
+        std::string last;
+        auto each_row = [&](const DbRow& row) {
+            rows++;
+            last = row.text(0);
+            if (!stopped && !visit(row))
+                stopped = true;
+        };
+        // on the writer connection, the tree has to see every write touch is called after
+        if (to.empty())
+            db.query_each(sql, {username, from, limit}, each_row);
+        else
+            db.query_each(sql, {username, from, to, limit}, each_row);
+
+        if (stopped) return false;
+        if (rows < limit) return true;
+        from = last + '\0';
+    }
+}
@@ -0,0 +1,234 @@
+#include "WriteEngine.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+// Errors of the file system that mean the upload can't fit
+static void throw_write_error(const fs::path &path, int error) {
+    if (error == ENOSPC || error == EDQUOT) {
+        RBLog("WriteEngine >> No space left for " + path.string(), LogLevel::ERROR);
+        throw RBException("insufficient_storage");
+    }
+    RBLog("WriteEngine >> Cannot write file " + path.string() + ": " + std::strerror(error), LogLevel::ERROR);
+    throw RBException("internal_server_error");
+}
+
+WriteSession::WriteSession(int fd, const fs::path &path, uint64_t end)
+    : fd(fd), path(path), end(end) {}
+
+WriteSession::~WriteSession() {
+    ::close(fd);
+}
+
+void WriteSession::write_at(uint64_t offset, const char *data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        auto res = ::pwrite(fd, data + written, size - written, offset + written);
+        if (res < 0 && errno == EINTR) continue;
+        if (res <= 0) throw_write_error(path, res < 0 ? errno : EIO);
+        written += res;
+    }
+    hash_written(offset, data, size);
+}
+
+void WriteSession::hash_written(uint64_t offset, const char *data, size_t size) {
+    std::lock_guard<std::mutex> lg(hash_mutex);
+    if (!hashing || size == 0) return;
+    // a range written again can't be checksummed in order anymore
+    if (offset < hashed) {
+        stop_hashing_locked();
+        return;
+    }
+    if (offset > hashed || !data) {
+        written_ahead[offset] = size;
+    } else {
+        crc.process_bytes(data, size);
+        sha.process_bytes(data, size);
+        hashed += size;
+    }
+
+    // the ranges written ahead that are next are read back
+    std::vector<char> buffer;
+    for (auto it = written_ahead.begin(); it != written_ahead.end() && it->first <= hashed;
+         it = written_ahead.erase(it)) {
+        if (it->first < hashed) {
+            stop_hashing_locked();
+            return;
+        }
+        buffer.resize(std::min<uint64_t>(it->second, RB_MAX_SEGMENT_SIZE));
+        for (uint64_t pos = it->first; pos < it->first + it->second;) {
+            auto res = ::pread(fd, &buffer[0], std::min<uint64_t>(buffer.size(), it->first + it->second - pos), pos);
+            if (res < 0 && errno == EINTR) continue;
+            if (res <= 0) {
+                RBLog("WriteEngine >> Cannot read back " + path.string(), LogLevel::ERROR);
+                stop_hashing_locked();
+                return;
+            }
+            crc.process_bytes(&buffer[0], res);
+            sha.process_bytes(&buffer[0], res);
+            pos += res;
+        }
+        hashed += it->second;
+    }
+}
+
+bool WriteSession::digests(uint64_t size, uint32_t &checksum, std::string &sha256) {
+    std::lock_guard<std::mutex> lg(hash_mutex);
+    if (!hashing || hashed != size || !written_ahead.empty()) return false;
+    checksum = crc.checksum();
+    sha256 = sha.digest();
+    hashing = false;
+    return true;
+}
+
+void WriteSession::rehash(uint64_t size) {
+    hash_written(0, nullptr, size);
+}
+
+void WriteSession::stop_hashing() {
+    std::lock_guard<std::mutex> lg(hash_mutex);
+    stop_hashing_locked();
+}
+
+void WriteSession::stop_hashing_locked() {
+    hashing = false;
+    written_ahead.clear();
+}
+
+void WriteSession::append(const char *data, size_t size) {
+    write_at(end, data, size);
+    end += size;
+}
+
+std::streamsize WriteSession::xsputn(const char *s, std::streamsize n) {
+    append(s, n);
+    return n;
+}
+
+WriteSession::int_type WriteSession::overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    char ch = traits_type::to_char_type(c);
+    append(&ch, 1);
+    return c;
+}
+
+WriteEngine::WriteEngine(size_t max_sessions, std::chrono::seconds idle_timeout)
+    : max_sessions(max_sessions), idle_timeout(idle_timeout) {
+    watchdog = make_watchdog(idle_timeout,
+        [this]() { return keep_going.load(); },
+        [this]() { close_idle(); }
+    );
+}
+
+WriteEngine::~WriteEngine() {
+    keep_going = false;
+    watchdog.join();
+}
+
+std::shared_ptr<WriteSession> WriteEngine::start(const std::string &key, const fs::path &path, uint64_t size) {
+    // a new file replaces the old one, which can be a link to an object of the store
+    if (::unlink(path.c_str()) < 0 && errno != ENOENT)
+        throw_write_error(path, errno);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        RBLog("WriteEngine >> Cannot open file " + path.string(), LogLevel::ERROR);
+        throw RBException("internal_server_error");
+    }
+    auto session = std::make_shared<WriteSession>(fd, path, 0);
+
+    // the file size is kept, it grows as the segments are written
+    if (size > 0 && ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS)
+        throw_write_error(path, errno);
+
+    std::lock_guard<std::mutex> lg(mutex);
+    return insert(key, session);
+}
+
+std::shared_ptr<WriteSession> WriteEngine::resume(const std::string &key, const fs::path &path, bool contiguous,
+                                                  std::optional<uint64_t> size) {
+    std::unique_lock<std::mutex> ul(mutex);
+    auto it = sessions.find(key);
+    if (it != sessions.end() && it->second.session->get_path() == path) {
+        lru.splice(lru.begin(), lru, it->second.lru_it);
+        it->second.last_use = clock::now();
+        return it->second.session;
+    }
+
+    int fd = ::open(path.c_str(), O_RDWR);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) < 0) {
+        if (fd >= 0) ::close(fd);
+        RBLog("WriteEngine >> Cannot reopen file " + path.string(), LogLevel::ERROR);
+        throw RBException("internal_server_error");
+    }
+    // a file with other links is shared through the object store, it's never written in place
+    if (st.st_nlink > 1) {
+        ::close(fd);
+        RBLog("WriteEngine >> " + path.string() + " is a stored object, it can't be resumed", LogLevel::ERROR);
+        throw RBException("wrong_segment");
+    }
+    if (size && static_cast<uint64_t>(st.st_size) != *size) {
+        // a file shorter than its progress lost segments, the upload has to start over
+        if (static_cast<uint64_t>(st.st_size) < *size || ::ftruncate(fd, *size) < 0) {
+            ::close(fd);
+            RBLog("WriteEngine >> " + path.string() + " doesn't match its upload progress", LogLevel::ERROR);
+            throw RBException("wrong_segment");
+        }
+        st.st_size = *size;
+    }
+    RBLog("WriteEngine >> Reopened " + path.string());
+
+    // evicted sessions are resumed after what has been written so far
+    auto session = std::make_shared<WriteSession>(fd, path, st.st_size);
+    if (!contiguous)
+        session->stop_hashing();
+    insert(key, session);
+    ul.unlock();
+
+    // what the session is given meanwhile is checksummed after this
+    if (contiguous)
+        session->rehash(st.st_size);
+    return session;
+}
+
+std::shared_ptr<WriteSession> WriteEngine::insert(const std::string &key, std::shared_ptr<WriteSession> session) {
+    auto it = sessions.find(key);
+    if (it != sessions.end()) {
+        lru.erase(it->second.lru_it);
+        sessions.erase(it);
+    }
+    lru.push_front(key);
+    sessions[key] = {session, lru.begin(), clock::now()};
+    while (sessions.size() > max_sessions) {
+        sessions.erase(lru.back());
+        lru.pop_back();
+    }
+    return session;
+}
+
+void WriteEngine::finish(const std::string &key) {
+    std::lock_guard<std::mutex> lg(mutex);
+    auto it = sessions.find(key);
+    if (it == sessions.end()) return;
+    lru.erase(it->second.lru_it);
+    sessions.erase(it);
+}
+
+void WriteEngine::close_idle() {
+    std::lock_guard<std::mutex> lg(mutex);
+    auto expiry = clock::now() - idle_timeout;
+    size_t closed = 0;
+    while (!lru.empty() && sessions[lru.back()].last_use < expiry) {
+        sessions.erase(lru.back());
+        lru.pop_back();
+        closed++;
+    }
+    if (closed)
+        RBLog("WriteEngine >> Closed " + std::to_string(closed) + " idle upload sessions", LogLevel::INFO);
+}
@@ -1,10 +1,22 @@
 #include <iostream>
-#include <boost/asio.hpp>
 #include <fstream>
 #include <string>
 
 #include "ServerFlow.h"
 
+// Request handling mostly waits on the disk, so it gets more threads than there are cores
+#define RB_SERVER_WORKERS_PER_CORE 4
+// Read-only database connections, the database is in WAL mode so that reads don't wait
+// for the uploads' writes. 0 keeps a single connection with a rollback journal
+#define RB_DB_READERS 8
+// WAL commits are synced at checkpoints: the last ones can be lost on a power failure, not the consistency
+#define RB_DB_SYNCHRONOUS "NORMAL"
+// Pages the WAL grows to before it's written back to the database
+#define RB_DB_CHECKPOINT_PAGES 1000
+// Files are stored from the content another user uploaded given only its hash, size and checksum
+// (CAP_OBJECT_LINK). Off unless the users may get each other's contents knowing their hash
+#define RB_OBJECT_LINK_ENABLED false
+
 std::function<void(void)> sig_int_handler;
 
 void handle_sig_int(int n) {
@@ -14,11 +26,18 @@ void handle_sig_int(int n) {
 std::atomic<bool> keep_going = true;
 
 int main() {
+    RBLog("CONSOLE >> CRC32 kernel: " + std::string(crc32_kernel_name()), LogLevel::DEBUG);
 
+    // connections are served asynchronously, the workers only run the requests' disk work
     ServerFlow server_logic(
         8888,
         std::thread::hardware_concurrency(),
-        "./rbserver_data"
+        RB_SERVER_WORKERS_PER_CORE * std::thread::hardware_concurrency(),
+        "./rbserver_data",
+        RB_DB_READERS,
+        RB_DB_SYNCHRONOUS,
+        RB_DB_CHECKPOINT_PAGES,
+        RB_OBJECT_LINK_ENABLED
     );
     
     void (*original_sigint_handler)(int) = signal(SIGINT, handle_sig_int);